@@ -12,17 +12,19 @@
 // Includes                                                                   //
 //----------------------------------------------------------------------------//
 
+#ifndef LODDER_STANDALONE
 #include "StdAfx.h"
-#include "Exporter.h"
+#endif
 #include "Lodder.h"
 
-#include <stdexcept>
+#include <float.h>
+#include <math.h>
 
 //----------------------------------------------------------------------------//
 // Debug                                                                      //
 //----------------------------------------------------------------------------//
 
-#ifdef _DEBUG
+#if defined(_DEBUG) && !defined(LODDER_STANDALONE)
 #define new DEBUG_NEW
 #undef THIS_FILE
 static char THIS_FILE[] = __FILE__;
@@ -96,6 +98,7 @@ bool CLodder::AddVertex(const Vertex& vertex)
 	m_vectorVertex[vertexId].error = FLT_MAX;
 	m_vectorVertex[vertexId].bCollapsed = false;
 	m_vectorVertex[vertexId].bFreezed = false;
+	m_vectorVertex[vertexId].heapId = -1;
 
 	return true;
 }
@@ -106,25 +109,28 @@ bool CLodder::AddVertex(const Vertex& vertex)
 
 bool CLodder::CalculateLevels()
 {
-	//try {
 	// initialize all the vertex quadrics
-//    AfxMessageBox("CalculateAllQuadrics()", 0, 0 );
 	CalculateAllQuadrics();
 
 	// freeze the border vertices
-//	AfxMessageBox("FreezeBorders()", 0, 0 );
 	FreezeBorders();
 
-//	AfxMessageBox("1", 0, 0 );
-	// calculate the best edge collapse for every vertex
-	size_t vertexId;
-	for(vertexId = 0; vertexId < m_vectorVertex.size(); vertexId++)
+	// calculate the best edge collapse for every vertex, each vertex only
+	// writes its own collapse data, so this can be done in parallel
+	int vertexCount;
+	vertexCount = m_vectorVertex.size();
+
+	int parallelVertexId;
+#pragma omp parallel for schedule(dynamic, 256)
+	for(parallelVertexId = 0; parallelVertexId < vertexCount; parallelVertexId++)
 	{
 		// calculate the best edge collapse for the vertex
-		CalculateVertexCollapse(vertexId);
+		CalculateVertexCollapse(parallelVertexId);
 	}
 
-//	AfxMessageBox("2", 0, 0 );
+	// put all collapse candidates into the priority queue
+	BuildHeap();
+
 	// initialize the next vertex/face lod id
 	m_nextVertexLodId = m_vectorVertex.size() - 1;
 	m_nextFaceLodId = m_vectorFace.size() - 1;
@@ -134,38 +140,21 @@ bool CLodder::CalculateLevels()
 	{
 		// get the next vertex to collapse
 		int collapsingVertexId;
-		try
-		{
-    	collapsingVertexId = GetNextCollapsingVertexId();
-		}
-		catch(...)
-		{
-			AfxMessageBox("2.1!!!", 0, 0 );
-			throw;
-		}
-    	
+		collapsingVertexId = GetNextCollapsingVertexId();
+
 		// stop if there are no more edge collapses left
 		if(collapsingVertexId == -1) break;
 
 		// collapse the vertex
-		try
-		{
 		CollapseVertex(collapsingVertexId);
-		}
-		catch(...)
-		{
-			AfxMessageBox("2.2!!!", 0, 0 );
-			throw;
-		}
-    	
 	}
 
-//	AfxMessageBox("3", 0, 0 );
 	// assign the lod ids to all unassigned vertices and faces
 	m_nextVertexLodId = 0;
 	m_nextFaceLodId = 0;
 
 	// set all lod ids of the unassigned vertices
+	size_t vertexId;
 	for(vertexId = 0; vertexId < m_vectorVertex.size(); vertexId++)
 	{
 		if(m_vectorVertex[vertexId].lodId == -1)
@@ -175,7 +164,6 @@ bool CLodder::CalculateLevels()
 		}
 	}
 
-//	AfxMessageBox("4", 0, 0 );
 	// transform the collapse ids of the vertices to the lod ids
 	for(vertexId = 0; vertexId < m_vectorVertex.size(); vertexId++)
 	{
@@ -185,7 +173,6 @@ bool CLodder::CalculateLevels()
 		}
 	}
 
-//	AfxMessageBox("5", 0, 0 );
 	// set all lod ids of the unassigned faces
 	for(size_t faceId = 0; faceId < m_vectorFace.size(); faceId++)
 	{
@@ -194,19 +181,7 @@ bool CLodder::CalculateLevels()
 
 	// store the lod count
 	m_lodCount = m_vectorVertex.size() - m_nextVertexLodId;
-//	AfxMessageBox("6", 0, 0 );
-	/*}
-	catch (std::exception& e)
-	{
-		AfxMessageBox(e.what(), 0, 0 );
-		throw e;
-	}
-	catch ()
-	{
-		AfxMessageBox("!!!", 0, 0 );
-		throw;
-	}*/
-	
+
 	return true;
 }
 
@@ -216,8 +191,18 @@ bool CLodder::CalculateLevels()
 
 void CLodder::CalculateAllQuadrics()
 {
+	// the face quadrics are calculated in parallel first and then summed up
+	// per vertex in ascending face order, so the result does not depend on
+	// the number of threads
+	int faceCount;
+	faceCount = m_vectorFace.size();
+
+	std::vector<CQuadric> vectorFaceQuadric(faceCount);
+
 	// loop through all the faces
-	for(size_t faceId = 0; faceId < m_vectorFace.size(); faceId++)
+	int faceId;
+#pragma omp parallel for schedule(static)
+	for(faceId = 0; faceId < faceCount; faceId++)
 	{
 		// get the face
 		Face& face = m_vectorFace[faceId];
@@ -265,10 +250,33 @@ void CLodder::CalculateAllQuadrics()
 		// scale the quadric with the area
 		q.Scale(area);
 
-		// add the quadric to each face vertex
-		m_vectorVertex[face.vertexId[0]].quadric.Add(q);
-		m_vectorVertex[face.vertexId[1]].quadric.Add(q);
-		m_vectorVertex[face.vertexId[2]].quadric.Add(q);
+		// store the quadric of the face
+		vectorFaceQuadric[faceId].Set(q);
+	}
+
+	// loop through all the vertices
+	int vertexCount;
+	vertexCount = m_vectorVertex.size();
+
+	int vertexId;
+#pragma omp parallel for schedule(dynamic, 256)
+	for(vertexId = 0; vertexId < vertexCount; vertexId++)
+	{
+		// get the vertex
+		Vertex& vertex = m_vectorVertex[vertexId];
+
+		// add the quadric of each vertex face to the vertex
+		std::set<int>::iterator iteratorFaceId;
+		for(iteratorFaceId = vertex.setFaceId.begin(); iteratorFaceId != vertex.setFaceId.end(); ++iteratorFaceId)
+		{
+			// get the face
+			Face& face = m_vectorFace[*iteratorFaceId];
+
+			// a degenerated face adds its quadric once for every occurrence of the vertex
+			if(face.vertexId[0] == vertexId) vertex.quadric.Add(vectorFaceQuadric[*iteratorFaceId]);
+			if(face.vertexId[1] == vertexId) vertex.quadric.Add(vectorFaceQuadric[*iteratorFaceId]);
+			if(face.vertexId[2] == vertexId) vertex.quadric.Add(vectorFaceQuadric[*iteratorFaceId]);
+		}
 	}
 }
 
@@ -376,6 +384,7 @@ void CLodder::CalculateVertexCollapse(int vertexId)
 	{
 		// vertex can be eliminated without error
 		vertex.error = -1.0f;
+		HeapUpdate(vertexId);
 		return;
 	}
 
@@ -395,12 +404,13 @@ void CLodder::CalculateVertexCollapse(int vertexId)
 		}
 	}
 
+	// move the vertex to its new position in the priority queue
+	HeapUpdate(vertexId);
 }
 
 //----------------------------------------------------------------------------//
 // Collapse the given vertex                                                  //
 //----------------------------------------------------------------------------//
-#define CHECK(a, x) x //try { x } catch (...) { AfxMessageBox( a, 0, 0 ); throw; }
 
 void CLodder::CollapseVertex(int vertexId)
 {
@@ -411,39 +421,34 @@ void CLodder::CollapseVertex(int vertexId)
 	vertex.lodId = m_nextVertexLodId--;
 	vertex.bCollapsed = true;
 
-	// we will store all modified vertices, so their error can be recalculated
-	std::set<int> setModifiedVertexId;
+	// the vertex is no longer a collapse candidate
+	HeapRemove(vertexId);
 
-	try {
-		// adjust the vertex quadric
-		vertex.quadric.Add(m_vectorVertex[vertex.collapseId].quadric);
-	}
-	catch ( ... )
-	{
-		//char buf[ 1024 ];
+	// an isolated vertex has no target to collapse to
+	if(vertex.collapseId == -1) return;
 
-		//sprintf( buf, "%d", vertex.collapseId );// = -1
-		//AfxMessageBox( buf, 0, 0 );
+	// we will store all modified vertices, so their error can be recalculated
+	std::set<int> setModifiedVertexId;
 
-		return;//throw;
-	}
+	// adjust the vertex quadric
+	vertex.quadric.Add(m_vectorVertex[vertex.collapseId].quadric);
 
 	std::set<int>::iterator iteratorFaceId;
-	
-	CHECK( "1",
+
 	// delete all faces with the collapsing edge
 	for(iteratorFaceId = vertex.setFaceId.begin(); iteratorFaceId != vertex.setFaceId.end(); )
 	{
+		// get the face id, advance first since the face may be erased from the set
+		int faceId;
+		faceId = *iteratorFaceId;
+		++iteratorFaceId;
+
 		// get the face
-		Face& face = m_vectorFace[*iteratorFaceId];
+		Face& face = m_vectorFace[faceId];
 
 		// check if the face contains the collapsing edge
 		if((face.vertexId[0] == vertex.collapseId) || (face.vertexId[1] == vertex.collapseId) || (face.vertexId[2] == vertex.collapseId))
 		{
-			// get the face id
-			int faceId;
-			faceId = *iteratorFaceId;
-
 			// erase the face from all the face vertices
 			m_vectorVertex[face.vertexId[0]].setFaceId.erase(faceId);
 			setModifiedVertexId.insert(face.vertexId[0]);
@@ -459,18 +464,9 @@ void CLodder::CollapseVertex(int vertexId)
 
 			// the collapsing vertex has killed another face
 			vertex.faceCollapseCount++;
-
-			// start checking from the beginning (TODO: optimize)
-			iteratorFaceId = vertex.setFaceId.begin();
 		}
-		else
-		{
-			 ++iteratorFaceId;
-		}
-	});
-
+	}
 
-	CHECK( "2",
 	// update all remaining faces with the new collapsed vertex
 	for(iteratorFaceId = vertex.setFaceId.begin(); iteratorFaceId != vertex.setFaceId.end(); ++iteratorFaceId)
 	{
@@ -486,10 +482,7 @@ void CLodder::CollapseVertex(int vertexId)
 		m_vectorVertex[vertex.collapseId].setFaceId.insert(*iteratorFaceId);
 	}
 	vertex.setFaceId.clear();
-	);
 
-
-	CHECK( "3",
 	// remove the vertex from all its neighbours
 	std::set<int>::iterator iteratorNeighbourId;
 	for(iteratorNeighbourId = vertex.setNeighbourId.begin(); iteratorNeighbourId != vertex.setNeighbourId.end(); ++iteratorNeighbourId)
@@ -507,9 +500,7 @@ void CLodder::CollapseVertex(int vertexId)
 		}
 	}
 	vertex.setNeighbourId.clear();
-	);
 
-	CHECK( "4",
 	// do not recalculate edge collapse on collapsed vertex 
 	setModifiedVertexId.erase(vertexId);
 
@@ -523,7 +514,6 @@ void CLodder::CollapseVertex(int vertexId)
 		// calculate the new vertex collapse
 		CalculateVertexCollapse(*iteratorModifiedVertexId);
 	}
-	)
 }
 
 //----------------------------------------------------------------------------//
@@ -535,7 +525,7 @@ bool CLodder::Create(int vertexCount, int faceCount)
 	// check if vertex and face numbers are valid
 	if((vertexCount <= 0) || (faceCount <= 0))
 	{
-		theExporter.SetLastError("Invalid number of vertices/faces for LOD!", __FILE__, __LINE__);
+		m_strLastError = "Invalid number of vertices/faces for LOD!";
 		return false;
 	}
 
@@ -631,6 +621,15 @@ int CLodder::GetFaceLodId(int faceId)
 	return m_vectorFace[faceId].lodId;
 }
 
+//----------------------------------------------------------------------------//
+// Get the text of the last error                                             //
+//----------------------------------------------------------------------------//
+
+const std::string& CLodder::GetLastError()
+{
+	return m_strLastError;
+}
+
 //----------------------------------------------------------------------------//
 // Get the number of LOD steps                                                //
 //----------------------------------------------------------------------------//
@@ -646,26 +645,165 @@ int CLodder::GetLodCount()
 
 int CLodder::GetNextCollapsingVertexId()
 {
-	// initialize the error
-	float error;
-	error = FLT_MAX;
+	// check if there are any candidates left
+	if(m_vectorHeap.empty()) return -1;
 
-	// initialize the collapsing vertex id
+	// the best candidate is on top of the priority queue
 	int collapsingVertexId;
-	collapsingVertexId = -1;
+	collapsingVertexId = m_vectorHeap[0];
 
-	// loop through all the vertices
+	// vertices without a valid edge collapse can not be collapsed
+	if(!(m_vectorVertex[collapsingVertexId].error < FLT_MAX)) return -1;
+
+	return collapsingVertexId;
+}
+
+//----------------------------------------------------------------------------//
+// Build the priority queue of all the collapse candidates                    //
+//----------------------------------------------------------------------------//
+
+void CLodder::BuildHeap()
+{
+	m_vectorHeap.clear();
+	m_vectorHeap.reserve(m_vectorVertex.size());
+
+	// insert all vertices that can be collapsed
 	for(size_t vertexId = 0; vertexId < m_vectorVertex.size(); vertexId++)
 	{
-		// check if we found a better edge collapse
-		if(!m_vectorVertex[vertexId].bCollapsed && !m_vectorVertex[vertexId].bFreezed && (m_vectorVertex[vertexId].error < error))
+		Vertex& vertex = m_vectorVertex[vertexId];
+
+		if(!vertex.bCollapsed && !vertex.bFreezed)
 		{
-			collapsingVertexId = vertexId;
-			error = m_vectorVertex[vertexId].error;
+			vertex.heapId = m_vectorHeap.size();
+			m_vectorHeap.push_back(vertexId);
 		}
 	}
 
-	return collapsingVertexId;
+	// restore the heap property bottom-up
+	int heapId;
+	for(heapId = int(m_vectorHeap.size()) / 2 - 1; heapId >= 0; heapId--)
+	{
+		HeapSiftDown(heapId);
+	}
+}
+
+//----------------------------------------------------------------------------//
+// Compare two collapse candidates                                            //
+//----------------------------------------------------------------------------//
+
+bool CLodder::HeapLess(int vertexId1, int vertexId2)
+{
+	float error1, error2;
+	error1 = m_vectorVertex[vertexId1].error;
+	error2 = m_vectorVertex[vertexId2].error;
+
+	// equal errors are ordered by vertex id, so the lowest id wins like in a linear scan
+	if(error1 < error2) return true;
+	if(error2 < error1) return false;
+	return vertexId1 < vertexId2;
+}
+
+//----------------------------------------------------------------------------//
+// Remove a given vertex from the priority queue                              //
+//----------------------------------------------------------------------------//
+
+void CLodder::HeapRemove(int vertexId)
+{
+	int heapId;
+	heapId = m_vectorVertex[vertexId].heapId;
+
+	// check if the vertex is in the priority queue at all
+	if(heapId == -1) return;
+
+	// move the last candidate into the free slot
+	int lastVertexId;
+	lastVertexId = m_vectorHeap.back();
+	m_vectorHeap.pop_back();
+	m_vectorVertex[vertexId].heapId = -1;
+
+	if(lastVertexId != vertexId)
+	{
+		m_vectorHeap[heapId] = lastVertexId;
+		m_vectorVertex[lastVertexId].heapId = heapId;
+
+		HeapSiftUp(heapId);
+		HeapSiftDown(m_vectorVertex[lastVertexId].heapId);
+	}
+}
+
+//----------------------------------------------------------------------------//
+// Move a candidate down in the priority queue                                //
+//----------------------------------------------------------------------------//
+
+void CLodder::HeapSiftDown(int heapId)
+{
+	int heapSize;
+	heapSize = m_vectorHeap.size();
+
+	int vertexId;
+	vertexId = m_vectorHeap[heapId];
+
+	while(true)
+	{
+		// find the better child
+		int childHeapId;
+		childHeapId = 2 * heapId + 1;
+		if(childHeapId >= heapSize) break;
+
+		if((childHeapId + 1 < heapSize) && HeapLess(m_vectorHeap[childHeapId + 1], m_vectorHeap[childHeapId])) childHeapId++;
+
+		// stop if the candidate is already better than its children
+		if(!HeapLess(m_vectorHeap[childHeapId], vertexId)) break;
+
+		m_vectorHeap[heapId] = m_vectorHeap[childHeapId];
+		m_vectorVertex[m_vectorHeap[heapId]].heapId = heapId;
+		heapId = childHeapId;
+	}
+
+	m_vectorHeap[heapId] = vertexId;
+	m_vectorVertex[vertexId].heapId = heapId;
+}
+
+//----------------------------------------------------------------------------//
+// Move a candidate up in the priority queue                                  //
+//----------------------------------------------------------------------------//
+
+void CLodder::HeapSiftUp(int heapId)
+{
+	int vertexId;
+	vertexId = m_vectorHeap[heapId];
+
+	while(heapId > 0)
+	{
+		// stop if the parent is better than the candidate
+		int parentHeapId;
+		parentHeapId = (heapId - 1) / 2;
+
+		if(!HeapLess(vertexId, m_vectorHeap[parentHeapId])) break;
+
+		m_vectorHeap[heapId] = m_vectorHeap[parentHeapId];
+		m_vectorVertex[m_vectorHeap[heapId]].heapId = heapId;
+		heapId = parentHeapId;
+	}
+
+	m_vectorHeap[heapId] = vertexId;
+	m_vectorVertex[vertexId].heapId = heapId;
+}
+
+//----------------------------------------------------------------------------//
+// Restore the priority queue after the error of a given vertex has changed   //
+//----------------------------------------------------------------------------//
+
+void CLodder::HeapUpdate(int vertexId)
+{
+	int heapId;
+	heapId = m_vectorVertex[vertexId].heapId;
+
+	// check if the vertex is in the priority queue at all
+	if(heapId == -1) return;
+
+	HeapSiftUp(heapId);
+	HeapSiftDown(m_vectorVertex[vertexId].heapId);
 }
 
 //----------------------------------------------------------------------------//
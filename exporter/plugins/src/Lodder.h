@@ -17,6 +17,10 @@
 
 #include "Quadric.h"
 
+#include <set>
+#include <string>
+#include <vector>
+
 //----------------------------------------------------------------------------//
 // Class declaration                                                          //
 //----------------------------------------------------------------------------//
@@ -38,6 +42,7 @@ public:
 		std::set<int> setFaceId;
 		bool bCollapsed;
 		bool bFreezed;
+		int heapId;
 	} Vertex;
 
 	typedef struct
@@ -50,6 +55,8 @@ public:
 protected:
 	std::vector<Vertex> m_vectorVertex;
 	std::vector<Face> m_vectorFace;
+	std::vector<int> m_vectorHeap;
+	std::string m_strLastError;
 	int m_nextVertexLodId;
 	int m_nextFaceLodId;
 	int m_lodCount;
@@ -66,6 +73,7 @@ public:
 	bool CalculateLevels();
 	bool Create(int vertexCount, int faceCount);
 	int GetFaceLodId(int faceId);
+	const std::string& GetLastError();
 	int GetLodCount();
 	int GetVertexCollapseId(int vertexId);
 	int GetVertexFaceCollapseCount(int vertexId);
@@ -78,6 +86,12 @@ protected:
 	void CollapseVertex(int vertexId);
 	void FreezeBorders();
 	int GetNextCollapsingVertexId();
+	void BuildHeap();
+	bool HeapLess(int vertexId1, int vertexId2);
+	void HeapRemove(int vertexId);
+	void HeapSiftDown(int heapId);
+	void HeapSiftUp(int heapId);
+	void HeapUpdate(int vertexId);
 
 	void Dump();
 };
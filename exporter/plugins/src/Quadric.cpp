@@ -12,14 +12,18 @@
 // Includes                                                                   //
 //----------------------------------------------------------------------------//
 
+#ifndef LODDER_STANDALONE
 #include "StdAfx.h"
+#endif
 #include "Quadric.h"
 
+#include <math.h>
+
 //----------------------------------------------------------------------------//
 // Debug                                                                      //
 //----------------------------------------------------------------------------//
 
-#ifdef _DEBUG
+#if defined(_DEBUG) && !defined(LODDER_STANDALONE)
 #define new DEBUG_NEW
 #undef THIS_FILE
 static char THIS_FILE[] = __FILE__;
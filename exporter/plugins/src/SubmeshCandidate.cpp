@@ -198,7 +198,11 @@ bool CSubmeshCandidate::CalculateLOD()
 {
   // create a lodder instance
   CLodder lodder;
-  if(!lodder.Create(m_vectorVertexCandidate.size(), m_vectorFace.size())) return false;
+  if(!lodder.Create(m_vectorVertexCandidate.size(), m_vectorFace.size()))
+  {
+    theExporter.SetLastError(lodder.GetLastError(), __FILE__, __LINE__);
+    return false;
+  }
 
   // add all vertices to the lodder
   size_t vertexCandidateId;
@@ -24,6 +24,9 @@
 #include "cal3d/coreskeleton.h"
 #include "cal3d/skeleton.h"
 
+#include <algorithm>
+#include <map>
+
 
  /*****************************************************************************/
 /** Constructs the hardware model instance.
@@ -602,14 +605,8 @@ bool CalHardwareModel::load(int baseVertexIndex, int startIndex,int maxBonesPerM
     }  
   } 
   
-  m_vectorVertexIndiceUsed.resize(1000000);
-//  m_vectorVertexIndiceUsed.resize(50000);
   int vertexCount=baseVertexIndex;
   int faceIndexCount = startIndex;
-        
-        // unused.
-  //CalCoreSkeleton * pCoreSkeleton = m_pCoreModel->getCoreSkeleton();
-  //std::vector< CalCoreBone *>& vectorBone = pCoreSkeleton->getVectorCoreBone();
 
   // if unspecified, fill with all core mesh ids
   if(m_coreMeshIds.empty())
@@ -617,6 +614,8 @@ bool CalHardwareModel::load(int baseVertexIndex, int startIndex,int maxBonesPerM
     for(int coreMeshId = 0; coreMeshId < m_pCoreModel->getCoreMeshCount(); coreMeshId++)
       m_coreMeshIds.push_back(coreMeshId);
   }
+
+  std::vector<int> vectorFacePartition;
     
   for(std::vector<int>::iterator meshIdIt = m_coreMeshIds.begin();meshIdIt != m_coreMeshIds.end(); meshIdIt++)
   {
@@ -628,70 +627,56 @@ bool CalHardwareModel::load(int baseVertexIndex, int startIndex,int maxBonesPerM
     {     
       CalCoreSubmesh *pCoreSubmesh = pCoreMesh->getCoreSubmesh(submeshId);
       
-      std::vector<CalCoreSubmesh::Vertex>& vectorVertex = pCoreSubmesh->getVectorVertex();
       std::vector<CalCoreSubmesh::Face>& vectorFace = pCoreSubmesh->getVectorFace();
-                        // unused.
-      //std::vector< std::vector<CalCoreSubmesh::TextureCoordinate> >& vectorTex = pCoreSubmesh->getVectorVectorTextureCoordinate();
-      
-      CalHardwareMesh hardwareMesh;
 
-      hardwareMesh.meshId = meshId;
-      hardwareMesh.submeshId = submeshId;
-      
-      hardwareMesh.baseVertexIndex=vertexCount;     
-      hardwareMesh.startIndex=faceIndexCount;
-      hardwareMesh.m_vectorBonesIndices.clear();          
-      
-      hardwareMesh.vertexCount=0;
-      hardwareMesh.faceCount=0;     
-      
-      int startIndex=hardwareMesh.startIndex;
-      
-      int faceId;     
-      for( faceId =0 ;faceId<pCoreSubmesh->getFaceCount();faceId++)
+      // the vertex remapping table only needs to cover this submesh
+      m_vectorVertexIndiceUsed.clear();
+      m_vectorVertexLocalIndice.assign(pCoreSubmesh->getVertexCount(), -1);
+
+      int partitionCount = partitionFaces(pCoreSubmesh, maxBonesPerMesh, vectorFacePartition);
+
+      int partitionId;
+      for(partitionId = 0; partitionId < partitionCount; partitionId++)
       {
-        if(canAddFace(hardwareMesh,vectorFace[faceId],vectorVertex,maxBonesPerMesh))
+        CalHardwareMesh hardwareMesh;
+
+        hardwareMesh.meshId = meshId;
+        hardwareMesh.submeshId = submeshId;
+      
+        hardwareMesh.baseVertexIndex=vertexCount;     
+        hardwareMesh.startIndex=faceIndexCount;
+        hardwareMesh.vertexCount=0;
+        hardwareMesh.faceCount=0;     
+
+        beginHardwareMesh(hardwareMesh);
+
+        int startIndex=hardwareMesh.startIndex;
+
+        // faces are emitted in their original order to keep the
+        // vertex cache locality of the exported mesh
+        int faceId;     
+        for( faceId =0 ;faceId<pCoreSubmesh->getFaceCount();faceId++)
         {
+          if(vectorFacePartition[faceId] != partitionId)
+            continue;
+
           m_pIndexBuffer[startIndex+hardwareMesh.faceCount*3]=   addVertex(hardwareMesh,vectorFace[faceId].vertexId[0],pCoreSubmesh,maxBonesPerMesh);
           m_pIndexBuffer[startIndex+hardwareMesh.faceCount*3+1]= addVertex(hardwareMesh,vectorFace[faceId].vertexId[1],pCoreSubmesh,maxBonesPerMesh);
           m_pIndexBuffer[startIndex+hardwareMesh.faceCount*3+2]= addVertex(hardwareMesh,vectorFace[faceId].vertexId[2],pCoreSubmesh,maxBonesPerMesh);
           hardwareMesh.faceCount++;
         }
-        else
-        {
-          vertexCount+=hardwareMesh.vertexCount;
-          faceIndexCount+=hardwareMesh.faceCount*3;
-          hardwareMesh.pCoreMaterial= m_pCoreModel->getCoreMaterial(pCoreSubmesh->getCoreMaterialThreadId());
-          
-          m_vectorHardwareMesh.push_back(hardwareMesh);
-          
-          hardwareMesh.baseVertexIndex=vertexCount;
-          hardwareMesh.startIndex=faceIndexCount;
-          
-          hardwareMesh.m_vectorBonesIndices.clear();
-          hardwareMesh.vertexCount=0; 
-          hardwareMesh.faceCount=0;
-          
-          startIndex=hardwareMesh.startIndex;
-          
-          m_pIndexBuffer[startIndex+hardwareMesh.faceCount*3]=   addVertex(hardwareMesh,vectorFace[faceId].vertexId[0],pCoreSubmesh,maxBonesPerMesh);
-          m_pIndexBuffer[startIndex+hardwareMesh.faceCount*3+1]= addVertex(hardwareMesh,vectorFace[faceId].vertexId[1],pCoreSubmesh,maxBonesPerMesh);
-          m_pIndexBuffer[startIndex+hardwareMesh.faceCount*3+2]= addVertex(hardwareMesh,vectorFace[faceId].vertexId[2],pCoreSubmesh,maxBonesPerMesh);
-          hardwareMesh.faceCount++;         
-        }
-      }
-      
-      vertexCount+=hardwareMesh.vertexCount;
-      faceIndexCount+=hardwareMesh.faceCount*3;
-      hardwareMesh.pCoreMaterial= m_pCoreModel->getCoreMaterial(pCoreSubmesh->getCoreMaterialThreadId());
-      
-      m_vectorHardwareMesh.push_back(hardwareMesh);
+
+        vertexCount+=hardwareMesh.vertexCount;
+        faceIndexCount+=hardwareMesh.faceCount*3;
+        hardwareMesh.pCoreMaterial= m_pCoreModel->getCoreMaterial(pCoreSubmesh->getCoreMaterialThreadId());
       
+        m_vectorHardwareMesh.push_back(hardwareMesh);
+      }
     }
   }
   
-    m_vectorVertexIndiceUsed.clear();
-
+  m_vectorVertexIndiceUsed.clear();
+  m_vectorVertexLocalIndice.clear();
 
   m_totalFaceCount=0;
   m_totalVertexCount=0;
@@ -707,50 +692,204 @@ bool CalHardwareModel::load(int baseVertexIndex, int startIndex,int maxBonesPerM
 }  
 
 
+/*****************************************************************************/
+/** Splits the faces of a submesh into hardware meshes.
+*
+* This function assigns every face of the submesh to a partition so that no
+* partition references more than maxBonesPerMesh bones. Faces are grouped by
+* the set of bones they reference and the groups are clustered greedily: each
+* partition is seeded with the group that has the most bones and is then grown
+* with the groups that add the fewest new bones to it. This keeps faces that
+* share bones (and hence vertices) together, which reduces both the number of
+* hardware meshes and the number of vertices duplicated on their borders.
+*
+* This clustering exists only in the cal3d bundled with osgCal; a stock
+* cal3d 0.11 fills hardware meshes greedily in face order.
+*
+* @param pCoreSubmesh The submesh to partition.
+* @param maxBonesPerMesh The maximum number of bones by hardware mesh
+* @param vectorFacePartition Receives the partition id of each face.
+*
+* @return The number of partitions.
+*****************************************************************************/
 
-bool CalHardwareModel::canAddFace(CalHardwareMesh &hardwareMesh, CalCoreSubmesh::Face & face,std::vector<CalCoreSubmesh::Vertex>& vectorVertex, int maxBonesPerMesh)
+int CalHardwareModel::partitionFaces(CalCoreSubmesh *pCoreSubmesh, int maxBonesPerMesh, std::vector<int>& vectorFacePartition)
 {
-  size_t boneCount=hardwareMesh.m_vectorBonesIndices.size();
-  
-  for(unsigned faceIndex=0;faceIndex<3;faceIndex++)
+  std::vector<CalCoreSubmesh::Vertex>& vectorVertex = pCoreSubmesh->getVectorVertex();
+  std::vector<CalCoreSubmesh::Face>& vectorFace = pCoreSubmesh->getVectorFace();
+  int faceCount = pCoreSubmesh->getFaceCount();
+
+  vectorFacePartition.assign(faceCount, 0);
+
+  // -- group faces by the (sorted) set of bones they reference --
+  std::map< std::vector<int>, int > mapBonesGroup;
+  std::vector< std::vector<int> > vectorGroupBones;
+  std::vector<int> vectorGroupFaceCount;
+  std::vector<int> vectorFaceGroup(faceCount);
+  std::vector<int> faceBones;
+  int maxBoneId = -1;
+
+  int faceId;
+  for(faceId = 0; faceId < faceCount; faceId++)
   {
-    for(size_t influenceIndex=0;influenceIndex< vectorVertex[face.vertexId[faceIndex]].vectorInfluence.size();influenceIndex++)
+    faceBones.clear();
+    for(int faceIndex = 0; faceIndex < 3; faceIndex++)
     {
-      unsigned boneIndex=0;
-      while(boneIndex< hardwareMesh.m_vectorBonesIndices.size() 
-        && hardwareMesh.m_vectorBonesIndices[boneIndex]!=vectorVertex[face.vertexId[faceIndex]].vectorInfluence[influenceIndex].boneId)
-        boneIndex++;
-      
-      if(boneIndex==hardwareMesh.m_vectorBonesIndices.size())
+      std::vector<CalCoreSubmesh::Influence>& vectorInfluence = vectorVertex[vectorFace[faceId].vertexId[faceIndex]].vectorInfluence;
+      for(size_t influenceIndex = 0; influenceIndex < vectorInfluence.size() && influenceIndex < 4; influenceIndex++)
+        faceBones.push_back(vectorInfluence[influenceIndex].boneId);
+    }
+    std::sort(faceBones.begin(), faceBones.end());
+    faceBones.erase(std::unique(faceBones.begin(), faceBones.end()), faceBones.end());
+
+    if(!faceBones.empty() && faceBones.back() > maxBoneId)
+      maxBoneId = faceBones.back();
+
+    std::map< std::vector<int>, int >::iterator it = mapBonesGroup.find(faceBones);
+    if(it == mapBonesGroup.end())
+    {
+      it = mapBonesGroup.insert(std::make_pair(faceBones, (int)vectorGroupBones.size())).first;
+      vectorGroupBones.push_back(faceBones);
+      vectorGroupFaceCount.push_back(0);
+    }
+    vectorFaceGroup[faceId] = it->second;
+    vectorGroupFaceCount[it->second]++;
+  }
+
+  int groupCount = vectorGroupBones.size();
+  if(groupCount == 0)
+    return 1;
+
+  // -- fast path: the whole submesh fits in one hardware mesh --
+  std::vector<char> vectorBoneUsed(maxBoneId + 1, 0);
+  int boneCount = 0;
+  int groupId;
+  for(groupId = 0; groupId < groupCount; groupId++)
+  {
+    for(size_t i = 0; i < vectorGroupBones[groupId].size(); i++)
+    {
+      if(!vectorBoneUsed[vectorGroupBones[groupId][i]])
+      {
+        vectorBoneUsed[vectorGroupBones[groupId][i]] = 1;
         boneCount++;
+      }
     }
   }
-  
-  /// @todo Change maxBonesPerMesh to a size_t?
-        if(int(boneCount)>maxBonesPerMesh)
-    return false;
-  
-  return true;  
+
+  if(boneCount <= maxBonesPerMesh)
+    return 1;
+
+  // -- cluster groups into partitions --
+  std::vector<int> vectorGroupPartition(groupCount, -1);
+  int assignedCount = 0;
+  int partitionCount = 0;
+
+  while(assignedCount < groupCount)
+  {
+    std::fill(vectorBoneUsed.begin(), vectorBoneUsed.end(), 0);
+    boneCount = 0;
+
+    // seed with the group that is the hardest to place
+    int seedId = -1;
+    for(groupId = 0; groupId < groupCount; groupId++)
+    {
+      if(vectorGroupPartition[groupId] != -1)
+        continue;
+      if(seedId == -1
+         || vectorGroupBones[groupId].size() > vectorGroupBones[seedId].size()
+         || (vectorGroupBones[groupId].size() == vectorGroupBones[seedId].size()
+             && vectorGroupFaceCount[groupId] > vectorGroupFaceCount[seedId]))
+        seedId = groupId;
+    }
+
+    int addId = seedId;
+    while(addId != -1)
+    {
+      vectorGroupPartition[addId] = partitionCount;
+      assignedCount++;
+      for(size_t i = 0; i < vectorGroupBones[addId].size(); i++)
+      {
+        if(!vectorBoneUsed[vectorGroupBones[addId][i]])
+        {
+          vectorBoneUsed[vectorGroupBones[addId][i]] = 1;
+          boneCount++;
+        }
+      }
+
+      // pick the group adding the fewest new bones, then the biggest one
+      addId = -1;
+      int addCost = 0;
+      for(groupId = 0; groupId < groupCount; groupId++)
+      {
+        if(vectorGroupPartition[groupId] != -1)
+          continue;
+
+        int cost = 0;
+        for(size_t i = 0; i < vectorGroupBones[groupId].size(); i++)
+          if(!vectorBoneUsed[vectorGroupBones[groupId][i]])
+            cost++;
+
+        if(boneCount + cost > maxBonesPerMesh)
+          continue;
+
+        if(cost == 0)
+        {
+          // free to add, no need to look further
+          vectorGroupPartition[groupId] = partitionCount;
+          assignedCount++;
+          continue;
+        }
+
+        if(addId == -1 || cost < addCost
+           || (cost == addCost && vectorGroupFaceCount[groupId] > vectorGroupFaceCount[addId]))
+        {
+          addId = groupId;
+          addCost = cost;
+        }
+      }
+    }
+
+    partitionCount++;
+  }
+
+  for(faceId = 0; faceId < faceCount; faceId++)
+    vectorFacePartition[faceId] = vectorGroupPartition[vectorFaceGroup[faceId]];
+
+  return partitionCount;
+}
+
+
+/*****************************************************************************/
+/** Resets the vertex remapping before filling a new hardware mesh.
+*
+* Only the entries used by the previous hardware mesh are reset, so the cost
+* is proportional to its vertex count and not to the submesh size.
+*****************************************************************************/
+
+void CalHardwareModel::beginHardwareMesh(CalHardwareMesh &hardwareMesh)
+{
+  for(size_t i = 0; i < m_vectorVertexIndiceUsed.size(); i++)
+    m_vectorVertexLocalIndice[m_vectorVertexIndiceUsed[i]] = -1;
+  m_vectorVertexIndiceUsed.clear();
+  hardwareMesh.m_vectorBonesIndices.clear();
 }
 
 
 
 int CalHardwareModel::addVertex(CalHardwareMesh &hardwareMesh, int indice, CalCoreSubmesh *pCoreSubmesh, int maxBonesPerMesh)
 {
-  int i=0;
-  
-  while(i< hardwareMesh.vertexCount && m_vectorVertexIndiceUsed[i]!=indice)
-    i++;
-  
-  if(i != hardwareMesh.vertexCount)
-    return i;
+  if(m_vectorVertexLocalIndice[indice] != -1)
+    return m_vectorVertexLocalIndice[indice];
+
+  int i=hardwareMesh.vertexCount;
 
   
   std::vector<CalCoreSubmesh::Vertex>& vectorVertex = pCoreSubmesh->getVectorVertex();
   std::vector< std::vector<CalCoreSubmesh::TextureCoordinate> >& vectorvectorTextureCoordinate = pCoreSubmesh->getVectorVectorTextureCoordinate();
   std::vector< std::vector<CalCoreSubmesh::TangentSpace> >& vectorvectorTangentSpace = pCoreSubmesh->getVectorVectorTangentSpace();
 
-  m_vectorVertexIndiceUsed[hardwareMesh.vertexCount]=indice;
+  m_vectorVertexIndiceUsed.push_back(indice);
+  m_vectorVertexLocalIndice[indice]=i;
   
   memcpy(&m_pVertexBuffer[(hardwareMesh.baseVertexIndex+i)*m_vertexStride],&vectorVertex[indice].position,sizeof(CalVector));
 
@@ -78,7 +78,8 @@ public:
   bool selectHardwareMesh(size_t meshId);
   
 private:
-  bool canAddFace(CalHardwareMesh &hardwareMesh, CalCoreSubmesh::Face & face,std::vector<CalCoreSubmesh::Vertex>& vectorVertex, int maxBonesPerMesh);
+  int  partitionFaces(CalCoreSubmesh *pCoreSubmesh, int maxBonesPerMesh, std::vector<int>& vectorFacePartition);
+  void beginHardwareMesh(CalHardwareMesh &hardwareMesh);
   int  addVertex(CalHardwareMesh &hardwareMesh, int indice , CalCoreSubmesh *pCoreSubmesh, int maxBonesPerMesh);
   int  addBoneIndice(CalHardwareMesh &hardwareMesh, int Indice, int maxBonesPerMesh);  
     
@@ -86,7 +87,8 @@ private:
 private:
   
   std::vector<CalHardwareMesh> m_vectorHardwareMesh;
-  std::vector<CalIndex> m_vectorVertexIndiceUsed;
+  std::vector<int> m_vectorVertexIndiceUsed;
+  std::vector<int> m_vectorVertexLocalIndice;
   int m_selectedHardwareMesh;
   std::vector<int> m_coreMeshIds;
   CalCoreModel *m_pCoreModel;
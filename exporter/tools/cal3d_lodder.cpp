@@ -0,0 +1,204 @@
+//----------------------------------------------------------------------------//
+// cal3d_lodder.cpp                                                           //
+//----------------------------------------------------------------------------//
+// This program is free software; you can redistribute it and/or modify it    //
+// under the terms of the GNU General Public License as published by the Free //
+// Software Foundation; either version 2 of the License, or (at your option)  //
+// any later version.                                                         //
+//----------------------------------------------------------------------------//
+
+//----------------------------------------------------------------------------//
+// Headless tool that (re)calculates the level of detail data of existing     //
+// core mesh files, the same way the exporter plugins do it.                  //
+//----------------------------------------------------------------------------//
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "cal3d/cal3d.h"
+#include "Lodder.h"
+
+//----------------------------------------------------------------------------//
+// Reorder a per-vertex vector by the vertex LOD ids                          //
+//----------------------------------------------------------------------------//
+
+template<class T>
+static void ReorderVertexData(std::vector<T>& vectorData, const std::vector<int>& vectorLodId)
+{
+  // some of the per-vertex data is optional
+  if(vectorData.size() != vectorLodId.size()) return;
+
+  std::vector<T> vectorReordered(vectorData.size());
+  for(size_t vertexId = 0; vertexId < vectorData.size(); vertexId++)
+  {
+    vectorReordered[vectorLodId[vertexId]] = vectorData[vertexId];
+  }
+
+  vectorData.swap(vectorReordered);
+}
+
+//----------------------------------------------------------------------------//
+// Calculate the LOD of a core submesh                                        //
+//----------------------------------------------------------------------------//
+
+static bool CalculateLOD(CalCoreSubmesh *pCoreSubmesh, std::string& strError)
+{
+  std::vector<CalCoreSubmesh::Vertex>& vectorVertex = pCoreSubmesh->getVectorVertex();
+  std::vector<CalCoreSubmesh::Face>& vectorFace = pCoreSubmesh->getVectorFace();
+
+  // nothing to do for an empty submesh
+  if(vectorVertex.empty() || vectorFace.empty()) return true;
+
+  // create a lodder instance
+  CLodder lodder;
+  if(!lodder.Create(vectorVertex.size(), vectorFace.size()))
+  {
+    strError = lodder.GetLastError();
+    return false;
+  }
+
+  // add all vertices to the lodder
+  size_t vertexId;
+  for(vertexId = 0; vertexId < vectorVertex.size(); vertexId++)
+  {
+    CalCoreSubmesh::Vertex& coreVertex = vectorVertex[vertexId];
+
+    CLodder::Vertex vertex;
+    vertex.x = coreVertex.position.x;
+    vertex.y = coreVertex.position.y;
+    vertex.z = coreVertex.position.z;
+    vertex.nx = coreVertex.normal.x;
+    vertex.ny = coreVertex.normal.y;
+    vertex.nz = coreVertex.normal.z;
+
+    if(!lodder.AddVertex(vertex)) return false;
+  }
+
+  // add all faces to the lodder
+  size_t faceId;
+  for(faceId = 0; faceId < vectorFace.size(); faceId++)
+  {
+    CLodder::Face face;
+    face.vertexId[0] = vectorFace[faceId].vertexId[0];
+    face.vertexId[1] = vectorFace[faceId].vertexId[1];
+    face.vertexId[2] = vectorFace[faceId].vertexId[2];
+
+    if(!lodder.AddFace(face)) return false;
+  }
+
+  // calculate LOD levels
+  if(!lodder.CalculateLevels())
+  {
+    strError = lodder.GetLastError();
+    return false;
+  }
+
+  // get the new position of every vertex and store the collapse data
+  std::vector<int> vectorLodId(vectorVertex.size());
+  for(vertexId = 0; vertexId < vectorVertex.size(); vertexId++)
+  {
+    vectorLodId[vertexId] = lodder.GetVertexLodId(vertexId);
+    vectorVertex[vertexId].collapseId = lodder.GetVertexCollapseId(vertexId);
+    vectorVertex[vertexId].faceCollapseCount = lodder.GetVertexFaceCollapseCount(vertexId);
+  }
+
+  // reorder all the per-vertex data
+  ReorderVertexData(vectorVertex, vectorLodId);
+  ReorderVertexData(pCoreSubmesh->getVectorPhysicalProperty(), vectorLodId);
+
+  size_t mapId;
+  for(mapId = 0; mapId < pCoreSubmesh->getVectorVectorTextureCoordinate().size(); mapId++)
+  {
+    ReorderVertexData(pCoreSubmesh->getVectorVectorTextureCoordinate()[mapId], vectorLodId);
+  }
+  for(mapId = 0; mapId < pCoreSubmesh->getVectorVectorTangentSpace().size(); mapId++)
+  {
+    ReorderVertexData(pCoreSubmesh->getVectorVectorTangentSpace()[mapId], vectorLodId);
+  }
+
+  std::vector<CalCoreSubMorphTarget *>& vectorMorphTarget = pCoreSubmesh->getVectorCoreSubMorphTarget();
+  for(size_t morphTargetId = 0; morphTargetId < vectorMorphTarget.size(); morphTargetId++)
+  {
+    ReorderVertexData(vectorMorphTarget[morphTargetId]->getVectorBlendVertex(), vectorLodId);
+  }
+
+  // remap the springs to the new vertex ids
+  std::vector<CalCoreSubmesh::Spring>& vectorSpring = pCoreSubmesh->getVectorSpring();
+  for(size_t springId = 0; springId < vectorSpring.size(); springId++)
+  {
+    vectorSpring[springId].vertexId[0] = vectorLodId[vectorSpring[springId].vertexId[0]];
+    vectorSpring[springId].vertexId[1] = vectorLodId[vectorSpring[springId].vertexId[1]];
+  }
+
+  // reorder the faces and remap them to the new vertex ids
+  std::vector<CalCoreSubmesh::Face> vectorLodFace(vectorFace.size());
+  for(faceId = 0; faceId < vectorFace.size(); faceId++)
+  {
+    CalCoreSubmesh::Face& face = vectorLodFace[lodder.GetFaceLodId(faceId)];
+    face.vertexId[0] = CalIndex(vectorLodId[vectorFace[faceId].vertexId[0]]);
+    face.vertexId[1] = CalIndex(vectorLodId[vectorFace[faceId].vertexId[1]]);
+    face.vertexId[2] = CalIndex(vectorLodId[vectorFace[faceId].vertexId[2]]);
+  }
+  vectorFace.swap(vectorLodFace);
+
+  // set the LOD step count
+  pCoreSubmesh->setLodCount(lodder.GetLodCount());
+
+  return true;
+}
+
+//----------------------------------------------------------------------------//
+// Main entry point                                                           //
+//----------------------------------------------------------------------------//
+
+int main(int argc, char *argv[])
+{
+  if(argc < 2)
+  {
+    puts("Usage: cal3d_lodder <input mesh file> [<output mesh file>]");
+    return 2;
+  }
+
+  std::string strInputFilename = argv[1];
+  std::string strOutputFilename = (argc > 2) ? argv[2] : argv[1];
+
+  // load the core mesh
+  CalCoreMesh *pCoreMesh = CalLoader::loadCoreMesh(strInputFilename);
+  if(pCoreMesh == 0)
+  {
+    printf("Can't load %s:\n%s\n", strInputFilename.c_str(), CalError::getLastErrorText().c_str());
+    return 2;
+  }
+
+  // calculate the LOD of all core submeshes
+  for(int submeshId = 0; submeshId < pCoreMesh->getCoreSubmeshCount(); submeshId++)
+  {
+    CalCoreSubmesh *pCoreSubmesh = pCoreMesh->getCoreSubmesh(submeshId);
+
+    std::string strError;
+    if(!CalculateLOD(pCoreSubmesh, strError))
+    {
+      printf("Can't calculate LOD of submesh %d:\n%s\n", submeshId, strError.c_str());
+      delete pCoreMesh;
+      return 2;
+    }
+
+    printf("submesh %d: %d vertices, %d faces, %d LOD steps\n", submeshId,
+           pCoreSubmesh->getVertexCount(), pCoreSubmesh->getFaceCount(), pCoreSubmesh->getLodCount());
+  }
+
+  // save the core mesh
+  if(!CalSaver::saveCoreMesh(strOutputFilename, pCoreMesh))
+  {
+    printf("Can't save %s:\n%s\n", strOutputFilename.c_str(), CalError::getLastErrorText().c_str());
+    delete pCoreMesh;
+    return 2;
+  }
+
+  delete pCoreMesh;
+
+  return 0;
+}
+
+//----------------------------------------------------------------------------//
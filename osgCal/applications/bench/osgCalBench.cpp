@@ -0,0 +1,833 @@
+/*
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <unistd.h>
+#include <new>
+#endif
+
+#include <osg/ArgumentParser>
+#include <osg/Timer>
+#include <osgDB/FileNameUtils>
+#include <osgDB/FileUtils>
+
+#include <cal3d/coretrack.h>
+
+#include <osgCal/CoreModel>
+#include <osgCal/MeshLoader>
+#include <osgCal/Model>
+#include <osgCal/ModelPool>
+
+using namespace osgCal;
+
+// -- Allocations counting --
+
+static size_t allocationsCount = 0;
+
+/**
+ * Allocations made by Mixer::executeAction/blendCycle/clearCycle/
+ * updateAnimation after warm up, for all models. Must be zero,
+ * osgCalBench fails otherwise.
+ */
+static size_t steadyStateMixerAllocations = 0;
+
+void*
+operator new( size_t size ) throw (std::bad_alloc)
+{
+    allocationsCount++;
+
+    void* p = malloc( size ? size : 1 );
+
+    if ( p == 0 )
+    {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+void
+operator delete( void* p ) throw ()
+{
+    free( p );
+}
+
+/**
+ * Resident memory of the process in bytes or -1 when it is not
+ * available on this platform.
+ */
+long
+processMemoryUsage()
+{
+#ifdef __linux__
+    FILE* f = fopen( "/proc/self/statm", "r" );
+
+    if ( f )
+    {
+        long size = 0;
+        long resident = 0;
+        int  n = fscanf( f, "%ld %ld", &size, &resident );
+        fclose( f );
+
+        if ( n == 2 )
+        {
+            return resident * sysconf( _SC_PAGESIZE );
+        }
+    }
+#endif
+    return -1;
+}
+
+/**
+ * Same cleanup as in CoreModel destructor (cal3d doesn't destroy
+ * core tracks).
+ */
+void
+destroyCalCoreModel( CalCoreModel* calCoreModel )
+{
+    for ( int i = 0; i < calCoreModel->getCoreAnimationCount(); i++ )
+    {
+        std::list< CalCoreTrack* >& ct =
+            calCoreModel->getCoreAnimation( i )->getListCoreTrack();
+
+        for ( std::list< CalCoreTrack* >::iterator
+                  t = ct.begin(),
+                  tEnd = ct.end();
+              t != tEnd; ++t )
+        {
+            (*t)->destroy();
+            delete (*t);
+        }
+        ct.clear();
+    }
+
+    delete calCoreModel;
+}
+
+// -- JSON output --
+
+std::string
+jsonString( const std::string& s )
+{
+    std::string r = "\"";
+
+    for ( size_t i = 0; i < s.size(); i++ )
+    {
+        switch ( s[i] )
+        {
+            case '"':  r += "\\\""; break;
+            case '\\': r += "\\\\"; break;
+            case '\n': r += "\\n";  break;
+            case '\t': r += "\\t";  break;
+            default:   r += s[i];
+        }
+    }
+
+    return r + "\"";
+}
+
+std::string
+jsonNumber( double x )
+{
+    std::ostringstream s;
+    s.imbue( std::locale::classic() );
+    s.precision( 6 );
+    s << x;
+    return s.str();
+}
+
+std::string
+jsonMemory( long bytes )
+{
+    if ( bytes < 0 )
+    {
+        return "null";
+    }
+
+    std::ostringstream s;
+    s << bytes;
+    return s.str();
+}
+
+/**
+ * MemoryUsage as JSON object, category names with underscores.
+ */
+std::string
+jsonMemoryUsage( const MemoryUsage& mu )
+{
+    std::ostringstream s;
+    s << "{ ";
+
+    for ( int i = 0; i < MemoryUsage::CATEGORIES_COUNT; i++ )
+    {
+        std::string name =
+            MemoryUsage::getCategoryName( (MemoryUsage::Category)i );
+        std::replace( name.begin(), name.end(), ' ', '_' );
+        s << "\"" << name << "\": " << mu.bytes[i] << ", ";
+    }
+
+    s << "\"total\": " << mu.getTotal() << " }";
+    return s.str();
+}
+
+// -- Benchmarks --
+
+struct BenchParameters
+{
+        std::vector< int > instances;
+        int                frames;
+        int                loadRepeats;
+        std::string        tempDir;
+};
+
+/**
+ * Run `f' `repeats' times and return best time in milliseconds.
+ */
+template < typename F >
+double
+bestTime( F f,
+          int repeats )
+{
+    double best = 0;
+
+    for ( int i = 0; i < repeats; i++ )
+    {
+        osg::Timer_t start = osg::Timer::instance()->tick();
+        f();
+        double t = osg::Timer::instance()->delta_m(
+            start, osg::Timer::instance()->tick() );
+
+        if ( i == 0 || t < best )
+        {
+            best = t;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Loading of meshes from cal3d files (what CoreModel::load does
+ * without meshes cache).
+ */
+struct ColdLoad
+{
+        const std::string& cfgFileName;
+
+        ColdLoad( const std::string& fn )
+            : cfgFileName( fn )
+        {}
+
+        void operator () ()
+        {
+            float        scale;
+            MeshesVector meshes;
+            CalCoreModel* calCoreModel = loadCoreModel( cfgFileName, scale );
+            loadMeshes( calCoreModel, meshes );
+            destroyCalCoreModel( calCoreModel );
+        }
+};
+
+/**
+ * Loading of meshes (with materials) from meshes cache file. With
+ * `parseMaterials' core materials are also loaded and parsed, as
+ * cached load did before materials were saved in meshes cache.
+ */
+struct CachedLoad
+{
+        const std::string& cfgFileName;
+        const std::string& cacheFileName;
+        bool               parseMaterials;
+
+        CachedLoad( const std::string& fn,
+                    const std::string& cfn,
+                    bool               pm )
+            : cfgFileName( fn )
+            , cacheFileName( cfn )
+            , parseMaterials( pm )
+        {}
+
+        void operator () ()
+        {
+            float        scale;
+            MeshesVector meshes;
+            CalCoreModel* calCoreModel =
+                loadCoreModel( cfgFileName, scale, true/*ignoreMeshes*/,
+                               0, 0, !parseMaterials );
+            loadMeshes( cacheFileName, calCoreModel, meshes );
+
+            if ( parseMaterials )
+            {
+                std::string dir = osgDB::getFilePath( cfgFileName );
+
+                for ( int i = 0; i < calCoreModel->getCoreMaterialCount(); i++ )
+                {
+                    osg::ref_ptr< Material > m = new Material(
+                        calCoreModel->getCoreMaterial( i ), dir.empty() ? "." : dir );
+                }
+            }
+
+            destroyCalCoreModel( calCoreModel );
+        }
+};
+
+/**
+ * Complete CoreModel::load (with materials & state sets creation).
+ */
+struct CoreModelLoad
+{
+        const std::string& cfgFileName;
+
+        CoreModelLoad( const std::string& fn )
+            : cfgFileName( fn )
+        {}
+
+        void operator () ()
+        {
+            osg::ref_ptr< CoreModel > cm = new CoreModel;
+            cm->load( cfgFileName );
+        }
+};
+
+/**
+ * Start all animation cycles with different phases, so instances
+ * are not updated in lock step.
+ */
+void
+startAnimation( Mixer* mixer,
+                int animationsCount,
+                int instance )
+{
+    if ( animationsCount == 0 )
+    {
+        return;
+    }
+
+    mixer->blendCycle( instance % animationsCount, 1.0f, 0 );
+    mixer->updateAnimation( instance * 0.37f );
+}
+
+/**
+ * Benchmark one model, write JSON object to `out'.
+ */
+void
+benchModel( const std::string& cfgFileName,
+            const BenchParameters& bp,
+            std::ostream& out )
+{
+    std::cerr << cfgFileName << std::endl;
+
+    const float deltaTime = 1.0f / 60.0f;
+
+    // -- Loading --
+    double coldMs = bestTime( ColdLoad( cfgFileName ), bp.loadRepeats );
+
+    std::string cacheFileName =
+        bp.tempDir + "/osgCalBench_"
+        + osgDB::getSimpleFileName( osgDB::getFilePath( cfgFileName ) )
+        + ".meshes.cache";
+    {
+        float        scale;
+        MeshesVector meshes;
+        CalCoreModel* calCoreModel = loadCoreModel( cfgFileName, scale );
+        loadMeshes( calCoreModel, meshes );
+        saveMeshes( calCoreModel, meshes, cacheFileName );
+        destroyCalCoreModel( calCoreModel );
+    }
+    double cachedMs = bestTime( CachedLoad( cfgFileName, cacheFileName, false ),
+                                bp.loadRepeats );
+    double materialsParsingMs =
+        bestTime( CachedLoad( cfgFileName, cacheFileName, true ), bp.loadRepeats );
+    remove( cacheFileName.c_str() );
+
+    double coreModelMs = bestTime( CoreModelLoad( cfgFileName ), bp.loadRepeats );
+
+    long memoryBefore = processMemoryUsage();
+    osg::ref_ptr< CoreModel > coreModel = new CoreModel;
+    coreModel->setRigidMeshesBatching( true ); // drawn_meshes counts batches
+    coreModel->load( cfgFileName );
+    long memoryAfter = processMemoryUsage();
+    long coreModelMemory =
+        memoryBefore < 0 ? -1 : std::max( 0L, memoryAfter - memoryBefore );
+
+    int animationsCount = coreModel->getCalCoreModel()->getCoreAnimationCount();
+    int vertices = 0;
+    int faces = 0;
+    int drawnMeshes = coreModel->getBatches().size();
+
+    for ( size_t i = 0; i < coreModel->getMeshes().size(); i++ )
+    {
+        const MeshData* d = coreModel->getMeshes()[i]->data.get();
+        vertices += d->vertexBuffer->size();
+        faces += d->getIndicesCount() / 3;
+
+        if ( !coreModel->getMeshes()[i]->batch.valid() )
+        {
+            drawnMeshes++;
+        }
+    }
+
+    out << "    {\n"
+        << "      \"file\": " << jsonString( cfgFileName ) << ",\n"
+        << "      \"meshes\": " << coreModel->getMeshes().size() << ",\n"
+        << "      \"drawn_meshes\": " << drawnMeshes << ",\n"
+        << "      \"vertices\": " << vertices << ",\n"
+        << "      \"faces\": " << faces << ",\n"
+        << "      \"animations\": " << animationsCount << ",\n"
+        << "      \"load_cold_ms\": " << jsonNumber( coldMs ) << ",\n"
+        << "      \"load_cached_ms\": " << jsonNumber( cachedMs ) << ",\n"
+        << "      \"load_cached_materials_saved_ms\": "
+        << jsonNumber( std::max( 0.0, materialsParsingMs - cachedMs ) ) << ",\n"
+        << "      \"core_model_load_ms\": " << jsonNumber( coreModelMs ) << ",\n"
+        << "      \"core_model_memory_bytes\": " << jsonMemory( coreModelMemory ) << ",\n"
+        << "      \"core_model_memory\": "
+        << jsonMemoryUsage( coreModel->getMemoryUsage() ) << ",\n";
+
+    // -- CPU skinning (per bones influence count) --
+    out << "      \"skinning\": [";
+    if ( animationsCount > 0 )
+    {
+        osg::ref_ptr< Model > model = new Model;
+        model->load( coreModel.get() );
+        model->setAutoUpdate( false );
+        model->blendCycle( 0, 1.0f, 0 );
+        model->update( 0.5 );
+        // ^ now bones are changed, so Mesh::update() performs skinning
+        // each time it is called
+
+        const char* separator = "";
+
+        for ( int influences = 1; influences <= 4; influences++ )
+        {
+            std::vector< Mesh* > meshes;
+            int meshVertices = 0;
+
+            for ( Model::MeshMap::const_iterator
+                      mm = model->getMeshMap().begin(),
+                      mmEnd = model->getMeshMap().end();
+                  mm != mmEnd; ++mm )
+            {
+                for ( size_t i = 0; i < mm->second.size(); i++ )
+                {
+                    const MeshData* d = mm->second[i]->getCoreMesh()->data.get();
+
+                    if ( !d->rigid && d->maxBonesInfluence == influences )
+                    {
+                        meshes.push_back( mm->second[i] );
+                        meshVertices += d->vertexBuffer->size();
+                    }
+                }
+            }
+
+            if ( meshes.empty() )
+            {
+                continue;
+            }
+
+            osg::Timer_t start = osg::Timer::instance()->tick();
+            for ( int f = 0; f < bp.frames; f++ )
+            {
+                for ( size_t i = 0; i < meshes.size(); i++ )
+                {
+                    meshes[i]->update();
+                }
+            }
+            double s = osg::Timer::instance()->delta_s(
+                start, osg::Timer::instance()->tick() );
+
+            out << separator << "\n"
+                << "        { \"influences\": " << influences
+                << ", \"meshes\": " << meshes.size()
+                << ", \"vertices\": " << meshVertices
+                << ", \"vertices_per_second\": "
+                << jsonNumber( s > 0 ? meshVertices * (double)bp.frames / s : 0 )
+                << " }";
+            separator = ",";
+        }
+        out << "\n      ";
+    }
+    out << "],\n";
+
+    // -- Instances --
+    out << "      \"instances\": [";
+
+    for ( size_t c = 0; c < bp.instances.size(); c++ )
+    {
+        int count = bp.instances[c];
+
+        // mixer & skeleton update only
+        std::vector< osg::ref_ptr< ModelData > > modelDatas;
+        for ( int i = 0; i < count; i++ )
+        {
+            ModelData* md = new ModelData( coreModel.get(), 0 );
+            startAnimation( md->getMixer(), animationsCount, i );
+            modelDatas.push_back( md );
+        }
+
+        osg::Timer_t start = osg::Timer::instance()->tick();
+        for ( int f = 0; f < bp.frames; f++ )
+        {
+            for ( int i = 0; i < count; i++ )
+            {
+                modelDatas[i]->update( deltaTime );
+            }
+        }
+        double modelDataUpdateMs = osg::Timer::instance()->delta_m(
+            start, osg::Timer::instance()->tick() ) / bp.frames;
+
+        // steady state mixer allocations: actions are fired every
+        // 30 frames and cycles switched every 45 frames (with
+        // different phases), first 90 frames warm up mixer pools.
+        // Only mixer calls are counted, not skeleton update.
+        size_t mixerAllocations = 0;
+        for ( int f = 0; f < bp.frames + 90; f++ )
+        {
+            for ( int i = 0; i < count; i++ )
+            {
+                Mixer* mixer = modelDatas[i]->getMixer();
+                size_t allocations = allocationsCount;
+
+                if ( animationsCount > 0 && ( f + i ) % 30 == 0 )
+                {
+                    mixer->executeAction( ( f / 30 + i ) % animationsCount, 0.1f, 0.1f );
+                }
+                if ( animationsCount > 0 && ( f + i ) % 45 == 0 )
+                {
+                    int cycle = ( f + i ) / 45 + i;
+                    mixer->clearCycle( ( cycle + animationsCount - 1 ) % animationsCount, 0.3f );
+                    mixer->blendCycle( cycle % animationsCount, 1.0f, 0.3f );
+                }
+                mixer->updateAnimation( deltaTime );
+
+                if ( f >= 90 )
+                {
+                    mixerAllocations += allocationsCount - allocations;
+                }
+
+                mixer->updateSkeleton();
+            }
+        }
+        steadyStateMixerAllocations += mixerAllocations;
+        modelDatas.clear();
+
+        // crowd playing the same cycle in 10 phases with shared
+        // pose cache
+        coreModel->setPoseCaching( true );
+        for ( int i = 0; i < count; i++ )
+        {
+            ModelData* md = new ModelData( coreModel.get(), 0 );
+            if ( animationsCount > 0 )
+            {
+                md->getMixer()->blendCycle( 0, 1.0f, 0 );
+                md->getMixer()->updateAnimation( ( i % 10 ) * 0.1f );
+            }
+            modelDatas.push_back( md );
+        }
+
+        start = osg::Timer::instance()->tick();
+        for ( int f = 0; f < bp.frames; f++ )
+        {
+            for ( int i = 0; i < count; i++ )
+            {
+                modelDatas[i]->update( deltaTime );
+            }
+        }
+        double crowdUpdateMs = osg::Timer::instance()->delta_m(
+            start, osg::Timer::instance()->tick() ) / bp.frames;
+        float poseCacheHitRate = coreModel->getPoseCache()->getStats().getHitRate();
+        modelDatas.clear();
+        coreModel->setPoseCaching( false );
+
+        // complete models (spawn time & memory before first update,
+        // deformed buffers are allocated lazily on first deformation)
+        long memoryBefore = processMemoryUsage();
+        std::vector< osg::ref_ptr< Model > > models;
+        start = osg::Timer::instance()->tick();
+        for ( int i = 0; i < count; i++ )
+        {
+            Model* model = new Model;
+            model->load( coreModel.get() );
+            model->setAutoUpdate( false );
+            models.push_back( model );
+        }
+        double modelCreateMs = osg::Timer::instance()->delta_m(
+            start, osg::Timer::instance()->tick() ) / count;
+        long memoryAfter = processMemoryUsage();
+        long modelMemory =
+            memoryBefore < 0 ? -1 : std::max( 0L, memoryAfter - memoryBefore ) / count;
+
+        for ( int i = 0; i < count; i++ )
+        {
+            startAnimation( models[i]->getMixer(), animationsCount, i );
+        }
+
+        start = osg::Timer::instance()->tick();
+        for ( int f = 0; f < bp.frames; f++ )
+        {
+            for ( int i = 0; i < count; i++ )
+            {
+                models[i]->update( deltaTime );
+            }
+        }
+        double modelUpdateMs = osg::Timer::instance()->delta_m(
+            start, osg::Timer::instance()->tick() ) / bp.frames;
+        memoryAfter = processMemoryUsage();
+        long animatedModelMemory =
+            memoryBefore < 0 ? -1 : std::max( 0L, memoryAfter - memoryBefore ) / count;
+        MemoryUsage modelMemoryUsage = models[0]->getMemoryUsage();
+
+        // picking of animated model: rays through the bounding
+        // sphere center from different directions
+        const int rays = 100;
+        const osg::BoundingSphere& bs = models[0]->getBound();
+        int hits = 0;
+        start = osg::Timer::instance()->tick();
+        for ( int r = 0; r < rays; r++ )
+        {
+            float a = r * 2.0f * osg::PI / rays;
+            osg::Vec3f d( cosf( a ), sinf( a ), 0.3f * cosf( 3 * a ) );
+            d.normalize();
+            ModelIntersection intersection;
+            hits += models[0]->intersect( bs.center() + d * bs.radius(),
+                                          bs.center() - d * bs.radius(),
+                                          intersection );
+        }
+        double modelIntersectUs = osg::Timer::instance()->delta_u(
+            start, osg::Timer::instance()->tick() ) / rays;
+
+        // recycling through pool (compare with model_create_ms)
+        osg::ref_ptr< ModelPool > pool = new ModelPool( coreModel.get() );
+        start = osg::Timer::instance()->tick();
+        for ( int i = 0; i < count; i++ )
+        {
+            pool->release( models[i].get() );
+        }
+        for ( int i = 0; i < count; i++ )
+        {
+            models[i] = pool->acquire();
+        }
+        double modelRecycleMs = osg::Timer::instance()->delta_m(
+            start, osg::Timer::instance()->tick() ) / count;
+        models.clear();
+
+        out << ( c ? "," : "" ) << "\n"
+            << "        { \"count\": " << count
+            << ", \"model_create_ms\": " << jsonNumber( modelCreateMs )
+            << ", \"model_recycle_ms\": " << jsonNumber( modelRecycleMs )
+            << ", \"model_memory_bytes\": " << jsonMemory( modelMemory )
+            << ", \"animated_model_memory_bytes\": " << jsonMemory( animatedModelMemory )
+            << ", \"model_memory\": " << jsonMemoryUsage( modelMemoryUsage )
+            << ", \"model_data_update_ms\": " << jsonNumber( modelDataUpdateMs )
+            << ", \"model_data_updates_per_second\": "
+            << jsonNumber( modelDataUpdateMs > 0 ? count * 1000.0 / modelDataUpdateMs : 0 )
+            << ", \"mixer_allocations\": " << mixerAllocations
+            << ", \"crowd_update_ms\": " << jsonNumber( crowdUpdateMs )
+            << ", \"pose_cache_hit_rate\": " << jsonNumber( poseCacheHitRate )
+            << ", \"model_update_ms\": " << jsonNumber( modelUpdateMs )
+            << ", \"model_intersect_us\": " << jsonNumber( modelIntersectUs )
+            << ", \"model_intersect_hits\": " << hits
+            << " }";
+    }
+
+    out << ( bp.instances.empty() ? "" : "\n      " ) << "]\n"
+        << "    }";
+}
+
+/**
+ * Find all <dir>/<model>/cal3d.cfg files.
+ */
+std::vector< std::string >
+findModels( const std::string& dir )
+{
+    std::vector< std::string > models;
+    osgDB::DirectoryContents dc = osgDB::getDirectoryContents( dir );
+    std::sort( dc.begin(), dc.end() );
+
+    for ( size_t i = 0; i < dc.size(); i++ )
+    {
+        std::string cfg = dir + "/" + dc[i] + "/cal3d.cfg";
+
+        if ( dc[i] != "." && dc[i] != ".." && osgDB::fileExists( cfg ) )
+        {
+            models.push_back( cfg );
+        }
+    }
+
+    return models;
+}
+
+std::vector< int >
+parseInstances( const std::string& s )
+{
+    std::vector< int > r;
+    std::istringstream is( s );
+    std::string item;
+
+    while ( std::getline( is, item, ',' ) )
+    {
+        int n = atoi( item.c_str() );
+
+        if ( n > 0 )
+        {
+            r.push_back( n );
+        }
+    }
+
+    return r;
+}
+
+int
+main( int argc,
+      char** argv )
+{
+    osg::ArgumentParser arguments( &argc, argv );
+
+    arguments.getApplicationUsage()->setApplicationName( "osgCalBench" );
+    arguments.getApplicationUsage()->setDescription( "Headless osgCal loading, animation and skinning benchmark" );
+    arguments.getApplicationUsage()->setCommandLineUsage( "osgCalBench [options] [cal3d.cfg ...]" );
+    arguments.getApplicationUsage()->addCommandLineOption( "--models <dir>", "Benchmark all <dir>/*/cal3d.cfg models (default when no cal3d.cfg given: models)" );
+    arguments.getApplicationUsage()->addCommandLineOption( "--instances <n,...>", "Model instance counts (default 1,10,100,1000)" );
+    arguments.getApplicationUsage()->addCommandLineOption( "--frames <n>", "Updates per measurement (default 100)" );
+    arguments.getApplicationUsage()->addCommandLineOption( "--load-repeats <n>", "Loads per loading measurement, best time is reported (default 3)" );
+    arguments.getApplicationUsage()->addCommandLineOption( "--temp-dir <dir>", "Directory for temporary meshes cache files (default .)" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-o or --output <file>", "Write JSON results to <file> (default stdout)" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-h or --help", "Display command line parameters" );
+
+    if ( arguments.read( "-h" ) || arguments.read( "--help" ) )
+    {
+        arguments.getApplicationUsage()->write( std::cout );
+        return 1;
+    }
+
+    BenchParameters bp;
+    bp.instances.push_back( 1 );
+    bp.instances.push_back( 10 );
+    bp.instances.push_back( 100 );
+    bp.instances.push_back( 1000 );
+    bp.frames = 100;
+    bp.loadRepeats = 3;
+    bp.tempDir = ".";
+
+    std::string instances;
+    while ( arguments.read( "--instances", instances ) )
+    {
+        bp.instances = parseInstances( instances );
+    }
+    while ( arguments.read( "--frames", bp.frames ) ) {}
+    while ( arguments.read( "--load-repeats", bp.loadRepeats ) ) {}
+    while ( arguments.read( "--temp-dir", bp.tempDir ) ) {}
+
+    std::string outputFileName;
+    while ( arguments.read( "-o", outputFileName )
+            || arguments.read( "--output", outputFileName ) ) {}
+
+    std::vector< std::string > models;
+    std::string modelsDir;
+    while ( arguments.read( "--models", modelsDir ) )
+    {
+        std::vector< std::string > m = findModels( modelsDir );
+        models.insert( models.end(), m.begin(), m.end() );
+    }
+
+    arguments.reportRemainingOptionsAsUnrecognized();
+    if ( arguments.errors() )
+    {
+        arguments.writeErrorMessages( std::cerr );
+        return 1;
+    }
+
+    for ( int pos = 1; pos < arguments.argc(); ++pos )
+    {
+        models.push_back( arguments[pos] );
+    }
+
+    if ( models.empty() && modelsDir.empty() )
+    {
+        models = findModels( "models" );
+    }
+
+    if ( models.empty() || bp.frames <= 0 || bp.loadRepeats <= 0 )
+    {
+        arguments.getApplicationUsage()->write( std::cout );
+        return 1;
+    }
+
+    std::ostringstream out;
+    out.imbue( std::locale::classic() );
+
+    out << "{\n"
+        << "  \"frames\": " << bp.frames << ",\n"
+        << "  \"load_repeats\": " << bp.loadRepeats << ",\n"
+#ifdef _OPENMP
+        << "  \"openmp\": true,\n"
+#else
+        << "  \"openmp\": false,\n"
+#endif
+        << "  \"models\": [";
+
+    for ( size_t i = 0; i < models.size(); i++ )
+    {
+        out << ( i ? ",\n" : "\n" );
+
+        try
+        {
+            benchModel( models[i], bp, out );
+        }
+        catch ( std::runtime_error& e )
+        {
+            std::cerr << "runtime error during benchmark of " << models[i] << ":" << std::endl
+                      << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    out << "\n  ]\n"
+        << "}\n";
+
+    if ( outputFileName.empty() )
+    {
+        std::cout << out.str();
+    }
+    else
+    {
+        FILE* f = fopen( outputFileName.c_str(), "w" );
+
+        if ( !f || fputs( out.str().c_str(), f ) < 0 )
+        {
+            std::cerr << "can't write " << outputFileName << std::endl;
+            if ( f ) fclose( f );
+            return EXIT_FAILURE;
+        }
+
+        fclose( f );
+    }
+
+    if ( steadyStateMixerAllocations > 0 )
+    {
+        std::cerr << "mixer allocated memory " << steadyStateMixerAllocations
+                  << " times after warm up (see mixer_allocations)" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
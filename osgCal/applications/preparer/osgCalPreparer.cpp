@@ -16,23 +16,661 @@
     Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
 #include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <math.h>
+#include <osg/Image>
+#include <osg/Math>
 #include <osgCal/MeshLoader>
 #include <osgCal/CoreModel>
+#include <osgCal/Material>
 #include <osgDB/FileNameUtils>
+#include <osgDB/ReadFile>
+#include <osgDB/WriteFile>
 
 using namespace osgCal;
 
 void
 usage()
 {
-    puts( "Usage: osgCalPreparer <cal3d.cfg file name>" );
+    puts( "Usage: osgCalPreparer [--dual-quaternion] [--atlas] [--atlas-size <n>]\n"
+          "                      <cal3d.cfg file name>" );
+    puts( "  --dual-quaternion  split meshes for dual quaternion skinning\n"
+          "                     (up to 60 bones per mesh instead of 30)\n"
+          "  --atlas            also pack maps of materials that differ only\n"
+          "                     in maps into atlases, merge deformable meshes\n"
+          "                     with the same material and bones palette and\n"
+          "                     write result as <model>.atlas.cfg (with its\n"
+          "                     meshes cache and atlas materials); merged\n"
+          "                     meshes are still found by their names, but\n"
+          "                     are shown and hidden only together\n"
+          "  --atlas-size <n>   maximum atlas width and height (4096)" );
+}
+
+/**
+ * Print hardware meshes partitioning statistics: how many hardware
+ * meshes were created from the source submeshes and how many
+ * vertices were duplicated on the hardware mesh borders.
+ */
+void
+printMeshesStatistics( CalCoreModel* calCoreModel,
+                       const MeshesVector& meshesData )
+{
+    int submeshes = 0;
+    int sourceVertices = 0;
+
+    for ( int i = 0; i < calCoreModel->getCoreMeshCount(); i++ )
+    {
+        CalCoreMesh* cm = calCoreModel->getCoreMesh( i );
+
+        for ( int j = 0; j < cm->getCoreSubmeshCount(); j++ )
+        {
+            CalCoreSubmesh* sm = cm->getCoreSubmesh( j );
+            const std::vector< CalCoreSubmesh::Face >& faces = sm->getVectorFace();
+
+            if ( faces.empty() )
+            {
+                continue;
+            }
+
+            submeshes++;
+
+            std::vector< bool > used( sm->getVertexCount(), false );
+
+            for ( size_t f = 0; f < faces.size(); f++ )
+            {
+                for ( int k = 0; k < 3; k++ )
+                {
+                    if ( !used[ faces[ f ].vertexId[ k ] ] )
+                    {
+                        used[ faces[ f ].vertexId[ k ] ] = true;
+                        sourceVertices++;
+                    }
+                }
+            }
+        }
+    }
+
+    int hardwareVertices = 0;
+
+    for ( size_t i = 0; i < meshesData.size(); i++ )
+    {
+        hardwareVertices += meshesData[ i ]->vertexBuffer->size();
+    }
+
+    printf( "  %d hardware meshes from %d submeshes, "
+            "%d vertices (%d duplicated)\n",
+            (int)meshesData.size(), submeshes,
+            hardwareVertices, hardwareVertices - sourceVertices );
+}
+
+// -- Texture atlases --
+
+/**
+ * Source material of atlas with its maps (normals & bump maps are
+ * scaled to the diffuse map size) and place in atlas.
+ */
+struct AtlasSource
+{
+        CalCoreMaterial*            coreMaterial;
+        osg::ref_ptr< osg::Image >  diffuse;
+        osg::ref_ptr< osg::Image >  normals;
+        osg::ref_ptr< osg::Image >  bump;
+        int                         x;
+        int                         y;
+};
+
+static const int ATLAS_PADDING = 4; // pixels around each map (for mipmaps)
+
+/**
+ * Materials that differ only in maps share atlas, so map file names
+ * are replaced by presence flags (and diffuse map alpha, which
+ * makes mesh transparent) in atlas key.
+ */
+static
+Material
+atlasKey( const Material& m,
+          bool            diffuseAlpha )
+{
+    Material k = m;
+
+    k.diffuseMap = diffuseAlpha ? "rgba" : "rgb";
+    k.normalsMap = m.normalsMap.empty() ? "" : "+";
+    k.bumpMap    = m.bumpMap.empty() ? "" : "+";
+
+    return k;
+}
+
+/**
+ * Atlas can't be used when texture is repeated.
+ */
+static
+bool
+hasUnitTexCoords( const MeshData* m )
+{
+    const float eps = 1e-3f;
+
+    for ( TexCoordBuffer::const_iterator
+              tc = m->texCoordBuffer->begin(),
+              tcEnd = m->texCoordBuffer->end();
+          tc != tcEnd; ++tc )
+    {
+        if ( tc->x() < -eps || tc->x() > 1 + eps
+             || tc->y() < -eps || tc->y() > 1 + eps )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Read uncompressed 2D image, return 0 when it can't be packed.
+ */
+static
+osg::Image*
+readAtlasImage( const std::string& fileName,
+                int                s = 0,
+                int                t = 0 )
+{
+    osg::ref_ptr< osg::Image > img = osgDB::readImageFile( fileName );
+
+    if ( !img.valid() || img->isCompressed() || img->r() != 1 )
+    {
+        return 0;
+    }
+
+    if ( s != 0 && ( img->s() != s || img->t() != t ) )
+    {
+        img->scaleImage( s, t, 1 );
+    }
+
+    return img.release();
+}
+
+static
+bool
+hasAlpha( const osg::Image* img )
+{
+    return osg::Image::computeNumComponents( img->getPixelFormat() ) == 4;
+}
+
+static
+bool
+higher( const AtlasSource* a,
+        const AtlasSource* b )
+{
+    return a->diffuse->t() > b->diffuse->t();
+}
+
+/**
+ * Shelf packing of sources (sorted by height) into atlas of
+ * specified width. Return atlas height or -1 when source is wider
+ * than atlas.
+ */
+static
+int
+packShelves( const std::vector< AtlasSource* >& sources,
+             int                                width )
+{
+    int x = 0;
+    int y = 0;
+    int shelfHeight = 0;
+
+    for ( size_t i = 0; i < sources.size(); i++ )
+    {
+        AtlasSource* s = sources[ i ];
+        int w = s->diffuse->s() + 2 * ATLAS_PADDING;
+        int h = s->diffuse->t() + 2 * ATLAS_PADDING;
+
+        if ( w > width )
+        {
+            return -1;
+        }
+
+        if ( x + w > width )
+        {
+            x = 0;
+            y += shelfHeight;
+            shelfHeight = 0;
+        }
+
+        s->x = x + ATLAS_PADDING;
+        s->y = y + ATLAS_PADDING;
+        x += w;
+        shelfHeight = std::max( shelfHeight, h );
+    }
+
+    return y + shelfHeight;
+}
+
+static
+int
+nextPowerOfTwo( int n )
+{
+    int p = 1;
+
+    while ( p < n )
+    {
+        p *= 2;
+    }
+
+    return p;
+}
+
+/**
+ * Place sources into the smallest (nearly square) atlas, largest
+ * sources are dropped while they don't fit into maxSize atlas.
+ * Return false when less than two sources are left.
+ */
+static
+bool
+packAtlas( std::vector< AtlasSource* >& sources,
+           int                          maxSize,
+           int&                         width,
+           int&                         height )
+{
+    std::sort( sources.begin(), sources.end(), higher );
+
+    while ( sources.size() >= 2 )
+    {
+        int area = 0;
+
+        for ( size_t i = 0; i < sources.size(); i++ )
+        {
+            area += ( sources[ i ]->diffuse->s() + 2 * ATLAS_PADDING )
+                * ( sources[ i ]->diffuse->t() + 2 * ATLAS_PADDING );
+        }
+
+        for ( width = nextPowerOfTwo( (int)sqrt( (double)area ) );
+              width <= maxSize; width *= 2 )
+        {
+            height = packShelves( sources, width );
+
+            if ( height > 0 && height <= maxSize
+                 && ( height <= width || width == maxSize ) )
+            {
+                height = nextPowerOfTwo( height );
+                return true;
+            }
+        }
+
+        sources.erase( sources.begin() );
+    }
+
+    return false;
+}
+
+/**
+ * Copy image into atlas with edge pixels repeated in padding.
+ */
+static
+void
+copyToAtlas( osg::Image*       atlas,
+             const osg::Image* img,
+             int               x,
+             int               y )
+{
+    for ( int t = -ATLAS_PADDING; t < img->t() + ATLAS_PADDING; t++ )
+    {
+        for ( int s = -ATLAS_PADDING; s < img->s() + ATLAS_PADDING; s++ )
+        {
+            osg::Vec4 c = img->getColor( osg::clampBetween( s, 0, img->s() - 1 ),
+                                         osg::clampBetween( t, 0, img->t() - 1 ) );
+            atlas->setColor( c, x + s, y + t );
+        }
+    }
+}
+
+/**
+ * Create atlas of source maps (`map' member) and write it to file.
+ */
+static
+void
+writeAtlas( const std::vector< AtlasSource* >&       sources,
+            osg::ref_ptr< osg::Image > AtlasSource::* map,
+            GLenum                                   pixelFormat,
+            int                                      width,
+            int                                      height,
+            const std::string&                       fileName )
+    throw (std::runtime_error)
+{
+    osg::ref_ptr< osg::Image > atlas = new osg::Image;
+
+    atlas->allocateImage( width, height, 1, pixelFormat, GL_UNSIGNED_BYTE );
+    memset( atlas->data(), 0, atlas->getTotalSizeInBytes() );
+
+    for ( size_t i = 0; i < sources.size(); i++ )
+    {
+        copyToAtlas( atlas.get(), ( sources[ i ]->*map ).get(),
+                     sources[ i ]->x, sources[ i ]->y );
+    }
+
+    if ( !osgDB::writeImageFile( *atlas, fileName ) )
+    {
+        throw std::runtime_error( "Can't write atlas " + fileName );
+    }
+}
+
+/**
+ * Copy of core material with maps replaced by atlases (file names
+ * relative to model directory).
+ */
+static
+CalCoreMaterial*
+createAtlasMaterial( CalCoreMaterial*   source,
+                     const std::string& diffuseMap,
+                     const std::string& normalsMap,
+                     const std::string& bumpMap )
+{
+    CalCoreMaterial* m = new CalCoreMaterial;
+
+    m->setAmbientColor( source->getAmbientColor() );
+    m->setDiffuseColor( source->getDiffuseColor() );
+    m->setSpecularColor( source->getSpecularColor() );
+    m->setShininess( source->getShininess() );
+
+    std::vector< CalCoreMaterial::Map >& maps = source->getVectorMap();
+    m->reserve( maps.size() );
+
+    for ( size_t i = 0; i < maps.size(); i++ )
+    {
+        CalCoreMaterial::Map map = maps[ i ];
+        std::string::size_type colon = map.strFilename.find( ':' );
+        std::string prefix = ( colon == std::string::npos
+                               ? "" : map.strFilename.substr( 0, colon + 1 ) );
+
+        if ( prefix == "DiffuseMap:" || prefix == "" )
+        {
+            map.strFilename = prefix + diffuseMap;
+        }
+        else if ( prefix == "NormalsMap:" )
+        {
+            map.strFilename = prefix + normalsMap;
+        }
+        else if ( prefix == "BumpMap:" )
+        {
+            map.strFilename = prefix + bumpMap;
+        }
+
+        m->setMap( i, map );
+    }
+
+    return m;
+}
+
+/**
+ * Pack maps of materials which differ only in maps into atlases,
+ * move texture coordinates of meshes using them into atlas and
+ * switch meshes to atlas materials (added to core model and saved
+ * next to model). Return file names of atlas materials.
+ */
+std::vector< std::string >
+buildAtlases( CalCoreModel*      calCoreModel,
+              MeshesVector&      meshesData,
+              const std::string& cfgFileName,
+              int                maxAtlasSize )
+    throw (std::runtime_error)
+{
+    std::string dir = osgDB::getFilePath( cfgFileName );
+    std::string baseName = osgDB::getStrippedName( cfgFileName );
+
+    // -- Load maps of materials used by meshes with unit texture coordinates --
+    typedef std::map< CalCoreMaterial*, AtlasSource > Sources;
+    Sources sources;
+    std::map< Material, std::vector< AtlasSource* > > groups;
+
+    for ( size_t i = 0; i < meshesData.size(); i++ )
+    {
+        const MeshData* m = meshesData[ i ].get();
+
+        if ( !m->texCoordBuffer.valid()
+             || sources.count( m->coreMaterial )
+             || !hasUnitTexCoords( m ) )
+        {
+            continue;
+        }
+
+        Material material( m->coreMaterial, dir );
+        AtlasSource& s = sources[ m->coreMaterial ];
+
+        s.coreMaterial = m->coreMaterial;
+        s.diffuse = material.diffuseMap.empty()
+            ? 0 : readAtlasImage( material.diffuseMap );
+
+        if ( !s.diffuse.valid() )
+        {
+            continue;
+        }
+
+        if ( !material.normalsMap.empty() )
+        {
+            s.normals = readAtlasImage( material.normalsMap,
+                                        s.diffuse->s(), s.diffuse->t() );
+        }
+
+        if ( !material.bumpMap.empty() )
+        {
+            s.bump = readAtlasImage( material.bumpMap,
+                                     s.diffuse->s(), s.diffuse->t() );
+        }
+
+        if ( material.normalsMap.empty() != !s.normals.valid()
+             || material.bumpMap.empty() != !s.bump.valid() )
+        {
+            continue; // unreadable or compressed map
+        }
+
+        groups[ atlasKey( material, hasAlpha( s.diffuse.get() ) ) ].push_back( &s );
+    }
+
+    // -- Create atlases --
+    std::vector< std::string > materialFiles;
+    std::map< CalCoreMaterial*, std::pair< CalCoreMaterial*, osg::Vec4 > > atlasPlaces;
+    std::map< CalCoreMaterial*, osg::ref_ptr< Material > > atlasMaterials;
+    // ^ atlas material and place (x, y, width, height) in atlas of source material
+
+    for ( std::map< Material, std::vector< AtlasSource* > >::iterator
+              g = groups.begin(),
+              gEnd = groups.end();
+          g != gEnd; ++g )
+    {
+        std::vector< AtlasSource* >& group = g->second;
+        int width = 0;
+        int height = 0;
+
+        if ( !packAtlas( group, maxAtlasSize, width, height ) )
+        {
+            continue;
+        }
+
+        char suffix[ 32 ];
+        sprintf( suffix, ".atlas%d", (int)materialFiles.size() );
+        std::string name = baseName + suffix;
+
+        writeAtlas( group, &AtlasSource::diffuse,
+                    hasAlpha( group.front()->diffuse.get() ) ? GL_RGBA : GL_RGB,
+                    width, height, dir + "/" + name + ".diffuse.tga" );
+
+        if ( group.front()->normals.valid() )
+        {
+            writeAtlas( group, &AtlasSource::normals, GL_RGB,
+                        width, height, dir + "/" + name + ".normals.tga" );
+        }
+
+        if ( group.front()->bump.valid() )
+        {
+            writeAtlas( group, &AtlasSource::bump, GL_RGB,
+                        width, height, dir + "/" + name + ".bump.tga" );
+        }
+
+        // -- Atlas material --
+        CalCoreMaterial* m = createAtlasMaterial( group.front()->coreMaterial,
+                                                  name + ".diffuse.tga",
+                                                  name + ".normals.tga",
+                                                  name + ".bump.tga" );
+        m->setName( name );
+
+        int id = calCoreModel->addCoreMaterial( m );
+        calCoreModel->createCoreMaterialThread( id );
+        calCoreModel->setCoreMaterialId( id, 0, id );
+        atlasMaterials[ m ] = new Material( m, "" );
+
+        if ( !CalSaver::saveCoreMaterial( dir + "/" + name + ".xrf", m ) )
+        {
+            throw std::runtime_error( "Can't save atlas material " + name + ": "
+                                      + CalError::getLastErrorDescription() );
+        }
+
+        materialFiles.push_back( name + ".xrf" );
+
+        for ( size_t i = 0; i < group.size(); i++ )
+        {
+            const AtlasSource* s = group[ i ];
+
+            atlasPlaces[ s->coreMaterial ] = std::make_pair(
+                m, osg::Vec4( (float)s->x / width,
+                              (float)s->y / height,
+                              (float)s->diffuse->s() / width,
+                              (float)s->diffuse->t() / height ) );
+        }
+    }
+
+    // -- Move texture coordinates into atlases --
+    for ( size_t i = 0; i < meshesData.size(); i++ )
+    {
+        MeshData* m = meshesData[ i ].get();
+
+        if ( !atlasPlaces.count( m->coreMaterial ) || !hasUnitTexCoords( m ) )
+        {
+            continue; // mesh with repeated texture keeps source material
+        }
+
+        const std::pair< CalCoreMaterial*, osg::Vec4 >& place = atlasPlaces[ m->coreMaterial ];
+        const osg::Vec4& r = place.second;
+
+        for ( TexCoordBuffer::iterator
+                  tc = m->texCoordBuffer->begin(),
+                  tcEnd = m->texCoordBuffer->end();
+              tc != tcEnd; ++tc )
+        {
+            tc->x() = r.x() + tc->x() * r.z();
+            tc->y() = r.y() + tc->y() * r.w();
+        }
+
+        m->coreMaterial = place.first;
+        m->material = atlasMaterials[ place.first ];
+    }
+
+    return materialFiles;
+}
+
+/**
+ * Merge deformable meshes with the same material and bones palette.
+ * Rigid meshes are left as is, since they can be batched at load time
+ * (see CoreModel::setRigidMeshesBatching) with per mesh visibility.
+ */
+void
+mergeDeformableMeshes( MeshesVector& meshesData )
+    throw (std::runtime_error)
+{
+    MeshesVector merged;
+    std::vector< bool > used( meshesData.size(), false );
+
+    for ( size_t i = 0; i < meshesData.size(); i++ )
+    {
+        if ( used[ i ] )
+        {
+            continue;
+        }
+
+        std::vector< const MeshData* > group( 1, meshesData[ i ].get() );
+
+        for ( size_t j = i + 1; j < meshesData.size() && !meshesData[ i ]->rigid; j++ )
+        {
+            if ( !used[ j ] && canMergeMeshes( meshesData[ i ].get(), meshesData[ j ].get() ) )
+            {
+                group.push_back( meshesData[ j ].get() );
+                used[ j ] = true;
+            }
+        }
+
+        merged.push_back( group.size() == 1
+                          ? meshesData[ i ].get() : mergeMeshes( group ) );
+    }
+
+    meshesData.swap( merged );
+}
+
+/**
+ * Copy .cfg file with atlas materials appended.
+ */
+void
+writeAtlasCfg( const std::string&                cfgFileName,
+               const std::string&                atlasCfgFileName,
+               const std::vector< std::string >& materialFiles )
+    throw (std::runtime_error)
+{
+    std::ifstream in( cfgFileName.c_str(), std::ios::binary );
+    std::ofstream out( atlasCfgFileName.c_str(), std::ios::binary );
+
+    if ( !in || !out )
+    {
+        throw std::runtime_error( "Can't create " + atlasCfgFileName );
+    }
+
+    out << in.rdbuf()
+        << "\n# texture atlases (osgCalPreparer --atlas)\n";
+
+    for ( size_t i = 0; i < materialFiles.size(); i++ )
+    {
+        out << "material=" << materialFiles[ i ] << "\n";
+    }
+
+    if ( !out )
+    {
+        throw std::runtime_error( "Can't write " + atlasCfgFileName );
+    }
 }
 
 int
 main( int argc,
       const char** argv )
 {
-    if ( argc < 2 )
+    int maxBonesPerMesh = Constants::MAX_BONES_PER_MESH;
+    bool atlas = false;
+    int maxAtlasSize = 4096;
+    int argIndex = 1;
+
+    for ( ; argIndex < argc && strncmp( argv[ argIndex ], "--", 2 ) == 0; argIndex++ )
+    {
+        std::string arg = argv[ argIndex ];
+
+        if ( arg == "--dual-quaternion" )
+        {
+            maxBonesPerMesh = Constants::MAX_BONES_PER_MESH_DUAL_QUATERNION;
+        }
+        else if ( arg == "--atlas" )
+        {
+            atlas = true;
+        }
+        else if ( arg == "--atlas-size" && argIndex + 1 < argc )
+        {
+            maxAtlasSize = atoi( argv[ ++argIndex ] );
+        }
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+
+    if ( argc <= argIndex )
     {
         usage();
         return 2;
@@ -49,7 +687,7 @@ main( int argc,
         return 2;                               \
     }
    
-    std::string cfgFileName = argv[ 1 ];
+    std::string cfgFileName = argv[ argIndex ];
 
     std::string dir = osgDB::getFilePath( cfgFileName );
 
@@ -68,16 +706,45 @@ main( int argc,
 
     BRACKET_ERROR( calCoreModel = loadCoreModel( cfgFileName, scale ),
                    "Can't load model:\n%s" );
-    BRACKET_ERROR( loadMeshes( calCoreModel, meshesData ),
+    BRACKET_ERROR( loadMeshes( calCoreModel, meshesData, maxBonesPerMesh ),
                    "Can't load meshes from core model:\n%s" );
     BRACKET_ERROR( saveMeshes( calCoreModel,
                                meshesData,
                                meshesCacheFileName( cfgFileName ) ),
                    "Can't save meshes cache:\n%s" );
 
-    delete calCoreModel;
-
     puts( "ok" );
+
+    printMeshesStatistics( calCoreModel, meshesData );
+
+    if ( atlas )
+    {
+        std::string atlasCfgFileName =
+            osgDB::getNameLessExtension( cfgFileName ) + ".atlas.cfg";
+        std::vector< std::string > materialFiles;
+
+        printf( "Preparing %s  ...  ", atlasCfgFileName.c_str() );
+        fflush( stdout );
+
+        BRACKET_ERROR( materialFiles = buildAtlases( calCoreModel, meshesData,
+                                                     cfgFileName, maxAtlasSize ),
+                       "Can't create atlases:\n%s" );
+        BRACKET_ERROR( mergeDeformableMeshes( meshesData ),
+                       "Can't merge meshes:\n%s" );
+        BRACKET_ERROR( writeAtlasCfg( cfgFileName, atlasCfgFileName, materialFiles ),
+                       "Can't write atlas model:\n%s" );
+        BRACKET_ERROR( saveMeshes( calCoreModel,
+                                   meshesData,
+                                   meshesCacheFileName( atlasCfgFileName ) ),
+                       "Can't save meshes cache:\n%s" );
+
+        puts( "ok" );
+
+        printf( "  %d atlas materials, %d hardware meshes\n",
+                (int)materialFiles.size(), (int)meshesData.size() );
+    }
+
+    delete calCoreModel;
     
     return 0;
 }
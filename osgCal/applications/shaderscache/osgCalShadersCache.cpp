@@ -0,0 +1,243 @@
+/*
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <osg/Geode>
+#include <osg/GLExtensions>
+#include <osg/GraphicsContext>
+#include <osgDB/FileUtils>
+#include <osgUtil/GLObjectsVisitor>
+#include <osgCal/CoreModel>
+#include <osgCal/ShadersCache>
+
+using namespace osgCal;
+
+void
+usage()
+{
+    puts( "Usage: osgCalShadersCache <cache directory> <cal3d.cfg file name> ..." );
+    puts( "" );
+    puts( "Compile and link all shader programs reachable from the specified" );
+    puts( "models (all fog modes, with and without depth first meshes, linear" );
+    puts( "and dual quaternion skinning, with and without transform feedback" );
+    puts( "skinning) and store their binaries in the cache directory. Use the" );
+    puts( "same directory with ShadersCache::setProgramBinariesDirectory (or" );
+    puts( "OSGCAL_PROGRAM_CACHE_DIR) in the application. Exits with failure" );
+    puts( "when some binary can't be written." );
+}
+
+typedef std::set< const osg::Program* > ProgramsSet;
+
+/**
+ * Add node with state set to compile and remember its program.
+ */
+void
+addStateSet( osg::Group* root,
+             osg::StateSet* stateSet,
+             ProgramsSet& programs )
+{
+    osg::Geode* g = new osg::Geode;
+    g->setStateSet( stateSet );
+    root->addChild( g );
+
+    const osg::Program* program = static_cast< const osg::Program* >(
+        stateSet->getAttribute( osg::StateAttribute::PROGRAM ) );
+
+    if ( program )
+    {
+        programs.insert( program );
+    }
+}
+
+/**
+ * Add nodes with all state sets that the core mesh can use with
+ * different mesh parameters. Returns the number of state sets added.
+ */
+int
+addMeshStateSets( osg::Group* root,
+                  const CoreModel* coreModel,
+                  const CoreMesh* mesh,
+                  std::set< osg::StateSet* >& added,
+                  ProgramsSet& programs )
+{
+    static const osg::Fog::Mode fogModes[] =
+        { (osg::Fog::Mode)0, osg::Fog::LINEAR, osg::Fog::EXP, osg::Fog::EXP2 };
+
+    int count = 0;
+
+    for ( int v = 0; v < 4 * 2 * 2 * 2; v++ )
+    {
+        bool dualQuaternion = ( v / 8 ) % 2 != 0;
+
+        if ( !dualQuaternion
+             && mesh->data->rigid == false
+             && mesh->data->getBonesCount() > Constants::MAX_BONES_PER_MESH + 1 )
+        {
+            continue; // mesh can be drawn with dual quaternion skinning only
+        }
+
+        osg::ref_ptr< MeshParameters > p = new MeshParameters( *mesh->parameters );
+        p->software = false;
+        p->fogMode = fogModes[ v % 4 ];
+        p->useDepthFirstMesh = ( v / 4 ) % 2 != 0;
+        p->dualQuaternionSkinning = dualQuaternion;
+        p->transformFeedbackSkinning = ( v / 16 ) % 2 != 0;
+
+        osg::ref_ptr< CoreMesh > m =
+            new CoreMesh( coreModel, mesh, mesh->material.get(), p.get() );
+
+        osg::StateSet* stateSets[] = { m->stateSets->stateSet.get(),
+                                       m->stateSets->staticStateSet.get(),
+                                       m->stateSets->depthOnly.get(),
+                                       m->stateSets->staticDepthOnly.get() };
+
+        for ( size_t s = 0; s < sizeof( stateSets ) / sizeof( stateSets[0] ); s++ )
+        {
+            if ( stateSets[ s ] && added.insert( stateSets[ s ] ).second )
+            {
+                addStateSet( root, stateSets[ s ], programs );
+                count++;
+            }
+        }
+
+        const osg::Program* skinningProgram = m->stateSets->skinningProgram.get();
+
+        if ( skinningProgram && programs.count( skinningProgram ) == 0 )
+        {
+            // transform feedback skinning program has no state set
+            osg::StateSet* ss = new osg::StateSet;
+            ss->setAttribute( const_cast< osg::Program* >( skinningProgram ) );
+            addStateSet( root, ss, programs );
+            count++;
+        }
+    }
+
+    return count;
+}
+
+int
+main( int argc,
+      const char** argv )
+{
+    if ( argc < 3 )
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    ShadersCache::setProgramBinariesDirectory( argv[1] );
+
+    // -- Create state sets for all models --
+    std::vector< osg::ref_ptr< CoreModel > > coreModels;
+    std::set< osg::StateSet* > added;
+    ProgramsSet programs;
+    osg::ref_ptr< osg::Group > root = new osg::Group;
+
+    for ( int i = 2; i < argc; i++ )
+    {
+        osg::ref_ptr< CoreModel > coreModel = new CoreModel;
+
+        try
+        {
+            coreModel->load( argv[i] );
+        }
+        catch ( std::runtime_error& e )
+        {
+            printf( "runtime error during load of %s:\n%s\n", argv[i], e.what() );
+            return EXIT_FAILURE;
+        }
+
+        int stateSets = 0;
+        const CoreModel::MeshVector& meshes = coreModel->getMeshes();
+
+        for ( size_t j = 0; j < meshes.size(); j++ )
+        {
+            stateSets += addMeshStateSets( root.get(), coreModel.get(),
+                                           meshes[j].get(), added, programs );
+        }
+
+        printf( "%s: %d state sets\n", argv[i], stateSets );
+        coreModels.push_back( coreModel );
+    }
+
+    // -- Compile them in offscreen context --
+    osg::ref_ptr< osg::GraphicsContext::Traits > traits = new osg::GraphicsContext::Traits;
+    traits->width = 1;
+    traits->height = 1;
+    traits->pbuffer = true;
+
+    osg::ref_ptr< osg::GraphicsContext > gc =
+        osg::GraphicsContext::createGraphicsContext( traits.get() );
+
+    if ( !gc.valid() || !gc->realize() || !gc->makeCurrent() )
+    {
+        puts( "can't create offscreen graphics context" );
+        return EXIT_FAILURE;
+    }
+
+    gc->getState()->initializeExtensionProcs();
+
+    if ( !gc->getState()->get< osg::GLExtensions >()->isGetProgramBinarySupported )
+    {
+        puts( "GL_ARB_get_program_binary is not supported, nothing to cache" );
+        gc->releaseContext();
+        return EXIT_FAILURE;
+    }
+
+    osgUtil::GLObjectsVisitor compiler( osgUtil::GLObjectsVisitor::COMPILE_STATE_ATTRIBUTES );
+    compiler.setState( gc->getState() );
+    root->accept( compiler );
+
+    // -- Check that binaries were actually written --
+    int cached = 0;
+    int failed = 0;
+
+    for ( ProgramsSet::const_iterator
+              p = programs.begin(),
+              pEnd = programs.end();
+          p != pEnd; ++p )
+    {
+        const CachedProgram* cp = dynamic_cast< const CachedProgram* >( *p );
+        std::string fileName = cp ? cp->getBinaryFileName() : "";
+
+        if ( cp && osgDB::fileExists( fileName ) )
+        {
+            cached++;
+        }
+        else
+        {
+            printf( "program binary is not written: %s\n  %s\n",
+                    (*p)->getName().c_str(),
+                    fileName.empty() ? "(not a cached program)" : fileName.c_str() );
+            failed++;
+        }
+    }
+
+    printf( "%d of %d programs cached in %s\n",
+            cached, (int)programs.size(), argv[1] );
+
+    // release shaders while context is still current
+    root->releaseGLObjects( gc->getState() );
+    for ( size_t i = 0; i < coreModels.size(); i++ )
+    {
+        coreModels[i]->releaseGLObjects( gc->getState() );
+    }
+    gc->releaseContext();
+    gc->close();
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
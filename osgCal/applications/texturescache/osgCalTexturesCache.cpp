@@ -0,0 +1,700 @@
+/*
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <osg/Image>
+#include <osg/Texture>
+#include <osg/Timer>
+#include <osgDB/FileNameUtils>
+#include <osgDB/ReadFile>
+#include <osgDB/WriteFile>
+#include <osgCal/CoreModel>
+#include <osgCal/Material>
+#include <osgCal/StateSetCache>
+
+using namespace osgCal;
+
+void
+usage()
+{
+    puts( "Usage: osgCalTexturesCache [--a8l8] <cal3d.cfg file name> ..." );
+    puts( "" );
+    puts( "Compress maps of the specified models with precomputed mipmaps and" );
+    puts( "store them next to the source maps as <map>.cache.dds, which are" );
+    puts( "loaded instead of the source maps. Diffuse maps are compressed to" );
+    puts( "DXT1 (DXT5 when they have alpha), normals & bump maps are converted" );
+    puts( "to two channels (x in alpha, y in green) and compressed to DXT5." );
+    puts( "  --a8l8  write normals & bump maps as uncompressed A8L8" );
+    puts( "          (the same as osgCalNMExport does)" );
+}
+
+enum MapKind
+{
+    DIFFUSE_MAP,
+    NORMALS_MAP  ///< normals & bump maps (both two channel)
+};
+
+/**
+ * RGBA8 pixels of one mip level. Normals map pixels keep unpacked
+ * normal (x, y, z) in rgb.
+ */
+struct Pixels
+{
+        int                          width;
+        int                          height;
+        std::vector< unsigned char > rgba;
+
+        unsigned char* at( int x, int y ) { return &rgba[ ( y * width + x ) * 4 ]; }
+        const unsigned char* at( int x, int y ) const { return &rgba[ ( y * width + x ) * 4 ]; }
+};
+
+// -- Normals (same as osgCalNMExport) --
+
+inline
+double
+colorToVector( unsigned char c )
+{
+    return ( static_cast< double >( c ) - 127 ) / 127;
+}
+
+inline
+unsigned char
+vectorToColor( double c )
+{
+    return static_cast< unsigned char >(
+        osg::clampBetween( floor( c * 127 + 127 + 0.5 ), 0.0, 255.0 ) );
+}
+
+/**
+ * Recalculate z from x & y, so mipmaps are built from normalized
+ * vectors (as normalizeZ in osgCalNMExport).
+ */
+static
+void
+normalizeZ( unsigned char* p )
+{
+    double x = colorToVector( p[0] );
+    double y = colorToVector( p[1] );
+
+    p[2] = vectorToColor( sqrt( std::max( 0.0, 1 - ( x*x + y*y ) ) ) );
+}
+
+static
+void
+normalizeRGB( unsigned char* p )
+{
+    double x = colorToVector( p[0] );
+    double y = colorToVector( p[1] );
+    double z = colorToVector( p[2] );
+
+    double length = sqrt( x*x + y*y + z*z );
+
+    if ( length > 0.0 )
+    {
+        double scale = 1 / length;
+
+        p[0] = vectorToColor( x*scale );
+        p[1] = vectorToColor( y*scale );
+        p[2] = vectorToColor( z*scale );
+    }
+}
+
+/**
+ * Read source image into pixels. Normals are taken from rgb or
+ * from already converted A8L8 map (x in alpha, y in luminance).
+ */
+static
+void
+readPixels( const osg::Image* img,
+            MapKind           kind,
+            Pixels&           p )
+{
+    p.width = img->s();
+    p.height = img->t();
+    p.rgba.resize( p.width * p.height * 4 );
+
+    const bool a8l8 = ( img->getPixelFormat() == GL_LUMINANCE_ALPHA );
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif // _OPENMP
+    for ( int y = 0; y < p.height; y++ )
+    {
+        for ( int x = 0; x < p.width; x++ )
+        {
+            osg::Vec4 c = img->getColor( x, y );
+            unsigned char* d = p.at( x, y );
+
+            for ( int i = 0; i < 4; i++ )
+            {
+                d[i] = (unsigned char)osg::clampBetween( floor( c[i] * 255 + 0.5 ), 0.0, 255.0 );
+            }
+
+            if ( kind == NORMALS_MAP )
+            {
+                if ( a8l8 )
+                {
+                    d[0] = d[3]; // x (a => r), y is already in g
+                }
+
+                d[3] = 255;
+                normalizeZ( d );
+            }
+        }
+    }
+}
+
+/**
+ * Build next mip level with box filter (odd sizes are clamped).
+ */
+static
+void
+downsample( const Pixels& src,
+            MapKind       kind,
+            Pixels&       dst )
+{
+    dst.width = std::max( 1, src.width / 2 );
+    dst.height = std::max( 1, src.height / 2 );
+    dst.rgba.resize( dst.width * dst.height * 4 );
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif // _OPENMP
+    for ( int y = 0; y < dst.height; y++ )
+    {
+        const int y0 = std::min( y*2, src.height - 1 );
+        const int y1 = std::min( y*2 + 1, src.height - 1 );
+
+        for ( int x = 0; x < dst.width; x++ )
+        {
+            const int x0 = std::min( x*2, src.width - 1 );
+            const int x1 = std::min( x*2 + 1, src.width - 1 );
+
+            const unsigned char* s00 = src.at( x0, y0 );
+            const unsigned char* s01 = src.at( x1, y0 );
+            const unsigned char* s10 = src.at( x0, y1 );
+            const unsigned char* s11 = src.at( x1, y1 );
+            unsigned char* d = dst.at( x, y );
+
+            for ( int i = 0; i < 4; i++ )
+            {
+                d[i] = ( s00[i] + s01[i] + s10[i] + s11[i] + 2 ) / 4;
+            }
+
+            if ( kind == NORMALS_MAP )
+            {
+                normalizeRGB( d );
+            }
+        }
+    }
+}
+
+// -- Block compression --
+
+static
+unsigned short
+toRGB565( const int* c )
+{
+    return ( ( c[0] >> 3 ) << 11 ) | ( ( c[1] >> 2 ) << 5 ) | ( c[2] >> 3 );
+}
+
+static
+void
+fromRGB565( unsigned short v,
+            int*           c )
+{
+    c[0] = ( v >> 11 ) & 31;  c[0] = ( c[0] << 3 ) | ( c[0] >> 2 );
+    c[1] = ( v >> 5 ) & 63;   c[1] = ( c[1] << 2 ) | ( c[1] >> 4 );
+    c[2] = v & 31;            c[2] = ( c[2] << 3 ) | ( c[2] >> 2 );
+}
+
+/**
+ * Encode 4x4 block colors as DXT1 (4 colors mode). Endpoints are
+ * taken from block bounding box (inset by 1/16) with diagonal
+ * chosen by red/blue & green covariance.
+ */
+static
+void
+encodeColorBlock( const unsigned char block[16][4],
+                  unsigned char*      out )
+{
+    int mn[3] = { 255, 255, 255 };
+    int mx[3] = { 0, 0, 0 };
+    int mean[3] = { 0, 0, 0 };
+
+    for ( int i = 0; i < 16; i++ )
+    {
+        for ( int c = 0; c < 3; c++ )
+        {
+            mn[c] = std::min( mn[c], (int)block[i][c] );
+            mx[c] = std::max( mx[c], (int)block[i][c] );
+            mean[c] += block[i][c];
+        }
+    }
+
+    int covRG = 0;
+    int covBG = 0;
+
+    for ( int i = 0; i < 16; i++ )
+    {
+        int g = block[i][1] * 16 - mean[1];
+        covRG += ( block[i][0] * 16 - mean[0] ) * g;
+        covBG += ( block[i][2] * 16 - mean[2] ) * g;
+    }
+
+    if ( covRG < 0 ) std::swap( mn[0], mx[0] );
+    if ( covBG < 0 ) std::swap( mn[2], mx[2] );
+
+    for ( int c = 0; c < 3; c++ )
+    {
+        int inset = ( mx[c] - mn[c] ) / 16;
+        mx[c] -= inset;
+        mn[c] += inset;
+    }
+
+    unsigned short c0 = toRGB565( mx );
+    unsigned short c1 = toRGB565( mn );
+
+    if ( c0 < c1 )
+    {
+        std::swap( c0, c1 );
+    }
+
+    unsigned int indices = 0;
+
+    if ( c0 != c1 )
+    {
+        int palette[4][3];
+        fromRGB565( c0, palette[0] );
+        fromRGB565( c1, palette[1] );
+
+        for ( int c = 0; c < 3; c++ )
+        {
+            palette[2][c] = ( 2 * palette[0][c] + palette[1][c] ) / 3;
+            palette[3][c] = ( palette[0][c] + 2 * palette[1][c] ) / 3;
+        }
+
+        for ( int i = 0; i < 16; i++ )
+        {
+            int best = 0;
+            int bestDistance = 0x7FFFFFFF;
+
+            for ( int p = 0; p < 4; p++ )
+            {
+                int distance = 0;
+
+                for ( int c = 0; c < 3; c++ )
+                {
+                    int d = block[i][c] - palette[p][c];
+                    distance += d * d;
+                }
+
+                if ( distance < bestDistance )
+                {
+                    best = p;
+                    bestDistance = distance;
+                }
+            }
+
+            indices |= best << ( i * 2 );
+        }
+    }
+
+    out[0] = c0 & 0xFF;  out[1] = c0 >> 8;
+    out[2] = c1 & 0xFF;  out[3] = c1 >> 8;
+
+    for ( int i = 0; i < 4; i++ )
+    {
+        out[4 + i] = ( indices >> ( i * 8 ) ) & 0xFF;
+    }
+}
+
+/**
+ * Encode 4x4 block alpha as DXT5 alpha block (8 alphas mode).
+ */
+static
+void
+encodeAlphaBlock( const unsigned char block[16][4],
+                  unsigned char*      out )
+{
+    int a0 = 0;
+    int a1 = 255;
+
+    for ( int i = 0; i < 16; i++ )
+    {
+        a0 = std::max( a0, (int)block[i][3] );
+        a1 = std::min( a1, (int)block[i][3] );
+    }
+
+    unsigned long long indices = 0;
+
+    if ( a0 != a1 )
+    {
+        int palette[8] = { a0, a1 };
+
+        for ( int p = 2; p < 8; p++ )
+        {
+            palette[p] = ( ( 8 - p ) * a0 + ( p - 1 ) * a1 ) / 7;
+        }
+
+        for ( int i = 0; i < 16; i++ )
+        {
+            int best = 0;
+
+            for ( int p = 1; p < 8; p++ )
+            {
+                if ( abs( block[i][3] - palette[p] ) < abs( block[i][3] - palette[best] ) )
+                {
+                    best = p;
+                }
+            }
+
+            indices |= (unsigned long long)best << ( i * 3 );
+        }
+    }
+
+    out[0] = a0;
+    out[1] = a1;
+
+    for ( int i = 0; i < 6; i++ )
+    {
+        out[2 + i] = ( indices >> ( i * 8 ) ) & 0xFF;
+    }
+}
+
+/**
+ * Compress mip level to DXT1 or DXT5 (with alpha) blocks, partial
+ * border blocks repeat edge pixels.
+ */
+static
+void
+compressLevel( const Pixels&                 p,
+               bool                          alpha,
+               std::vector< unsigned char >& out )
+{
+    const int blocksWide = ( p.width + 3 ) / 4;
+    const int blocksHigh = ( p.height + 3 ) / 4;
+    const int blockSize = alpha ? 16 : 8;
+
+    size_t offset = out.size();
+    out.resize( offset + blocksWide * blocksHigh * blockSize );
+    unsigned char* data = &out[ offset ];
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif // _OPENMP
+    for ( int by = 0; by < blocksHigh; by++ )
+    {
+        unsigned char block[16][4];
+
+        for ( int bx = 0; bx < blocksWide; bx++ )
+        {
+            for ( int i = 0; i < 16; i++ )
+            {
+                memcpy( block[i],
+                        p.at( std::min( bx*4 + i % 4, p.width - 1 ),
+                              std::min( by*4 + i / 4, p.height - 1 ) ),
+                        4 );
+            }
+
+            unsigned char* b = data + ( by * blocksWide + bx ) * blockSize;
+
+            if ( alpha )
+            {
+                encodeAlphaBlock( block, b );
+                b += 8;
+            }
+
+            encodeColorBlock( block, b );
+        }
+    }
+}
+
+/**
+ * Pack normals as two channel map: x in alpha, y in green
+ * (luminance for A8L8), as makeA8L8fromRGB in osgCalNMExport.
+ */
+static
+void
+packNormals( Pixels&                       p,
+             bool                          a8l8,
+             std::vector< unsigned char >& out )
+{
+    const int count = p.width * p.height;
+
+    if ( a8l8 )
+    {
+        size_t offset = out.size();
+        out.resize( offset + count * 2 );
+
+        for ( int i = 0; i < count; i++ )
+        {
+            out[ offset + i*2 ]     = p.rgba[ i*4 + 1 ]; // y (g => lum)
+            out[ offset + i*2 + 1 ] = p.rgba[ i*4 ];     // x (r => a)
+        }
+    }
+    else
+    {
+        // DXT5 with red & blue zeroed, so color endpoints fit green only
+        for ( int i = 0; i < count; i++ )
+        {
+            unsigned char* d = &p.rgba[ i*4 ];
+            d[3] = d[0];
+            d[0] = 0;
+            d[2] = 0;
+        }
+
+        compressLevel( p, true, out );
+    }
+}
+
+/**
+ * Convert map to compressed (or A8L8 for normals) image with mipmaps
+ * and write it to TexturesCache::cacheFileName. Returns false when
+ * map is already compressed (or it is not 2D).
+ */
+bool
+prepareTexture( const std::string& fileName,
+                MapKind            kind,
+                bool               a8l8,
+                size_t&            sourceSize,
+                size_t&            cacheSize )
+    throw (std::runtime_error)
+{
+    osg::ref_ptr< osg::Image > img = osgDB::readImageFile( fileName );
+
+    if ( !img.valid() )
+    {
+        throw std::runtime_error( "Can't load " + fileName );
+    }
+
+    if ( img->isCompressed() || img->r() != 1 )
+    {
+        return false;
+    }
+
+    const bool alpha = ( kind == DIFFUSE_MAP
+                         && osg::Image::computeNumComponents( img->getPixelFormat() ) == 4 );
+
+    Pixels level;
+    readPixels( img.get(), kind, level );
+    sourceSize = img->getTotalSizeInBytes();
+    img = 0;
+
+    // -- Compress all mip levels --
+    std::vector< unsigned char > data;
+    osg::Image::MipmapDataType mipmapOffsets;
+    const int width = level.width;
+    const int height = level.height;
+
+    for ( ;; )
+    {
+        if ( kind == NORMALS_MAP )
+        {
+            Pixels packed = level; // level is downsampled further
+            packNormals( packed, a8l8, data );
+        }
+        else
+        {
+            compressLevel( level, alpha, data );
+        }
+
+        if ( level.width == 1 && level.height == 1 )
+        {
+            break;
+        }
+
+        Pixels next;
+        downsample( level, kind, next );
+        level.width = next.width;
+        level.height = next.height;
+        level.rgba.swap( next.rgba );
+
+        mipmapOffsets.push_back( data.size() );
+    }
+
+    GLenum internalFormat;
+    GLenum pixelFormat;
+
+    if ( kind == NORMALS_MAP && a8l8 )
+    {
+        internalFormat = GL_LUMINANCE8_ALPHA8;
+        pixelFormat = GL_LUMINANCE_ALPHA;
+    }
+    else
+    {
+        internalFormat = pixelFormat = ( kind == NORMALS_MAP || alpha
+                                         ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+                                         : GL_COMPRESSED_RGB_S3TC_DXT1_EXT );
+    }
+
+    unsigned char* imageData = new unsigned char[ data.size() ];
+    memcpy( imageData, &data[0], data.size() );
+
+    osg::ref_ptr< osg::Image > cache = new osg::Image;
+    cache->setImage( width, height, 1,
+                     internalFormat, pixelFormat, GL_UNSIGNED_BYTE,
+                     imageData, osg::Image::USE_NEW_DELETE );
+    cache->setMipmapLevels( mipmapOffsets );
+
+    std::string cacheFileName = TexturesCache::cacheFileName( fileName );
+
+    if ( !osgDB::writeImageFile( *cache, cacheFileName ) )
+    {
+        throw std::runtime_error( "Can't write " + cacheFileName );
+    }
+
+    cacheSize = data.size();
+
+    return true;
+}
+
+/**
+ * Add maps of all model materials.
+ */
+void
+addModelTextures( const std::string&                cfgFileName,
+                  std::map< std::string, MapKind >& textures )
+    throw (std::runtime_error)
+{
+    std::string dir = osgDB::getFilePath( cfgFileName );
+
+    if ( dir == "" )
+    {
+        dir = ".";
+    }
+
+    float scale;
+    CalCoreModel* calCoreModel = loadCoreModel( cfgFileName, scale, true );
+
+    for ( int i = 0; i < calCoreModel->getCoreMaterialCount(); i++ )
+    {
+        Material material( calCoreModel->getCoreMaterial( i ), dir );
+
+        if ( !material.diffuseMap.empty() )
+        {
+            textures.insert( std::make_pair( material.diffuseMap, DIFFUSE_MAP ) );
+        }
+
+        if ( !material.normalsMap.empty() )
+        {
+            textures.insert( std::make_pair( material.normalsMap, NORMALS_MAP ) );
+        }
+
+        if ( !material.bumpMap.empty() )
+        {
+            textures.insert( std::make_pair( material.bumpMap, NORMALS_MAP ) );
+        }
+    }
+
+    delete calCoreModel;
+}
+
+int
+main( int argc,
+      const char** argv )
+{
+    bool a8l8 = false;
+    int argIndex = 1;
+
+    for ( ; argIndex < argc && strncmp( argv[ argIndex ], "--", 2 ) == 0; argIndex++ )
+    {
+        std::string arg = argv[ argIndex ];
+
+        if ( arg == "--a8l8" )
+        {
+            a8l8 = true;
+        }
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ( argc <= argIndex )
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    // -- Collect maps of all models --
+    std::map< std::string, MapKind > textures;
+
+    for ( int i = argIndex; i < argc; i++ )
+    {
+        try
+        {
+            addModelTextures( argv[i], textures );
+        }
+        catch ( std::runtime_error& e )
+        {
+            printf( "runtime error during load of %s:\n%s\n", argv[i], e.what() );
+            return EXIT_FAILURE;
+        }
+    }
+
+    // -- Prepare them --
+    int failed = 0;
+    size_t totalSourceSize = 0;
+    size_t totalCacheSize = 0;
+    osg::Timer_t start = osg::Timer::instance()->tick();
+
+    for ( std::map< std::string, MapKind >::const_iterator
+              t = textures.begin(),
+              tEnd = textures.end();
+          t != tEnd; ++t )
+    {
+        printf( "%s  ...  ", t->first.c_str() );
+        fflush( stdout );
+
+        size_t sourceSize = 0;
+        size_t cacheSize = 0;
+
+        try
+        {
+            if ( !prepareTexture( t->first, t->second, a8l8, sourceSize, cacheSize ) )
+            {
+                puts( "already compressed, skipped" );
+                continue;
+            }
+        }
+        catch ( std::runtime_error& e )
+        {
+            printf( "failed:\n%s\n", e.what() );
+            failed++;
+            continue;
+        }
+
+        printf( "%d KB -> %d KB (with mipmaps)\n",
+                (int)( sourceSize / 1024 ), (int)( cacheSize / 1024 ) );
+
+        totalSourceSize += sourceSize;
+        totalCacheSize += cacheSize;
+    }
+
+    printf( "%d maps, %d KB -> %d KB in %.2f s\n",
+            (int)textures.size(),
+            (int)( totalSourceSize / 1024 ), (int)( totalCacheSize / 1024 ),
+            osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() ) );
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
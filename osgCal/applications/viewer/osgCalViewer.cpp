@@ -35,6 +35,8 @@
 
 #include <osgCal/CoreModel>
 #include <osgCal/Model>
+#include <osgCal/ShadersCache>
+#include <osgCal/Profiler>
 
 osg::Node*
 makeModel( osgCal::CoreModel* cm,
@@ -217,6 +219,58 @@ class ToggleHandler : public osgGA::GUIEventHandler
 };
 
 
+/**
+ * Show osgCal::Profiler timings and counters in StatsHandler.
+ */
+void
+addProfilerStatsLines( osgViewer::StatsHandler* statsHandler )
+{
+    static const char* timingLabels[ osgCal::Profiler::TIMINGS_COUNT ] =
+    {
+        "osgCal update: ",
+        "Mixer animation: ",
+        "Mixer skeleton: ",
+        "Bones update: ",
+        "Skinning: ",
+        "Bone uniforms: ",
+        "DL compile: ",
+        "Morphing: ",
+        "Cloth: ",
+    };
+
+    static const char* counterLabels[ osgCal::Profiler::COUNTERS_COUNT ] =
+    {
+        "Models updated: ",
+        "Bones changed: ",
+        "Vertices skinned: ",
+        "osgCal draws: ",
+        "DLs compiled: ",
+        "Bytes freed: ",
+        "Feedback vertices: ",
+        "Vertices morphed: ",
+        "Cloth particles: ",
+    };
+
+    osg::Vec4 timingColor( 1.0f, 0.6f, 0.2f, 1.0f );
+    osg::Vec4 counterColor( 0.6f, 0.8f, 1.0f, 1.0f );
+
+    for ( int i = 0; i < osgCal::Profiler::TIMINGS_COUNT; i++ )
+    {
+        statsHandler->addUserStatsLine(
+            timingLabels[ i ], timingColor, timingColor,
+            osgCal::Profiler::getTimingStatsName( (osgCal::Profiler::Timing)i ),
+            1000.0f /* ms */, true, false, "", "", 1000.0f );
+    }
+
+    for ( int i = 0; i < osgCal::Profiler::COUNTERS_COUNT; i++ )
+    {
+        statsHandler->addUserStatsLine(
+            counterLabels[ i ], counterColor, counterColor,
+            osgCal::Profiler::getCounterStatsName( (osgCal::Profiler::Counter)i ),
+            1.0f, false, false, "", "", 1e9f );
+    }
+}
+
 class CompileStateSets : public osg::Operation
 {
     public:
@@ -254,8 +308,16 @@ main( int argc,
     arguments.getApplicationUsage()->setCommandLineUsage("osgCalViewer [options] cal3d.cfg ...");
     arguments.getApplicationUsage()->addCommandLineOption("--sw", "Use software skinning and fixed-function drawing");
     arguments.getApplicationUsage()->addCommandLineOption("--hw", "Use hardware (GLSL) skinning and drawing");
+    arguments.getApplicationUsage()->addCommandLineOption("--dq", "Use dual quaternion skinning (and split meshes up to 60 bones when there is no meshes cache)");
+    arguments.getApplicationUsage()->addCommandLineOption("--tf", "Skin meshes once per update to transform feedback buffers and draw all passes from them");
     arguments.getApplicationUsage()->addCommandLineOption("--df", "Use depth first meshes (improve performance when pixel shading is a bottleneck)");
+    arguments.getApplicationUsage()->addCommandLineOption("--batch", "Draw rigid meshes attached to the same bone with the same material as one batch");
     arguments.getApplicationUsage()->addCommandLineOption("--no-debug", "Don't display debug information");
+    arguments.getApplicationUsage()->addCommandLineOption("--program-cache <dir>", "Store linked shader program binaries in <dir> to speed up next runs");
+    arguments.getApplicationUsage()->addCommandLineOption("--memory", "Print memory usage of the loaded core model and model");
+    arguments.getApplicationUsage()->addCommandLineOption("--stream-animations <MB>", "Load animations on demand keeping up to <MB> megabytes of unused animations (0 - no limit)");
+    arguments.getApplicationUsage()->addCommandLineOption("--trace <file>", "Write Chrome trace (chrome://tracing) of osgCal timings to <file> (needs osgCal built with OSGCAL_PROFILING)");
+    arguments.getApplicationUsage()->addEnvironmentalVariable("OSGCAL_PROGRAM_CACHE_DIR <dir>", "Default directory for linked shader program binaries");
     arguments.getApplicationUsage()->addCommandLineOption("--four-window", "Run viewer in four window setup (to test multi-context applications)");
     arguments.getApplicationUsage()->addCommandLineOption("-h or --help","Display command line parameters");
     arguments.getApplicationUsage()->addCommandLineOption("--help-env","Display environmental variables available");
@@ -286,6 +348,21 @@ main( int argc,
         return 1;
     }
     
+    std::string programCacheDir;
+    while ( arguments.read( "--program-cache", programCacheDir ) )
+    {
+        osgCal::ShadersCache::setProgramBinariesDirectory( programCacheDir );
+    }
+
+    std::string traceFileName;
+    while ( arguments.read( "--trace", traceFileName ) ) {}
+
+    bool printMemoryUsage = false;
+    while ( arguments.read( "--memory" ) )
+    {
+        printMemoryUsage = true;
+    }
+
     std::string fn;
 
     // note currently doesn't delete the loaded file entries from the command line yet...
@@ -325,6 +402,28 @@ main( int argc,
             p->useDepthFirstMesh = true;
         }
 
+        while ( arguments.read( "--dq" ) )
+        {
+            p->dualQuaternionSkinning = true;
+            coreModel->setMaxBonesPerMesh( osgCal::Constants::MAX_BONES_PER_MESH_DUAL_QUATERNION );
+        }
+
+        while ( arguments.read( "--tf" ) )
+        {
+            p->transformFeedbackSkinning = true;
+        }
+
+        while ( arguments.read( "--batch" ) )
+        {
+            coreModel->setRigidMeshesBatching( true );
+        }
+
+        int streamBudget = 0;
+        while ( arguments.read( "--stream-animations", streamBudget ) )
+        {
+            coreModel->setAnimationStreaming( true, streamBudget * 1024 * 1024 );
+        }
+
         while ( arguments.read( "--sw" ) )
         {
             p->software = true;
@@ -401,6 +500,17 @@ main( int argc,
                                    meshAdder.get(),
                                    animNum ) );
 
+        if ( printMemoryUsage )
+        {
+            osgCal::Model* model = static_cast< osgCal::Model* >(
+                root->getChild( root->getNumChildren() - 1 ) );
+
+            std::cout << "core model memory usage:" << std::endl
+                      << coreModel->getMemoryUsage()
+                      << "model memory usage:" << std::endl
+                      << model->getMemoryUsage();
+        }
+
         animationNames = coreModel->getAnimationNames();
     } // end of model's ref_ptr scope
 
@@ -428,7 +538,12 @@ main( int argc,
     viewer.addEventHandler( new osgViewer::WindowSizeHandler );
 
     // add the stats handler
-    viewer.addEventHandler( new osgViewer::StatsHandler );
+    osgViewer::StatsHandler* statsHandler = new osgViewer::StatsHandler;
+    if ( osgCal::Profiler::isCompiledIn() )
+    {
+        addProfilerStatsLines( statsHandler );
+    }
+    viewer.addEventHandler( statsHandler );
 
     // add the help handler
     viewer.addEventHandler(new osgViewer::HelpHandler( arguments.getApplicationUsage() ) );
@@ -506,6 +621,11 @@ main( int argc,
     viewer.setRealizeOperation( new CompileStateSets( lightSource0 ) );
     viewer.realize();
 
+    if ( !traceFileName.empty() )
+    {
+        osgCal::Profiler::startTrace();
+    }
+
     // -- Main loop --
     osg::Timer_t startTick = osg::Timer::instance()->tick();
 
@@ -534,6 +654,15 @@ main( int argc,
             pauseState == Unpaused ? tick : pauseStartTick );
 
         viewer.frame( currentTime - totalPauseTime );
+
+        osgCal::Profiler::recordFrame( viewer.getViewerStats(),
+                                       viewer.getFrameStamp()->getFrameNumber() );
+    }
+
+    if ( !traceFileName.empty()
+         && !osgCal::Profiler::stopTrace( traceFileName ) )
+    {
+        std::cout << "can't write " << traceFileName << std::endl;
     }
 
 //    viewer.setSceneData( new osg::Group() ); // destroy scene data before viewer
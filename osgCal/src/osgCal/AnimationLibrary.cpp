@@ -0,0 +1,187 @@
+/* -*- c++ -*-
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <stdio.h>
+
+#include <osg/observer_ptr>
+#include <osgDB/FileUtils>
+#include <OpenThreads/ScopedLock>
+
+#include <cal3d/coretrack.h>
+
+#include <osgCal/AnimationLibrary>
+
+using namespace osgCal;
+
+void
+AnimationLibrary::destroyTracks( CalCoreAnimation* a )
+{
+    // TODO: report CoreTrack memory leak problem to cal3d maintainers
+    std::list<CalCoreTrack *>& ct = a->getListCoreTrack();
+    for ( std::list<CalCoreTrack *>::iterator
+              t = ct.begin(),
+              tEnd = ct.end();
+          t != tEnd; ++t )
+    {
+        (*t)->destroy();
+        delete (*t);
+    }
+    ct.clear();
+}
+
+static void
+freeAnimation( CalCoreAnimation* a )
+{
+    AnimationLibrary::destroyTracks( a );
+
+    if ( a->decRef() )
+    {
+        delete a;
+    }
+}
+
+AnimationLibrary::AnimationLibrary()
+{
+}
+
+AnimationLibrary::~AnimationLibrary()
+{
+    // all core models must be released already, but free whatever
+    // is left anyway
+    for ( AnimationsMap::iterator
+              a = animations.begin(),
+              aEnd = animations.end();
+          a != aEnd; ++a )
+    {
+        freeAnimation( a->second.animation );
+    }
+}
+
+CalCoreAnimation*
+AnimationLibrary::acquire( const std::string& fileName,
+                           const std::string& name,
+                           const std::string& skeletonSignature,
+                           float              scale )
+{
+    Key key;
+    key.fileName = osgDB::getRealPath( fileName );
+    key.skeletonSignature = skeletonSignature;
+    key.scale = scale;
+
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    AnimationsMap::iterator a = animations.find( key );
+
+    if ( a != animations.end() )
+    {
+        a->second.usersCount++;
+        return a->second.animation;
+    }
+
+    CalCoreAnimation* animation = CalLoader::loadCoreAnimation( fileName );
+    if ( animation == 0 )
+    {
+        return 0;
+    }
+
+    animation->incRef(); // library reference
+    animation->setName( name );
+
+    if ( scale != 1.0f )
+    {
+        animation->scale( scale );
+    }
+
+    Entry e;
+    e.animation = animation;
+    e.usersCount = 1;
+
+    animations[ key ] = e;
+    keys[ animation ] = key;
+
+    return animation;
+}
+
+void
+AnimationLibrary::release( CalCoreAnimation* animation )
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    KeysMap::iterator k = keys.find( animation );
+
+    if ( k == keys.end() )
+    {
+        return; // not from library
+    }
+
+    AnimationsMap::iterator a = animations.find( k->second );
+
+    if ( --a->second.usersCount > 0 )
+    {
+        return;
+    }
+
+    animations.erase( a );
+    keys.erase( k );
+
+    freeAnimation( animation );
+}
+
+int
+AnimationLibrary::getAnimationsCount() const
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    return animations.size();
+}
+
+std::string
+AnimationLibrary::getSkeletonSignature( CalCoreSkeleton* skeleton )
+{
+    std::vector< CalCoreBone* >& bones = skeleton->getVectorCoreBone();
+
+    // FNV-1a over bone names & parent ids
+    unsigned int hash = 2166136261u;
+
+    for ( size_t i = 0; i < bones.size(); i++ )
+    {
+        const std::string& name = bones[i]->getName();
+
+        for ( size_t j = 0; j < name.size(); j++ )
+        {
+            hash = ( hash ^ (unsigned char)name[j] ) * 16777619u;
+        }
+
+        hash = ( hash ^ (unsigned int)( bones[i]->getParentId() + 1 ) ) * 16777619u;
+    }
+
+    char signature[ 32 ];
+    sprintf( signature, "%u:%08x", (unsigned int)bones.size(), hash );
+
+    return signature;
+}
+
+static osg::observer_ptr< AnimationLibrary >  animationLibrary;
+
+AnimationLibrary*
+AnimationLibrary::instance()
+{
+    if ( !animationLibrary.valid() )
+    {
+        animationLibrary = new AnimationLibrary;
+    }
+
+    return animationLibrary.get();
+}
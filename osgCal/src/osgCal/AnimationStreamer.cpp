@@ -0,0 +1,473 @@
+/* -*- c++ -*-
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <string.h>
+#include <fstream>
+
+#include <osg/Notify>
+#include <osgDB/FileNameUtils>
+#include <OpenThreads/ScopedLock>
+
+#include <cal3d/coretrack.h>
+#include <cal3d/corekeyframe.h>
+
+#include <osgCal/AnimationLibrary>
+#include <osgCal/AnimationStreamer>
+
+using namespace osgCal;
+
+AnimationStreamer::Stats::Stats()
+    : hits( 0 )
+    , misses( 0 )
+    , loads( 0 )
+    , evictions( 0 )
+    , stallTime( 0 )
+    , loadedBytes( 0 )
+{
+}
+
+class AnimationStreamer::LoadOperation : public osg::Operation
+{
+    public:
+
+        LoadOperation( AnimationStreamer* s,
+                       int                i )
+            : osg::Operation( "osgCal animation load", false )
+            , streamer( s )
+            , id( i )
+        {}
+
+        virtual void operator () ( osg::Object* )
+        {
+            streamer->load( id );
+        }
+
+    private:
+
+        // streamer stops the thread before destruction
+        AnimationStreamer* streamer;
+        int                id;
+};
+
+AnimationStreamer::AnimationStreamer( size_t budget )
+    : scale( 1.0f )
+    , memoryBudget( budget )
+    , useCounter( 0 )
+{
+}
+
+AnimationStreamer::~AnimationStreamer()
+{
+    // core animations can be already deleted (when core model
+    // loading failed), so only loading thread is stopped here
+    if ( thread.valid() )
+    {
+        thread->cancel();
+    }
+
+    for ( std::vector< Clip >::iterator
+              c = clips.begin(),
+              cEnd = clips.end();
+          c != cEnd; ++c )
+    {
+        if ( c->loaded )
+        {
+            AnimationLibrary::destroyTracks( c->loaded );
+            delete c->loaded;
+        }
+    }
+}
+
+void
+AnimationStreamer::setMemoryBudget( size_t bytes )
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    memoryBudget = bytes;
+    ++pendingUpdates;
+}
+
+size_t
+AnimationStreamer::getMemoryBudget() const
+{
+    return memoryBudget;
+}
+
+void
+AnimationStreamer::setScale( float s )
+{
+    scale = s;
+}
+
+/**
+ * Read duration from binary animation file header.
+ */
+static bool
+readDuration( const std::string& fileName,
+              float&             duration )
+{
+    std::ifstream file( fileName.c_str(), std::ios::in | std::ios::binary );
+
+    if ( !file )
+    {
+        return false;
+    }
+
+    CalStreamSource source( file );
+
+    char magic[4];
+    int  version;
+
+    return source.readBytes( &magic[0], 4 )
+        && memcmp( &magic[0], Cal::ANIMATION_FILE_MAGIC, 4 ) == 0
+        && source.readInteger( version )
+        && source.readFloat( duration )
+        && duration > 0.0f;
+}
+
+int
+AnimationStreamer::addAnimation( CalCoreModel*      calCoreModel,
+                                 const std::string& fileName,
+                                 const std::string& name )
+    throw (std::runtime_error)
+{
+    float duration = 0;
+
+    if ( osgDB::getLowerCaseFileExtension( fileName ) != "caf"
+         || !readDuration( fileName, duration ) )
+    {
+        // XML animation (or unknown header), load it once to get
+        // duration
+        CalCoreAnimation* a = CalLoader::loadCoreAnimation( fileName );
+
+        if ( a == 0 )
+        {
+            throw std::runtime_error(
+                "Can't load animation " + name + ": "
+                + CalError::getLastErrorDescription() );
+        }
+
+        duration = a->getDuration();
+        AnimationLibrary::destroyTracks( a );
+        delete a;
+    }
+
+    CalCoreAnimation* animation = new CalCoreAnimation();
+    animation->setName( name );
+    animation->setFilename( fileName );
+    animation->setDuration( duration );
+
+    Clip c;
+    c.fileName = fileName;
+    c.animation = animation;
+    c.loaded = 0;
+    c.state = UNLOADED;
+    c.pinCount = 0;
+    c.bytes = 0;
+    c.lastUse = 0;
+    c.missTime = 0;
+
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    if ( calCoreModel->getCoreAnimationCount() != (int)clips.size() )
+    {
+        // clips are indexed by core animation id
+        delete animation;
+        throw std::runtime_error(
+            "Can't stream animation " + name
+            + ": all core model animations must be streamed" );
+    }
+
+    clips.push_back( c );
+
+    return calCoreModel->addCoreAnimation( animation );
+}
+
+void
+AnimationStreamer::prefetch( int id )
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    if ( id >= (int)clips.size() )
+    {
+        return; // added after load, not streamed
+    }
+
+    Clip& c = clips[ id ];
+
+    c.lastUse = ++useCounter;
+
+    if ( c.state != UNLOADED )
+    {
+        return;
+    }
+
+    c.state = LOADING;
+
+    if ( !thread.valid() )
+    {
+        thread = new osg::OperationThread;
+        thread->startThread();
+    }
+
+    thread->add( new LoadOperation( this, id ) );
+}
+
+void
+AnimationStreamer::request( int id )
+{
+    {
+        OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+        if ( id >= (int)clips.size() )
+        {
+            return;
+        }
+
+        Clip& c = clips[ id ];
+
+        if ( c.state == LOADED )
+        {
+            stats.hits++;
+        }
+        else
+        {
+            stats.misses++;
+
+            if ( c.missTime == 0 && c.state != FAILED )
+            {
+                c.missTime = osg::Timer::instance()->tick();
+            }
+        }
+    }
+
+    prefetch( id );
+}
+
+bool
+AnimationStreamer::isLoaded( int id ) const
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    return id >= (int)clips.size() || clips[ id ].state == LOADED;
+}
+
+void
+AnimationStreamer::pin( int id )
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    if ( id < (int)clips.size() )
+    {
+        clips[ id ].pinCount++;
+    }
+}
+
+void
+AnimationStreamer::unpin( int id )
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    if ( id < (int)clips.size()
+         && --clips[ id ].pinCount == 0 && memoryBudget != 0 )
+    {
+        ++pendingUpdates;
+    }
+}
+
+void
+AnimationStreamer::load( int id )
+{
+    std::string fileName;
+    {
+        OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+        fileName = clips[ id ].fileName;
+    }
+
+    CalCoreAnimation* a = CalLoader::loadCoreAnimation( fileName );
+
+    if ( a == 0 )
+    {
+        osg::notify( osg::WARN )
+            << "Can't load animation " << fileName << ": "
+            << CalError::getLastErrorDescription() << std::endl;
+
+        OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+        clips[ id ].state = FAILED;
+        clips[ id ].missTime = 0;
+        return;
+    }
+
+    if ( scale != 1.0f )
+    {
+        a->scale( scale );
+    }
+
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+    clips[ id ].loaded = a;
+    ++pendingUpdates;
+}
+
+void
+AnimationStreamer::update()
+{
+    if ( pendingUpdates == 0 )
+    {
+        return;
+    }
+
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    pendingUpdates.exchange( 0 );
+
+    // -- Move loaded tracks to core animations --
+    for ( std::vector< Clip >::iterator
+              c = clips.begin(),
+              cEnd = clips.end();
+          c != cEnd; ++c )
+    {
+        if ( c->loaded == 0 )
+        {
+            continue;
+        }
+
+        c->animation->getListCoreTrack().swap( c->loaded->getListCoreTrack() );
+        c->animation->setDuration( c->loaded->getDuration() );
+        delete c->loaded; // no tracks left
+        c->loaded = 0;
+
+        c->state = LOADED;
+        c->bytes = tracksSize( c->animation );
+
+        stats.loads++;
+        stats.loadedBytes += c->bytes;
+
+        if ( c->missTime != 0 )
+        {
+            stats.stallTime += osg::Timer::instance()->delta_s(
+                c->missTime, osg::Timer::instance()->tick() );
+            c->missTime = 0;
+        }
+    }
+
+    evict();
+}
+
+void
+AnimationStreamer::evict()
+{
+    if ( memoryBudget == 0 )
+    {
+        return;
+    }
+
+    while ( stats.loadedBytes > memoryBudget )
+    {
+        Clip* lru = 0;
+
+        for ( std::vector< Clip >::iterator
+                  c = clips.begin(),
+                  cEnd = clips.end();
+              c != cEnd; ++c )
+        {
+            if ( c->state == LOADED && c->pinCount == 0
+                 && ( lru == 0 || c->lastUse < lru->lastUse ) )
+            {
+                lru = &*c;
+            }
+        }
+
+        if ( lru == 0 )
+        {
+            return; // everything is in use
+        }
+
+        AnimationLibrary::destroyTracks( lru->animation );
+        lru->state = UNLOADED;
+        stats.loadedBytes -= lru->bytes;
+        stats.evictions++;
+        lru->bytes = 0;
+    }
+}
+
+void
+AnimationStreamer::stop()
+{
+    if ( thread.valid() )
+    {
+        thread->cancel();
+        thread = 0;
+    }
+
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    for ( std::vector< Clip >::iterator
+              c = clips.begin(),
+              cEnd = clips.end();
+          c != cEnd; ++c )
+    {
+        if ( c->loaded )
+        {
+            AnimationLibrary::destroyTracks( c->loaded );
+            delete c->loaded;
+            c->loaded = 0;
+        }
+
+        // core animation itself is deleted by CalCoreModel
+        AnimationLibrary::destroyTracks( c->animation );
+    }
+
+    clips.clear();
+    stats.loadedBytes = 0;
+}
+
+AnimationStreamer::Stats
+AnimationStreamer::getStats() const
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    return stats;
+}
+
+void
+AnimationStreamer::resetStats()
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    size_t loadedBytes = stats.loadedBytes;
+    stats = Stats();
+    stats.loadedBytes = loadedBytes;
+}
+
+size_t
+AnimationStreamer::tracksSize( CalCoreAnimation* a )
+{
+    // same estimation as in MemoryUsage::addCalCoreModel
+    size_t bytes = 0;
+    std::list< CalCoreTrack* >& tracks = a->getListCoreTrack();
+
+    for ( std::list< CalCoreTrack* >::iterator
+              t = tracks.begin(),
+              tEnd = tracks.end();
+          t != tEnd; ++t )
+    {
+        bytes += sizeof ( CalCoreTrack )
+            + sizeof ( void* ) * 3 // list node
+            + (*t)->getCoreKeyframeCount()
+              * ( sizeof ( CalCoreKeyframe ) + sizeof ( CalCoreKeyframe* ) );
+    }
+
+    return bytes;
+}
@@ -0,0 +1,581 @@
+/* -*- c++ -*-
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <math.h>
+#include <algorithm>
+
+#include <osgCal/Cloth>
+#include <osgCal/Model>
+
+using namespace osgCal;
+
+// same as in CalSpringSystem
+static const float DAMPING = 0.99f;
+static const int   ITERATIONS_COUNT = 2;
+
+// larger steps make Verlet integration unstable (e.g. after pause)
+static const float MAX_DELTA_TIME = 0.05f;
+
+// smaller batches are relaxed in one thread
+static const int   PARALLEL_BATCH_SIZE = 64;
+
+static
+inline
+osg::Vec3f
+toVec3( const CalVector& v )
+{
+    return osg::Vec3f( v.x, v.y, v.z );
+}
+
+/**
+ * Closest point of segment [a, b] to p.
+ */
+static
+inline
+osg::Vec3f
+closestPoint( const osg::Vec3f& a,
+              const osg::Vec3f& b,
+              const osg::Vec3f& p )
+{
+    osg::Vec3f ab = b - a;
+    float      l2 = ab.length2();
+
+    if ( l2 < 1e-12f )
+    {
+        return a;
+    }
+
+    float t = osg::clampBetween( ( ( p - a ) * ab ) / l2, 0.0f, 1.0f );
+
+    return a + ab * t;
+}
+
+// -- Bone capsules --
+
+void
+osgCal::calculateBoneCapsules( CalCoreSkeleton*    skeleton,
+                               const MeshesVector& meshes,
+                               BoneCapsules&       capsules )
+{
+    const std::vector< CalCoreBone* >& coreBones = skeleton->getVectorCoreBone();
+    const int bonesCount = coreBones.size();
+
+    // -- One capsule per bone & child (or sphere for leaf bone) --
+    std::vector< BoneCapsule >        all;
+    std::vector< std::vector< int > > boneCapsules( bonesCount );
+
+    for ( int b = 0; b < bonesCount; b++ )
+    {
+        std::list< int >& children = coreBones[b]->getListChildId();
+        BoneCapsule c;
+        c.boneId = b;
+        c.radius = 0;
+
+        for ( std::list< int >::iterator
+                  child = children.begin(),
+                  childEnd = children.end();
+              child != childEnd; ++child )
+        {
+            c.childBoneId = *child;
+            boneCapsules[b].push_back( all.size() );
+            all.push_back( c );
+        }
+
+        if ( children.empty() )
+        {
+            c.childBoneId = -1;
+            boneCapsules[b].push_back( all.size() );
+            all.push_back( c );
+        }
+    }
+
+    // -- Mean distance of bind pose vertices to nearest bone segment --
+    std::vector< int > counts( all.size(), 0 );
+
+    for ( size_t m = 0; m < meshes.size(); m++ )
+    {
+        const MeshData* data = meshes[m].get();
+
+        if ( data->cloth.valid() )
+        {
+            continue;
+        }
+
+        const VertexBuffer& vb = *data->vertexBuffer;
+
+        for ( size_t v = 0; v < vb.size(); v++ )
+        {
+            // -- Bone with the largest influence --
+            int boneId = data->rigidBoneId;
+
+            if ( !data->rigid )
+            {
+                const osg::Vec4f&                     w  = (*data->weightBuffer)[v];
+                const MatrixIndexBuffer::value_type&  mi = (*data->matrixIndexBuffer)[v];
+                int best = 0;
+
+                for ( int j = 1; j < 4; j++ )
+                {
+                    if ( w[j] > w[best] )
+                    {
+                        best = j;
+                    }
+                }
+
+                boneId = data->getBoneId( mi[ best ] );
+            }
+
+            if ( boneId < 0 || boneId >= bonesCount ) // unrigged
+            {
+                continue;
+            }
+
+            // -- Nearest segment --
+            const osg::Vec3f& p = vb[v];
+            const osg::Vec3f  a = toVec3( coreBones[ boneId ]->getTranslationAbsolute() );
+            int               nearest = -1;
+            float             distance = 0;
+
+            for ( size_t i = 0; i < boneCapsules[ boneId ].size(); i++ )
+            {
+                const BoneCapsule& c = all[ boneCapsules[ boneId ][i] ];
+                const osg::Vec3f   b = c.childBoneId < 0 ? a
+                    : toVec3( coreBones[ c.childBoneId ]->getTranslationAbsolute() );
+                float d = ( p - closestPoint( a, b, p ) ).length();
+
+                if ( nearest < 0 || d < distance )
+                {
+                    nearest = boneCapsules[ boneId ][i];
+                    distance = d;
+                }
+            }
+
+            all[ nearest ].radius += distance;
+            counts[ nearest ]++;
+        }
+    }
+
+    capsules.clear();
+
+    for ( size_t i = 0; i < all.size(); i++ )
+    {
+        if ( counts[i] > 0 )
+        {
+            all[i].radius /= counts[i];
+            capsules.push_back( all[i] );
+        }
+    }
+}
+
+// -- Colliders --
+
+ClothColliders::ClothColliders()
+    : cellSize( 1.0f )
+    , buckets( BUCKETS_COUNT )
+{
+}
+
+int
+ClothColliders::getBucket( int x, int y, int z ) const
+{
+    return ( ( x * 73856093 ) ^ ( y * 19349663 ) ^ ( z * 83492791 ) )
+        & ( BUCKETS_COUNT - 1 );
+}
+
+void
+ClothColliders::update( const BoneCapsules& boneCapsules,
+                        const ModelData*    modelData )
+{
+    capsules.resize( boneCapsules.size() );
+
+    // -- Move capsules to the current bone positions --
+    cellSize = 0;
+
+    for ( size_t i = 0; i < boneCapsules.size(); i++ )
+    {
+        const BoneCapsule& bc = boneCapsules[i];
+        Capsule&           c = capsules[i];
+
+        c.a = toVec3( modelData->getBoneParams( bc.boneId ).bone->getTranslationAbsolute() );
+        c.b = bc.childBoneId < 0 ? c.a
+            : toVec3( modelData->getBoneParams( bc.childBoneId ).bone->getTranslationAbsolute() );
+        c.radius = bc.radius;
+
+        for ( int j = 0; j < 3; j++ )
+        {
+            cellSize = std::max( cellSize, fabsf( c.a[j] - c.b[j] ) + 2 * c.radius );
+        }
+    }
+
+    cellSize = std::max( cellSize, 1e-3f );
+
+    // -- Rebuild grid --
+    for ( int i = 0; i < BUCKETS_COUNT; i++ )
+    {
+        buckets[i].clear(); // keeps capacity
+    }
+
+    for ( size_t i = 0; i < capsules.size(); i++ )
+    {
+        const Capsule& c = capsules[i];
+        int minCell[3];
+        int maxCell[3];
+
+        for ( int j = 0; j < 3; j++ )
+        {
+            minCell[j] = (int)floorf( ( std::min( c.a[j], c.b[j] ) - c.radius ) / cellSize );
+            maxCell[j] = (int)floorf( ( std::max( c.a[j], c.b[j] ) + c.radius ) / cellSize );
+        }
+
+        for ( int x = minCell[0]; x <= maxCell[0]; x++ )
+        {
+            for ( int y = minCell[1]; y <= maxCell[1]; y++ )
+            {
+                for ( int z = minCell[2]; z <= maxCell[2]; z++ )
+                {
+                    std::vector< int >& b = buckets[ getBucket( x, y, z ) ];
+
+                    // capsule cells can share bucket
+                    if ( std::find( b.begin(), b.end(), (int)i ) == b.end() )
+                    {
+                        b.push_back( i );
+                    }
+                }
+            }
+        }
+    }
+}
+
+void
+ClothColliders::collide( float& x,
+                         float& y,
+                         float& z ) const
+{
+    // point inside capsule is inside its bounding box, so only
+    // capsules from point cell are checked
+    const std::vector< int >& b =
+        buckets[ getBucket( (int)floorf( x / cellSize ),
+                            (int)floorf( y / cellSize ),
+                            (int)floorf( z / cellSize ) ) ];
+
+    for ( size_t i = 0; i < b.size(); i++ )
+    {
+        const Capsule& c = capsules[ b[i] ];
+        osg::Vec3f     p( x, y, z );
+        osg::Vec3f     q = closestPoint( c.a, c.b, p );
+        osg::Vec3f     d = p - q;
+        float          l2 = d.length2();
+
+        if ( l2 < c.radius * c.radius && l2 > 1e-12f )
+        {
+            p = q + d * ( c.radius / sqrtf( l2 ) );
+            x = p.x();
+            y = p.y();
+            z = p.z();
+        }
+    }
+}
+
+// -- Simulation --
+
+ClothSimulation::ClothSimulation( const MeshData* data )
+    : dynamicCount( 0 )
+    , initialized( false )
+{
+    const Cloth& cloth = *data->cloth;
+    const int particlesCount = cloth.getParticlesCount();
+
+    x.resize( particlesCount );
+    y.resize( particlesCount );
+    z.resize( particlesCount );
+    ox.resize( particlesCount );
+    oy.resize( particlesCount );
+    oz.resize( particlesCount );
+
+    // -- Dynamic particles go first --
+    while ( dynamicCount < particlesCount
+            && (*cloth.particleWeights)[ dynamicCount ] > 0.0f )
+    {
+        inverseWeights.push_back( 1.0f / (*cloth.particleWeights)[ dynamicCount ] );
+        dynamicCount++;
+    }
+
+    normalSums.resize( dynamicCount );
+
+    // -- Triangles with dynamic particles --
+    std::vector< int > particleIds( data->vertexBuffer->size(), -1 );
+
+    for ( int p = 0; p < particlesCount; p++ )
+    {
+        particleIds[ (*cloth.particleVertices)[p] ] = p;
+    }
+
+    const IndexBuffer& ib = *data->indexBuffer;
+
+    for ( unsigned int i = 0; i + 2 < ib.getNumIndices(); i += 3 )
+    {
+        int t[3] = { particleIds[ ib.index( i ) ],
+                     particleIds[ ib.index( i + 1 ) ],
+                     particleIds[ ib.index( i + 2 ) ] };
+
+        if ( t[0] < 0 || t[1] < 0 || t[2] < 0 ) // no dynamic particles
+        {
+            continue;
+        }
+
+        if ( t[0] < dynamicCount || t[1] < dynamicCount || t[2] < dynamicCount )
+        {
+            triangles.insert( triangles.end(), t, t + 3 );
+        }
+    }
+}
+
+static
+inline
+osg::Vec3f
+mul3( const osg::Matrix3& m,
+      const osg::Vec3f& v )
+{
+    return osg::Vec3f( m(0,0)*v.x() + m(1,0)*v.y() + m(2,0)*v.z(),
+                       m(0,1)*v.x() + m(1,1)*v.y() + m(2,1)*v.z(),
+                       m(0,2)*v.x() + m(1,2)*v.y() + m(2,2)*v.z() );
+}
+
+void
+ClothSimulation::pin( const MeshData*     data,
+                      const ModelData*    modelData,
+                      const VertexBuffer& vertices,
+                      bool                all )
+{
+    const Cloth&             cloth = *data->cloth;
+    const WeightBuffer&      wb    = *data->weightBuffer;
+    const MatrixIndexBuffer& mib   = *data->matrixIndexBuffer;
+
+    for ( int p = all ? 0 : dynamicCount; p < cloth.getParticlesCount(); p++ )
+    {
+        const int         v = (*cloth.particleVertices)[p];
+        const osg::Vec3f& sv = vertices[v];
+        osg::Vec3f        r( 0, 0, 0 );
+
+        // dynamic vertices are rigged to identity bone, so they
+        // get their initial (bind pose) position here
+        for ( int j = 0; j < 4 && wb[v][j] > 0.0f; j++ )
+        {
+            const ModelData::BoneParams& bp =
+                modelData->getBoneParams( data->getBoneId( mib[v][j] ) );
+
+            r += ( mul3( bp.rotation, sv ) + bp.translation ) * wb[v][j];
+        }
+
+        x[p] = r.x();
+        y[p] = r.y();
+        z[p] = r.z();
+
+        if ( p < dynamicCount )
+        {
+            ox[p] = r.x();
+            oy[p] = r.y();
+            oz[p] = r.z();
+        }
+    }
+}
+
+static
+inline
+void
+setNormal( osg::Vec3f&       n,
+           const osg::Vec3f& v )
+{
+    n = v;
+}
+
+static
+inline
+void
+setNormal( osg::Vec3b&       n,
+           const osg::Vec3f& v )
+{
+    n.set( (GLbyte)( v.x() * 127.0f ),
+           (GLbyte)( v.y() * 127.0f ),
+           (GLbyte)( v.z() * 127.0f ) );
+}
+
+void
+ClothSimulation::calculateNormals( const MeshData* data,
+                                   NormalBuffer&   normals )
+{
+    std::fill( normalSums.begin(), normalSums.end(), osg::Vec3f( 0, 0, 0 ) );
+
+    for ( size_t i = 0; i < triangles.size(); i += 3 )
+    {
+        const int a = triangles[i];
+        const int b = triangles[i+1];
+        const int c = triangles[i+2];
+
+        // area weighted face normal
+        const osg::Vec3f n =
+            osg::Vec3f( x[b] - x[a], y[b] - y[a], z[b] - z[a] )
+            ^ osg::Vec3f( x[c] - x[a], y[c] - y[a], z[c] - z[a] );
+
+        if ( a < dynamicCount ) normalSums[a] += n;
+        if ( b < dynamicCount ) normalSums[b] += n;
+        if ( c < dynamicCount ) normalSums[c] += n;
+    }
+
+    const osg::UIntArray& pv = *data->cloth->particleVertices;
+
+    for ( int p = 0; p < dynamicCount; p++ )
+    {
+        osg::Vec3f& n = normalSums[p];
+
+        if ( n.normalize() > 0 )
+        {
+            setNormal( normals[ pv[p] ], n );
+        }
+    }
+}
+
+void
+ClothSimulation::update( const MeshData*  data,
+                         const ModelData* modelData,
+                         float            deltaTime,
+                         VertexBuffer&    vertices,
+                         NormalBuffer*    normals )
+{
+    const Cloth& cloth = *data->cloth;
+
+    // -- Move pinned particles with skeleton --
+    pin( data, modelData, vertices, !initialized );
+    initialized = true;
+
+    const int n = dynamicCount;
+
+    if ( deltaTime > 0.0f )
+    {
+        // -- Verlet integration --
+        // Separate loops over x/y/z arrays are vectorized by compiler.
+        const float      dt = std::min( deltaTime, MAX_DELTA_TIME );
+        const float      dt2 = dt * dt;
+        const osg::Vec3f g = modelData->getClothGravity() * dt2;
+        const osg::Vec3f f = modelData->getClothForce() * dt2;
+        const float*     iw = n > 0 ? &inverseWeights.front() : 0;
+
+#define INTEGRATE( _p, _o, _c )                                         \
+        {                                                               \
+            float* p = n > 0 ? &_p.front() : 0;                         \
+            float* o = n > 0 ? &_o.front() : 0;                         \
+            const float gc = g._c();                                    \
+            const float fc = f._c();                                    \
+                                                                        \
+            for ( int i = 0; i < n; i++ )                               \
+            {                                                           \
+                const float c = p[i];                                   \
+                p[i] += ( c - o[i] ) * DAMPING + fc * iw[i] + gc;       \
+                o[i] = c;                                               \
+            }                                                           \
+        }
+
+        INTEGRATE( x, ox, x );
+        INTEGRATE( y, oy, y );
+        INTEGRATE( z, oz, z );
+#undef INTEGRATE
+
+        // -- Springs relaxation --
+        // Springs of one batch don't share particles, so they are
+        // relaxed in parallel.
+        const unsigned int* springs = &cloth.springs->front();
+        const float*        idleLengths = &cloth.idleLengths->front();
+        const osg::UIntArray& batchEnds = *cloth.batchEnds;
+
+        for ( int iteration = 0; iteration < ITERATIONS_COUNT; iteration++ )
+        {
+            int begin = 0;
+
+            for ( size_t b = 0; b < batchEnds.size(); b++ )
+            {
+                const int end = batchEnds[b];
+
+#ifdef _OPENMP
+#pragma omp parallel for if ( end - begin >= PARALLEL_BATCH_SIZE )
+#endif // _OPENMP
+                for ( int s = begin; s < end; s++ )
+                {
+                    const int   p0 = springs[ s*2 ];
+                    const int   p1 = springs[ s*2 + 1 ];
+                    const float dx = x[p1] - x[p0];
+                    const float dy = y[p1] - y[p0];
+                    const float dz = z[p1] - z[p0];
+                    const float length = sqrtf( dx*dx + dy*dy + dz*dz );
+
+                    if ( length <= 0.0f )
+                    {
+                        continue;
+                    }
+
+                    // same as CalSpringSystem: both dynamic particles
+                    // move by half, single dynamic one moves by whole
+                    // difference
+                    float f0 = ( length - idleLengths[s] ) / length;
+                    float f1 = f0;
+
+                    if ( p0 < n )
+                    {
+                        f0 *= 0.5f;
+                        f1 *= 0.5f;
+                    }
+                    else
+                    {
+                        f0 = 0.0f;
+                    }
+
+                    if ( p1 >= n )
+                    {
+                        f0 *= 2.0f;
+                        f1 = 0.0f;
+                    }
+
+                    x[p0] += dx * f0;  y[p0] += dy * f0;  z[p0] += dz * f0;
+                    x[p1] -= dx * f1;  y[p1] -= dy * f1;  z[p1] -= dz * f1;
+                }
+
+                begin = end;
+            }
+        }
+
+        // -- Collisions --
+        const ClothColliders* colliders = modelData->getClothColliders();
+
+        if ( colliders )
+        {
+            for ( int i = 0; i < n; i++ )
+            {
+                colliders->collide( x[i], y[i], z[i] );
+            }
+        }
+    }
+
+    // -- Write simulated particles --
+    const osg::UIntArray& pv = *cloth.particleVertices;
+
+    for ( int p = 0; p < n; p++ )
+    {
+        vertices[ pv[p] ].set( x[p], y[p], z[p] );
+    }
+
+    if ( normals )
+    {
+        calculateNormals( data, *normals );
+    }
+}
@@ -15,6 +15,8 @@
     License along with this library; if not, write to the Free Software
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
+#include <OpenThreads/ScopedLock>
+
 #include <osgCal/CoreMesh>
 #include <osgCal/CoreModel>
 
@@ -32,7 +34,9 @@ CoreMesh::CoreMesh( const CoreModel* model,
                                     _data,
                                     _material,
                                     _p ) )
+    , batchRange( -1 )
 {
+    checkBonesCount();
 }
 
 CoreMesh::CoreMesh( const CoreModel* model,
@@ -47,7 +51,39 @@ CoreMesh::CoreMesh( const CoreModel* model,
                                     mesh->data.get(),
                                     newMaterial,
                                     newP ) )
+    , batchRange( -1 )
+{
+    checkBonesCount();
+}
+
+void
+CoreMesh::checkBonesCount() const
+    throw (std::runtime_error)
 {
+    // shaders have uniforms only for MAX_BONES_PER_MESH + 1 bone
+    // matrices, meshes with more bones (split with
+    // CoreModel::setMaxBonesPerMesh) need dual quaternion skinning
+    if ( data->rigid == false
+         && parameters->dualQuaternionSkinning == false
+         && data->getBonesCount() > Constants::MAX_BONES_PER_MESH + 1 )
+    {
+        throw std::runtime_error( "mesh '" + data->name + "' has too many bones "
+                                  "for linear skinning, use dual quaternion skinning "
+                                  "or split meshes with less bones" );
+    }
+}
+
+const MeshBoneVolumes*
+CoreMesh::getBoneVolumes() const
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( boneVolumesMutex );
+
+    if ( !boneVolumes.valid() )
+    {
+        boneVolumes = new MeshBoneVolumes( data.get() );
+    }
+
+    return boneVolumes.get();
 }
 
 void
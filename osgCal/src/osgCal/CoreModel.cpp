@@ -20,6 +20,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <algorithm>
+#include <map>
 #include <sstream>
 
 #include <osg/Notify>
@@ -51,9 +52,14 @@ public:
 ////////////////////////////////////////////////////////////////////////////////
 CoreModel::CoreModel()
     : calCoreModel( 0 )
+    , maxBonesPerMesh( Constants::MAX_BONES_PER_MESH )
+    , rigidMeshesBatching( false )
+    , morphTargetsCount( 0 )
+    , clothFlag( false )
 {
     stateSetCache = StateSetCache::instance();
 //    stateSetCache = new StateSetCache;
+    animationLibrary = AnimationLibrary::instance();
 }
 
 CoreModel::CoreModel(const CoreModel&, const osg::CopyOp&)
@@ -62,30 +68,30 @@ CoreModel::CoreModel(const CoreModel&, const osg::CopyOp&)
     throw std::runtime_error( "CoreModel copying is not supported" );
 }
 
-#include <cal3d/coretrack.h>
-
 CoreModel::~CoreModel()
 {
     if ( calCoreModel )
     {
-        // TODO: report CoreTrack memory leak problem to cal3d maintainers
+        if ( animationStreamer.valid() )
+        {
+            animationStreamer->stop();
+        }
+
+        std::vector< CalCoreAnimation* > calCoreAnimations;
         for ( int i = 0; i < calCoreModel->getCoreAnimationCount(); i++ )
         {
-            CalCoreAnimation* a = calCoreModel->getCoreAnimation( i );
-            std::list<CalCoreTrack *>& ct = a->getListCoreTrack();
-            for ( std::list<CalCoreTrack *>::iterator
-                      t = ct.begin(),
-                      tEnd = ct.end();
-                  t != tEnd; ++t )
-            {
-                (*t)->destroy();
-                delete (*t);
-            }
-            ct.clear();
+            calCoreAnimations.push_back( calCoreModel->getCoreAnimation( i ) );
         }
 
         // cleanup of non-auto released resources
         delete calCoreModel;
+
+        // animations are shared with other core models, library frees
+        // them (and their tracks) when they are not used anymore
+        for ( size_t i = 0; i < calCoreAnimations.size(); i++ )
+        {
+            animationLibrary->release( calCoreAnimations[i] );
+        }
     }
 }
 
@@ -128,8 +134,11 @@ CoreModel::load( const std::string& cfgFileNameOriginal,
 
     if ( isFileExists( meshesCacheFileName( cfgFileName ) ) == false )
     {
-        calCoreModel = loadCoreModel( cfgFileName, scale );
-        loadMeshes( calCoreModel, meshesData );
+        calCoreModel = loadCoreModel( cfgFileName, scale, false,
+                                      animationLibrary.get(),
+                                      animationStreamer.get(),
+                                      false, &animationNames );
+        loadMeshes( calCoreModel, meshesData, maxBonesPerMesh );
     }
     else
     {
@@ -137,26 +146,57 @@ CoreModel::load( const std::string& cfgFileNameOriginal,
         // in any order. So, yes, if cache file doesn't correspond to
         // model we can SIGSEGV.
         calCoreModel =
-            loadCoreModel( cfgFileName, scale, true/*ignoreMeshes*/ );
+            loadCoreModel( cfgFileName, scale, true/*ignoreMeshes*/,
+                           animationLibrary.get(),
+                           animationStreamer.get(),
+                           true/*ignoreMaterials*/,
+                           &animationNames );
         loadMeshes( meshesCacheFileName( cfgFileName ),
                     calCoreModel, meshesData );
     }
 
+    if ( animationStreamer.valid() )
+    {
+        animationStreamer->setScale( scale );
+    }
+
     // -- Preparing meshes and materials for fast Model creation --
+    std::map< const Material*, osg::ref_ptr< Material > > materials;
+
     for ( MeshesVector::iterator
               meshData = meshesData.begin(),
               meshDataEnd = meshesData.end();
           meshData != meshDataEnd; ++meshData )
     {
         MeshData* md = (*meshData).get();
+
+        // resolve maps once per shared material
+        osg::ref_ptr< Material >& material = materials[ md->material.get() ];
+        if ( !material.valid() )
+        {
+            material = new Material( *md->material, dir );
+        }
+
+        if ( md->matrixIndexBuffer.valid() && !md->matrixIndexShortBuffer.valid() )
+        {
+            // converted once here, not on each draw from buffers
+            const GLubyte* mi  = (const GLubyte*)md->matrixIndexBuffer->getDataPointer();
+            const GLubyte* end = mi + md->matrixIndexBuffer->size() * 4;
+
+            md->matrixIndexShortBuffer = new osg::ShortArray( mi, end );
+        }
+
         CoreMesh* m = new CoreMesh( this,
                                     md,
-                                    new Material( md->coreMaterial, dir ),
+                                    material.get(),
                                     ps->getParameters( md ) );
-        // TODO: add per-core model coreMaterialCache
 
         meshes.push_back( m );
 
+        morphTargetsCount = std::max( morphTargetsCount,
+                                      (int)md->morphTargets.size() );
+        clothFlag = clothFlag || md->cloth.valid();
+
         osg::notify( osg::INFO )
             << "mesh              : " << m->data->name << std::endl
             << "maxBonesInfluence : " << m->data->maxBonesInfluence << std::endl
@@ -166,19 +206,123 @@ CoreModel::load( const std::string& cfgFileNameOriginal,
                 << std::endl
             << "rigid             : " << m->data->rigid << std::endl
             << "rigidBoneId       : " << m->data->rigidBoneId << std::endl
+            << "morphTargets      : " << m->data->morphTargets.size() << std::endl
+            << "clothParticles    : "
+                << ( md->cloth.valid() ? md->cloth->getParticlesCount() : 0 ) << std::endl
             << *m->material << std::endl;
     }
 
-    // -- Collecting animation names --
+    if ( rigidMeshesBatching )
+    {
+        batchRigidMeshes();
+    }
+
+    // -- Cloth colliders --
+    if ( clothFlag && calCoreModel->getCoreSkeleton() )
+    {
+        calculateBoneCapsules( calCoreModel->getCoreSkeleton(),
+                               meshesData, clothCapsules );
+    }
+
+    // -- Collecting animation durations --
+    // (names are collected by loadCoreModel, shared animations can
+    // have other names in their CalCoreAnimation)
     for ( int i = 0; i < calCoreModel->getCoreAnimationCount(); i++ )
     {
-        animationNames.push_back(
-            calCoreModel->getCoreAnimation( i )->getName() );
         animationDurations.push_back(
             calCoreModel->getCoreAnimation( i )->getDuration() );
     }
 }
 
+/**
+ * Can meshes be drawn as one batch? Software meshes and transform
+ * feedback skinned ones are drawn by their own.
+ */
+static bool
+canBatch( const CoreMesh* a,
+          const CoreMesh* b )
+{
+    return a->data->rigid
+        && canMergeMeshes( a->data.get(), b->data.get() )
+        && a->parameters == b->parameters
+        && !a->parameters->software
+        && !a->parameters->transformFeedbackSkinning;
+}
+
+void
+CoreModel::batchRigidMeshes()
+{
+    for ( size_t i = 0; i < meshes.size(); i++ )
+    {
+        CoreMesh* front = meshes[ i ].get();
+
+        if ( front->batch.valid() )
+        {
+            continue; // already merged
+        }
+
+        // -- Collect meshes compatible with the front one --
+        std::vector< CoreMesh* >        group( 1, front );
+        std::vector< const MeshData* >  groupData( 1, front->data.get() );
+
+        for ( size_t j = i + 1; j < meshes.size(); j++ )
+        {
+            CoreMesh* m = meshes[ j ].get();
+
+            if ( !m->batch.valid() && canBatch( front, m ) )
+            {
+                group.push_back( m );
+                groupData.push_back( m->data.get() );
+            }
+        }
+
+        if ( group.size() < 2 )
+        {
+            continue;
+        }
+
+        // -- Merge them --
+        CoreMesh* batch = new CoreMesh( this,
+                                        mergeMeshes( groupData ),
+                                        front->material.get(),
+                                        front->parameters.get() );
+        batches.push_back( batch );
+
+        for ( size_t r = 0; r < group.size(); r++ )
+        {
+            group[ r ]->batch = batch;
+            group[ r ]->batchRange = r;
+        }
+
+        osg::notify( osg::INFO )
+            << "batch             : " << batch->data->name << std::endl
+            << "meshesCount       : " << group.size() << std::endl;
+    }
+}
+
+void
+CoreModel::setAnimationStreaming( bool   enabled,
+                                  size_t memoryBudget )
+{
+    animationStreamer = enabled ? new AnimationStreamer( memoryBudget ) : 0;
+}
+
+void
+CoreModel::setPoseCaching( bool  enabled,
+                           float quantum )
+{
+    poseCache = enabled ? new PoseCache( quantum ) : 0;
+}
+
+void
+CoreModel::prefetchAnimation( int id ) const
+{
+    if ( animationStreamer.valid() )
+    {
+        animationStreamer->prefetch( id );
+    }
+}
+
 bool
 CoreModel::loadNoThrow( const std::string& cfgFileName,
                         std::string&       errorText,
@@ -209,10 +353,59 @@ CoreModel::releaseGLObjects( osg::State* state ) const
         // removes mesh display lists & state sets
     }
 
+    for ( MeshVector::const_iterator
+              batch = batches.begin(),
+              batchEnd = batches.end();
+          batch != batchEnd; ++batch )
+    {
+        (*batch)->releaseGLObjects( state );
+    }
+
     ShadersCache::instance()->releaseGLObjects( state );
     // ^ generally not needed since shaders are included in mesh state sets
 }
 
+MemoryUsage
+CoreModel::getMemoryUsage() const
+{
+    MemoryUsage mu;
+
+    if ( calCoreModel )
+    {
+        mu.addCalCoreModel( calCoreModel );
+    }
+
+    if ( poseCache.valid() )
+    {
+        mu.bytes[ MemoryUsage::ANIMATIONS ] += poseCache->getMemoryUsage();
+    }
+
+    std::set< const MeshData* >   countedData;
+    std::set< const osg::Image* > countedImages;
+
+    MeshVector allMeshes( meshes );
+    allMeshes.insert( allMeshes.end(), batches.begin(), batches.end() );
+
+    for ( MeshVector::const_iterator
+              coreMesh = allMeshes.begin(),
+              coreMeshEnd = allMeshes.end();
+          coreMesh != coreMeshEnd; ++coreMesh )
+    {
+        if ( countedData.insert( (*coreMesh)->data.get() ).second )
+        {
+            mu.addMeshData( (*coreMesh)->data.get() );
+        }
+
+        if ( (*coreMesh)->stateSets.valid() )
+        {
+            mu.addTextures( (*coreMesh)->stateSets->stateSet.get(), countedImages );
+            mu.addTextures( (*coreMesh)->stateSets->staticStateSet.get(), countedImages );
+        }
+    }
+
+    return mu;
+}
+
 
 // -- CoreModel loading --
 
@@ -231,10 +424,82 @@ struct FileCloser
         }
 };
 
+/**
+ * Scale core model. CalCoreSubmesh::scale() doesn't scale morph
+ * targets and removes springs (when scale differs from 1 by more
+ * than 10%) or leaves their idle lengths unscaled, so we do it
+ * ourselves.
+ */
+static void
+scaleCoreModel( CalCoreModel* calCoreModel,
+                float         scale )
+{
+    // -- Save springs --
+    typedef std::pair< std::vector< CalCoreSubmesh::Spring >,
+                       std::vector< CalCoreSubmesh::PhysicalProperty > > SpringSystem;
+    std::vector< SpringSystem > springSystems;
+
+    for ( int i = 0; i < calCoreModel->getCoreMeshCount(); i++ )
+    {
+        CalCoreMesh* cm = calCoreModel->getCoreMesh( i );
+
+        for ( int j = 0; j < cm->getCoreSubmeshCount(); j++ )
+        {
+            CalCoreSubmesh* sm = cm->getCoreSubmesh( j );
+            springSystems.push_back( SpringSystem( sm->getVectorSpring(),
+                                                   sm->getVectorPhysicalProperty() ) );
+        }
+    }
+
+    calCoreModel->scale( scale );
+
+    std::vector< SpringSystem >::iterator ss = springSystems.begin();
+
+    for ( int i = 0; i < calCoreModel->getCoreMeshCount(); i++ )
+    {
+        CalCoreMesh* cm = calCoreModel->getCoreMesh( i );
+
+        for ( int j = 0; j < cm->getCoreSubmeshCount(); j++, ++ss )
+        {
+            CalCoreSubmesh* sm = cm->getCoreSubmesh( j );
+
+            // -- Restore scaled springs --
+            sm->getVectorSpring().swap( ss->first );
+            sm->getVectorPhysicalProperty().swap( ss->second );
+
+            std::vector< CalCoreSubmesh::Spring >& springs = sm->getVectorSpring();
+
+            for ( size_t s = 0; s < springs.size(); s++ )
+            {
+                springs[s].idleLength *= scale;
+            }
+
+            // -- Morph targets --
+            std::vector< CalCoreSubMorphTarget* >& targets =
+                sm->getVectorCoreSubMorphTarget();
+
+            for ( size_t t = 0; t < targets.size(); t++ )
+            {
+                std::vector< CalCoreSubMorphTarget::BlendVertex >& bv =
+                    targets[t]->getVectorBlendVertex();
+
+                for ( size_t v = 0; v < bv.size(); v++ )
+                {
+                    bv[v].position *= scale;
+                }
+            }
+        }
+    }
+}
+
 CalCoreModel*
 osgCal::loadCoreModel( const std::string& cfgFileName,
                        float& scale,
-                       bool ignoreMeshes )
+                       bool ignoreMeshes,
+                       AnimationLibrary* animationLibrary,
+                       AnimationStreamer* animationStreamer,
+                       bool ignoreMaterials,
+                       std::vector< std::string >* animationNames )
     throw (std::runtime_error)
 {
     // -- Initial loading of model --
@@ -250,6 +515,9 @@ osgCal::loadCoreModel( const std::string& cfgFileName,
 
     std::auto_ptr< CalCoreModel > calCoreModel( new CalCoreModel( "dummy" ) );
 
+    // (full path, name) of animations to get from library
+    std::vector< std::pair< std::string, std::string > > animationFiles;
+
     // Extract path from fileName
     std::string dir = osgDB::getFilePath( cfgFileName );
 
@@ -310,6 +578,26 @@ osgCal::loadCoreModel( const std::string& cfgFileName,
             }
             else if ( !strcmp( buffer, "animation" ) )
             {
+                if ( animationStreamer )
+                {
+                    animationStreamer->addAnimation( calCoreModel.get(),
+                                                     fullpath, nameToLoad );
+                    if ( animationNames )
+                    {
+                        animationNames->push_back( nameToLoad );
+                    }
+                    continue;
+                }
+
+                if ( animationLibrary )
+                {
+                    // shared animations are added after scaling,
+                    // they are already scaled by library
+                    animationFiles.push_back(
+                        std::make_pair( fullpath, nameToLoad ) );
+                    continue;
+                }
+
                 int animationId = calCoreModel->loadCoreAnimation( fullpath );
                 if( animationId < 0 )
                 {
@@ -319,6 +607,10 @@ osgCal::loadCoreModel( const std::string& cfgFileName,
                 }
                 calCoreModel->getCoreAnimation(animationId)
                     ->setName( nameToLoad );
+                if ( animationNames )
+                {
+                    animationNames->push_back( nameToLoad );
+                }
             }
             else if ( !strcmp( buffer, "mesh" ) )
             {
@@ -372,6 +664,12 @@ osgCal::loadCoreModel( const std::string& cfgFileName,
             }
             else if ( !strcmp( buffer, "material" ) )
             {
+                if ( ignoreMaterials )
+                {
+                    // parsed materials are loaded from cache too
+                    continue;
+                }
+
                 int materialId = calCoreModel->loadCoreMaterial( fullpath );
 
                 if( materialId < 0 )
@@ -397,7 +695,48 @@ osgCal::loadCoreModel( const std::string& cfgFileName,
     // scaling must be done after everything has been created
     if( bScale )
     {
-        calCoreModel->scale( scale );
+        scaleCoreModel( calCoreModel, scale );
+    }
+
+    // -- Shared animations --
+    if ( !animationFiles.empty() )
+    {
+        if ( calCoreModel->getCoreSkeleton() == 0 )
+        {
+            throw std::runtime_error(
+                "Can't load animation " + animationFiles.front().second
+                + ": skeleton must be loaded first" );
+        }
+
+        std::string skeletonSignature = AnimationLibrary::getSkeletonSignature(
+            calCoreModel->getCoreSkeleton() );
+
+        for ( size_t i = 0; i < animationFiles.size(); i++ )
+        {
+            CalCoreAnimation* a = animationLibrary->acquire(
+                animationFiles[i].first, animationFiles[i].second,
+                skeletonSignature, scale );
+
+            if ( a == 0 )
+            {
+                std::string error = CalError::getLastErrorDescription();
+
+                for ( int j = 0; j < calCoreModel->getCoreAnimationCount(); j++ )
+                {
+                    animationLibrary->release( calCoreModel->getCoreAnimation( j ) );
+                }
+
+                throw std::runtime_error(
+                     "Can't load animation " + animationFiles[i].second + ": "
+                     + error );
+            }
+
+            calCoreModel->addCoreAnimation( a );
+            if ( animationNames )
+            {
+                animationNames->push_back( animationFiles[i].second );
+            }
+        }
     }
 
     return calCoreModel.release();
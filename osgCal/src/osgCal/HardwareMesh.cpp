@@ -24,6 +24,17 @@
 #include <osg/CullFace>
 
 #include <osgCal/HardwareMesh>
+#include <osgCal/Profiler>
+
+#ifndef GL_TRANSFORM_FEEDBACK_BUFFER
+    #define GL_TRANSFORM_FEEDBACK_BUFFER 0x8C8E
+#endif
+#ifndef GL_RASTERIZER_DISCARD
+    #define GL_RASTERIZER_DISCARD 0x8C89
+#endif
+#ifndef GL_DYNAMIC_COPY
+    #define GL_DYNAMIC_COPY 0x88EA
+#endif
 
 using namespace osgCal;
 
@@ -32,6 +43,10 @@ using namespace osgCal;
 HardwareMesh::HardwareMesh( ModelData*      _modelData,
                             const CoreMesh* _mesh )
     : Mesh( _modelData, _mesh )
+    , visibleRanges( _mesh->data->batchRanges.size(), 0 )
+    , hiddenRangesCount( _mesh->data->batchRanges.size() )
+    , updateCount( 1 ) // != FeedbackBuffer::skinnedUpdateCount, so we skin at first draw
+    , paletteValid( false )
 {   
     setUseDisplayList( false );
     setSupportsDisplayList( false );
@@ -39,14 +54,9 @@ HardwareMesh::HardwareMesh( ModelData*      _modelData,
     
     setUseVertexBufferObjects( false ); // false is default
 
-    if ( mesh->data->rigid )
-    {
-        setVertexArray( mesh->data->vertexBuffer.get() );
-    }
-    else
-    {
-        setVertexArray( (VertexBuffer*)mesh->data->vertexBuffer->clone( osg::CopyOp::DEEP_COPY_ALL ) );
-    }
+    setVertexArray( mesh->data->vertexBuffer.get() );
+    // ^ vertex buffer is copied only when model is deformed and CPU
+    // vertices are needed (see update())
 
     addPrimitiveSet( mesh->data->indexBuffer.get() ); // DrawElementsUInt
 
@@ -67,6 +77,25 @@ HardwareMesh::clone( const osg::CopyOp& ) const
     throw std::runtime_error( "clone() is not implemented" );
 }
 
+void
+HardwareMesh::setRangeVisible( int  range,
+                               bool visible )
+{
+    int& count = visibleRanges[ range ];
+
+    if ( visible )
+    {
+        if ( count++ == 0 )
+        {
+            hiddenRangesCount--;
+        }
+    }
+    else if ( count > 0 && --count == 0 )
+    {
+        hiddenRangesCount++;
+    }
+}
+
 
 void
 HardwareMesh::onParametersChanged( const MeshParameters* previousDs )
@@ -134,10 +163,154 @@ HardwareMesh::drawImplementation( osg::RenderInfo&     renderInfo,
     const osg::Program::PerContextProgram* program = getProgram( state, stateSet );
     const osg::GLExtensions* gl2extensions = osg::GLExtensions::Get( state.getContextID(), true );
 
+    // -- Create display list if not yet exists --
+    unsigned int contextID = renderInfo.getContextID();
+
+    mesh->displayLists->mutex.lock();
+    GLuint& dl = mesh->displayLists->lists[ contextID ];
+
+    if( dl != 0 )
+    {
+        mesh->displayLists->mutex.unlock();
+    }
+    else
+    {
+        {
+            OSGCAL_PROFILE_SCOPE( DISPLAY_LIST_COMPILE );
+            OSGCAL_PROFILE_COUNT( DISPLAY_LISTS_COMPILED, 1 );
+
+            dl = generateDisplayList( contextID, getGLObjectSizeHint() );
+
+            innerDrawImplementation( state, dl );
+        }
+        mesh->displayLists->mutex.unlock();
+
+        mesh->displayLists->checkAllDisplayListsCompiled( mesh->data.get() );
+    }
+
+    // -- Skin vertices or setup bone uniforms --
+    if ( mesh->stateSets->skinningProgram.valid() )
+    {
+        skinToFeedbackBuffer( state, dl );
+    }
+    else if ( mesh->data->rigid == false && program )
+    {
+        setupBoneUniforms( program, gl2extensions );
+    }
+
+    // -- Draw mesh --
+    bool transparent = stateSet->getRenderingHint() & osg::StateSet::TRANSPARENT_BIN;
+    GLint frontFacing = program ? program->getUniformLocation( "frontFacing" ) : -1;
+
+    if ( transparent )
+    {
+        OSGCAL_PROFILE_COUNT( DRAW_CALLS, 2 );
+        glCullFace( GL_FRONT ); // first draw only back faces
+        if ( frontFacing >= 0 )
+        {   // ^ there can be no "frontFacing" in user shader
+            gl2extensions->glUniform1f( frontFacing, 0.0 );
+        }
+        drawMesh( state, dl );
+        glCullFace( GL_BACK ); // then draw only front faces
+        if ( frontFacing >= 0 )
+        {
+            gl2extensions->glUniform1f( frontFacing, 1.0 );
+        }
+        drawMesh( state, dl );
+    }
+    else if ( frontFacing >= 0 )
+    {
+        // opaque two-sided meshes with osgCal shaders are drawn in
+        // one pass (gl_FrontFacing), this is for user shaders
+        OSGCAL_PROFILE_COUNT( DRAW_CALLS, 2 );
+        // first draw only front faces
+        gl2extensions->glUniform1f( frontFacing, 1.0 );
+        drawMesh( state, dl );
+        // then draw only back faces
+        glCullFace( GL_FRONT ); 
+        gl2extensions->glUniform1f( frontFacing, 0.0 );
+        drawMesh( state, dl );
+        glCullFace( GL_BACK ); // restore backfacing mode
+    }
+    else
+    {
+        OSGCAL_PROFILE_COUNT( DRAW_CALLS, 1 );
+        drawMesh( state, dl );
+    }
+
+//     // get mesh material to restore glColor after glDrawElements call
+//     const osg::Material* material = static_cast< const osg::Material* >
+//         ( state.getLastAppliedAttribute( osg::StateAttribute::MATERIAL ) );
+//     if ( material ) glColor4fv( material->getDiffuse( osg::Material::FRONT ).ptr() );
+    // ^ seems that material color restoring is not needed when
+    // glDrawElements call is placed into display list
+}
+
+void
+HardwareMesh::setupBoneUniforms( const osg::Program::PerContextProgram* program,
+                                 const osg::GLExtensions* gl2extensions ) const
+{
+    // -- Setup dual quaternion uniforms --
+    if ( mesh->parameters->dualQuaternionSkinning )
+    {
+        OSGCAL_PROFILE_SCOPE( BONE_UNIFORMS );
+
+        GLint realQuaternionsAttrib = program->getUniformLocation( "realQuaternions" );
+        if ( realQuaternionsAttrib < 0 )
+        {
+            realQuaternionsAttrib = program->getUniformLocation( "realQuaternions[0]" );
+        }
+
+        GLint dualQuaternionsAttrib = program->getUniformLocation( "dualQuaternions" );
+        if ( dualQuaternionsAttrib < 0 )
+        {
+            dualQuaternionsAttrib = program->getUniformLocation( "dualQuaternions[0]" );
+        }
+
+        if ( realQuaternionsAttrib < 0 || dualQuaternionsAttrib < 0 )
+        {
+            throw std::runtime_error( "no dual quaternion uniforms in deformed mesh?" );
+        }
+
+        static const std::vector< osg::Vec4f >
+            noRotation( Constants::MAX_BONES_PER_MESH_DUAL_QUATERNION + 1,
+                        osg::Vec4f( 0, 0, 0, 1 ) );
+        static const std::vector< osg::Vec4f >
+            noTranslation( Constants::MAX_BONES_PER_MESH_DUAL_QUATERNION + 1,
+                           osg::Vec4f( 0, 0, 0, 0 ) );
+
+        int boneCount = mesh->data->getBonesCount();
+
+        if ( deformed )
+        {
+            GLfloat realQuaternions[Constants::MAX_BONES_PER_MESH_DUAL_QUATERNION + 1][4];
+            GLfloat dualQuaternions[Constants::MAX_BONES_PER_MESH_DUAL_QUATERNION + 1][4];
+
+            for( int boneIndex = 0; boneIndex < boneCount; boneIndex++ )
+            {
+                modelData->getBoneDualQuaternion( mesh->data->getBoneId( boneIndex ),
+                                                  &realQuaternions[boneIndex][0],
+                                                  &dualQuaternions[boneIndex][0] );
+            }
+
+            gl2extensions->glUniform4fv( realQuaternionsAttrib, boneCount,
+                                         &realQuaternions[0][0] );
+            gl2extensions->glUniform4fv( dualQuaternionsAttrib, boneCount,
+                                         &dualQuaternions[0][0] );
+        }
+        else
+        {
+            gl2extensions->glUniform4fv( realQuaternionsAttrib, boneCount,
+                                         (const GLfloat*)&noRotation.front() );
+            gl2extensions->glUniform4fv( dualQuaternionsAttrib, boneCount,
+                                         (const GLfloat*)&noTranslation.front() );
+        }
+    }
     // -- Setup rotation/translation uniforms --
-//    if ( deformed )
-    if ( mesh->data->rigid == false && program )
+    else
     {
+        OSGCAL_PROFILE_SCOPE( BONE_UNIFORMS );
+
         // -- Calculate and bind rotation/translation uniforms --
         GLint rotationMatricesAttrib = program->getUniformLocation( "rotationMatrices" );
         if ( rotationMatricesAttrib < 0 )
@@ -192,70 +365,164 @@ HardwareMesh::drawImplementation( osg::RenderInfo&     renderInfo,
                                          (const GLfloat*)&noTranslation.front() );
         }
     }
+}
 
-    // -- Create display list if not yet exists --
-    unsigned int contextID = renderInfo.getContextID();
+// skinnedPosition, skinnedNormal, skinnedTexCoord, skinnedTangent
+// (see SkeletalFeedback.vert)
+static const int FEEDBACK_VERTEX_SIZE = ( 3 + 3 + 2 + 4 ) * sizeof( GLfloat );
 
-    mesh->displayLists->mutex.lock();
-    GLuint& dl = mesh->displayLists->lists[ contextID ];
+void
+HardwareMesh::skinToFeedbackBuffer( osg::State& state,
+                                    GLuint      displayList ) const
+{
+    FeedbackBuffer& fb = feedbackBuffers[ state.getContextID() ];
 
-    if( dl != 0 )
+    if ( fb.buffer != 0 && fb.skinnedUpdateCount == updateCount )
     {
-        mesh->displayLists->mutex.unlock();
+        return; // already skinned by previous pass
     }
-    else
-    {
-        dl = generateDisplayList( contextID, getGLObjectSizeHint() );
 
-        innerDrawImplementation( renderInfo, dl );
-        mesh->displayLists->mutex.unlock();
+    const osg::GLExtensions* gl2extensions = state.get< osg::GLExtensions >();
 
-        mesh->displayLists->checkAllDisplayListsCompiled( mesh->data.get() );
+    if ( !gl2extensions->glBeginTransformFeedback
+         || !gl2extensions->glBindBufferBase )
+    {
+        throw std::runtime_error( "transform feedback skinning is not supported "
+                                  "(OpenGL 3.0 or EXT_transform_feedback needed)" );
     }
 
-    // -- Call display list --
-    bool transparent = stateSet->getRenderingHint() & osg::StateSet::TRANSPARENT_BIN;
-    GLint frontFacing = program ? program->getUniformLocation( "frontFacing" ) : -1;
+    OSGCAL_PROFILE_SCOPE( SKINNING );
 
-    if ( transparent )
+    // -- Use skinning program --
+    const osg::StateAttribute* passProgram =
+        state.getLastAppliedAttribute( osg::StateAttribute::PROGRAM );
+    const osg::Program* skinningProgram = mesh->stateSets->skinningProgram.get();
+
+    skinningProgram->apply( state ); // compiles program on first use
+    const osg::Program::PerContextProgram* program = skinningProgram->getPCP( state );
+
+    if ( program && program->isLinked() )
     {
-        glCullFace( GL_FRONT ); // first draw only back faces
-        if ( frontFacing >= 0 )
-        {   // ^ there can be no "frontFacing" in user shader
-            gl2extensions->glUniform1f( frontFacing, 0.0 );
-        }
-        glCallList( dl );
-        glCullFace( GL_BACK ); // then draw only front faces
-        if ( frontFacing >= 0 )
+        // -- Create buffer --
+        // Display list draws indexed triangles, so we capture three
+        // vertices per triangle and later draw them with glDrawArrays.
+        if ( fb.buffer == 0 )
         {
-            gl2extensions->glUniform1f( frontFacing, 1.0 );
+            fb.verticesCount = mesh->data->indexBuffer->getNumIndices();
+
+            gl2extensions->glGenBuffers( 1, &fb.buffer );
+            gl2extensions->glBindBuffer( GL_TRANSFORM_FEEDBACK_BUFFER, fb.buffer );
+            gl2extensions->glBufferData( GL_TRANSFORM_FEEDBACK_BUFFER,
+                                         fb.verticesCount * FEEDBACK_VERTEX_SIZE,
+                                         0, GL_DYNAMIC_COPY );
+            gl2extensions->glBindBuffer( GL_TRANSFORM_FEEDBACK_BUFFER, 0 );
         }
-        glCallList( dl );
+
+        // -- Skin --
+        setupBoneUniforms( program, gl2extensions );
+
+        glEnable( GL_RASTERIZER_DISCARD );
+        gl2extensions->glBindBufferBase( GL_TRANSFORM_FEEDBACK_BUFFER, 0, fb.buffer );
+        gl2extensions->glBeginTransformFeedback( GL_TRIANGLES );
+        callDisplayList( state, displayList );
+        gl2extensions->glEndTransformFeedback();
+        gl2extensions->glBindBufferBase( GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0 );
+        glDisable( GL_RASTERIZER_DISCARD );
+
+        OSGCAL_PROFILE_COUNT( FEEDBACK_VERTICES, fb.verticesCount );
+
+        fb.skinnedUpdateCount = updateCount;
     }
-    else if ( frontFacing >= 0 )
+
+    // -- Restore pass program --
+    if ( passProgram )
     {
-        // first draw only front faces
-        gl2extensions->glUniform1f( frontFacing, 1.0 );
-        glCallList( dl );
-        // then draw only back faces
-        glCullFace( GL_FRONT ); 
-        gl2extensions->glUniform1f( frontFacing, 0.0 );
-        glCallList( dl );
-        glCullFace( GL_BACK ); // restore backfacing mode
+        passProgram->apply( state );
     }
     else
     {
-        glCallList( dl );
+        gl2extensions->glUseProgram( 0 );
+        state.setLastAppliedProgramObject( 0 );
     }
+}
 
-//     // get mesh material to restore glColor after glDrawElements call
-//     const osg::Material* material = static_cast< const osg::Material* >
-//         ( state.getLastAppliedAttribute( osg::StateAttribute::MATERIAL ) );
-//     if ( material ) glColor4fv( material->getDiffuse( osg::Material::FRONT ).ptr() );
-    // ^ seems that material color restoring is not needed when
-    // glDrawElements call is placed into display list
+void
+HardwareMesh::callDisplayList( osg::State& state,
+                               GLuint      displayList ) const
+{
+    if ( modelVertexBuffer.valid() || hiddenRangesCount > 0 )
+    {
+        innerDrawImplementation( state );
+    }
+    else
+    {
+        glCallList( displayList );
+    }
 }
 
+void
+HardwareMesh::drawMesh( osg::State& state,
+                        GLuint      displayList ) const
+{
+    if ( !mesh->stateSets->skinningProgram.valid() )
+    {
+        callDisplayList( state, displayList );
+        return;
+    }
+
+    const FeedbackBuffer& fb = feedbackBuffers[ state.getContextID() ];
+
+    if ( fb.buffer == 0 )
+    {
+        return; // skinning program failed to link
+    }
+
+    const osg::GLExtensions* gl2extensions = state.get< osg::GLExtensions >();
+
+    state.disableAllVertexArrays();
+    state.unbindVertexBufferObject();
+    gl2extensions->glBindBuffer( GL_ARRAY_BUFFER_ARB, fb.buffer );
+
+    state.setVertexPointer( 3, GL_FLOAT, FEEDBACK_VERTEX_SIZE,
+                            (const GLvoid*)0 );
+    state.setNormalPointer( GL_FLOAT, FEEDBACK_VERTEX_SIZE,
+                            (const GLvoid*)( 3 * sizeof( GLfloat ) ) );
+    state.setTexCoordPointer( 0, 2, GL_FLOAT, FEEDBACK_VERTEX_SIZE,
+                              (const GLvoid*)( 6 * sizeof( GLfloat ) ) );
+    state.setTexCoordPointer( 1, 4, GL_FLOAT, FEEDBACK_VERTEX_SIZE,
+                              (const GLvoid*)( 8 * sizeof( GLfloat ) ) );
+
+    glDrawArrays( GL_TRIANGLES, 0, fb.verticesCount );
+
+    gl2extensions->glBindBuffer( GL_ARRAY_BUFFER_ARB, 0 );
+    state.disableAllVertexArrays();
+}
+
+void
+HardwareMesh::releaseGLObjects( osg::State* state ) const
+{
+    Mesh::releaseGLObjects( state );
+
+    if ( state )
+    {
+        FeedbackBuffer& fb = feedbackBuffers[ state->getContextID() ];
+
+        if ( fb.buffer != 0 )
+        {
+            state->get< osg::GLExtensions >()->glDeleteBuffers( 1, &fb.buffer );
+            fb = FeedbackBuffer();
+        }
+    }
+    else
+    {
+        for ( size_t i = 0; i < feedbackBuffers.size(); i++ )
+        {
+            feedbackBuffers[ i ] = FeedbackBuffer();
+        }
+    }
+}
+
+
 void
 HardwareMesh::compileGLObjects(osg::RenderInfo& renderInfo) const
 {
@@ -272,9 +539,14 @@ HardwareMesh::compileGLObjects(osg::RenderInfo& renderInfo) const
 
     if( dl == 0 )
     {
-        dl = generateDisplayList( contextID, getGLObjectSizeHint() );
+        {
+            OSGCAL_PROFILE_SCOPE( DISPLAY_LIST_COMPILE );
+            OSGCAL_PROFILE_COUNT( DISPLAY_LISTS_COMPILED, 1 );
 
-        innerDrawImplementation( renderInfo, dl );
+            dl = generateDisplayList( contextID, getGLObjectSizeHint() );
+
+            innerDrawImplementation( *renderInfo.getState(), dl );
+        }
         mesh->displayLists->mutex.unlock();
 
         mesh->displayLists->checkAllDisplayListsCompiled( mesh->data.get() );
@@ -315,7 +587,7 @@ HardwareMesh::accept( osgUtil::GLObjectsVisitor* glv )
 }
 
 void
-HardwareMesh::innerDrawImplementation( osg::RenderInfo&     renderInfo,
+HardwareMesh::innerDrawImplementation( osg::State&          state,
                                        GLuint               displayList ) const
 {   
 #define glError()                                                       \
@@ -328,10 +600,15 @@ HardwareMesh::innerDrawImplementation( osg::RenderInfo&     renderInfo,
         }                                                               \
     }
 
-    osg::State& state = *renderInfo.getState();
-    
     state.disableAllVertexArrays();
 
+    // display list is shared between models, so it is always
+    // compiled from mesh data, while per model buffers are drawn directly
+    const VertexBuffer* vertexBuffer =
+        displayList ? mesh->data->vertexBuffer.get() : getSourceVertexBuffer();
+    const NormalBuffer* normalBuffer =
+        displayList ? mesh->data->normalBuffer.get() : getSourceNormalBuffer();
+
     // -- Setup vertex arrays --
 #ifdef OSG_CAL_BYTE_BUFFERS
     #define NORMAL_TYPE         GL_BYTE
@@ -339,7 +616,7 @@ HardwareMesh::innerDrawImplementation( osg::RenderInfo&     renderInfo,
     #define NORMAL_TYPE         GL_FLOAT
 #endif
 
-    if ( !mesh->data->normalBuffer.valid() )
+    if ( normalBuffer == 0 )
     {
         throw std::runtime_error( "HardwareMesh::innerDrawImplementation(): normalBuffer is not valid. "
                                   "This could happend if your program uses maximum numbers of graphics contexts "
@@ -351,7 +628,7 @@ HardwareMesh::innerDrawImplementation( osg::RenderInfo&     renderInfo,
     }
     
     state.setNormalPointer( NORMAL_TYPE, 0,
-                            mesh->data->normalBuffer->getDataPointer() );
+                            normalBuffer->getDataPointer() );
 
     if ( mesh->data->texCoordBuffer.valid() )
     {
@@ -387,33 +664,22 @@ HardwareMesh::innerDrawImplementation( osg::RenderInfo&     renderInfo,
                                   mesh->data->weightBuffer->getDataPointer() );
     }
 
-    GLshort* matrixIndexBuffer = NULL;
-
-    if ( mesh->data->matrixIndexBuffer.valid() )
+    if ( mesh->data->matrixIndexShortBuffer.valid() )
     {
-        matrixIndexBuffer = new GLshort[ mesh->data->matrixIndexBuffer->size() * 4 ];
-
-        GLshort* mi = matrixIndexBuffer;
-        const GLbyte* m   = (const GLbyte*)mesh->data->matrixIndexBuffer->getDataPointer();
-        const GLbyte* end = m + mesh->data->matrixIndexBuffer->size() * 4;
-        while ( m < end )
-        {
-            *mi++ = *m++;
-        }
-        
         state.setTexCoordPointer( 3, mesh->data->maxBonesInfluence, GL_SHORT, 4*2,
-                                  matrixIndexBuffer );
+                                  mesh->data->matrixIndexShortBuffer->getDataPointer() );
 //         state.setColorPointer( 4, GL_UNSIGNED_BYTE, 0,
 //                                mesh->data->matrixIndexBuffer->getDataPointer() );
         // GL_UNSIGNED_BYTE only supported in ColorPointer not the TexCoord
         // but with color we need to multiply color by 255.0 in shader
-        // and get slighlty less performance (~1%). So we create
-        // GLshort data here. Hope the driver will convert it to bytes
-        // when compiling display list.
+        // and get slighlty less performance (~1%). So we use
+        // GLshort data (see MeshData::matrixIndexShortBuffer). Hope
+        // the driver will convert it to bytes when compiling display
+        // list.
     }
 
     state.setVertexPointer( 3, GL_FLOAT, 0,
-                            mesh->data->vertexBuffer->getDataPointer() );
+                            vertexBuffer->getDataPointer() );
 
     // -- Draw our indexed triangles --
     if ( displayList != 0 )
@@ -422,7 +688,34 @@ HardwareMesh::innerDrawImplementation( osg::RenderInfo&     renderInfo,
         glNewList( displayList, GL_COMPILE );
     }
 
-    mesh->data->indexBuffer->draw( state, false );
+    if ( displayList == 0 && hiddenRangesCount > 0 )
+    {
+        // -- Draw visible ranges of batch (adjacent ones at once) --
+        const GLuint* indices = (const GLuint*)mesh->data->indexBuffer->getDataPointer();
+        const std::vector< IndexRange >& ranges = mesh->data->batchRanges;
+
+        for ( size_t r = 0; r < ranges.size(); r++ )
+        {
+            if ( visibleRanges[ r ] == 0 )
+            {
+                continue;
+            }
+
+            int first = ranges[ r ].first;
+            int count = ranges[ r ].count;
+
+            while ( r + 1 < ranges.size() && visibleRanges[ r + 1 ] != 0 )
+            {
+                count += ranges[ ++r ].count;
+            }
+
+            glDrawElements( GL_TRIANGLES, count, GL_UNSIGNED_INT, indices + first );
+        }
+    }
+    else
+    {
+        mesh->data->indexBuffer->draw( state, false );
+    }
 //     // no visible speedup when using glDrawRangeElements
 //     glDrawRangeElements(
 //         GL_TRIANGLES,
@@ -438,7 +731,6 @@ HardwareMesh::innerDrawImplementation( osg::RenderInfo&     renderInfo,
     //glError();
     state.disableAllVertexArrays();
 
-    delete[] matrixIndexBuffer;
     delete[] weightBuffer;
 }
 
@@ -463,16 +755,40 @@ HardwareMesh::update()
     // them to correct data
     RTPair* rotationTranslationMatrices = (RTPair*)(void*)&rotationTranslationMatricesData;
 
+    bool changed = morph( true );
+    changed |= simulateCloth( true );
+    // ^ per model buffers are drawn (w/o display list), so they are
+    // updated even when there is no software vertex update
+    const bool dualQuaternion = mesh->parameters->dualQuaternionSkinning;
+    const int  bonesCount = mesh->data->getBonesCount();
+
+    // -- Skip mesh with unchanged palette --
+    changed |= !paletteValid;
+
+    for ( int boneIndex = 0; boneIndex < bonesCount && !changed; boneIndex++ )
+    {
+        changed = modelData->getBoneParams( mesh->data->getBoneId( boneIndex ) ).changed;
+    }
+
+    if ( !changed )
+    {
+        return; // `deformed' is the same as on the previous update
+    }
+
+    paletteValid = true;
     deformed = false;
-    bool changed = false;
 
-    for( int boneIndex = 0; boneIndex < mesh->data->getBonesCount(); boneIndex++ )
+    for( int boneIndex = 0; boneIndex < bonesCount; boneIndex++ )
     {
         int boneId = mesh->data->getBoneId( boneIndex );
         const ModelData::BoneParams& bp = modelData->getBoneParams( boneId );
 
         deformed |= bp.deformed;
-        changed  |= bp.changed;
+
+        if ( dualQuaternion )
+        {
+            continue; // palette is set up in skinDualQuaternion
+        }
 
         RTPair& rt = rotationTranslationMatrices[ boneIndex ];
 
@@ -480,6 +796,9 @@ HardwareMesh::update()
         rt.second = bp.translation;
     }
 
+    // -- Invalidate transform feedback buffers --
+    updateCount++;
+
     // -- Check for deformation state and select state set type --
 //     if ( deformed )
 //     {
@@ -499,13 +818,43 @@ HardwareMesh::update()
         depthMesh->update( deformed, changed );
     }
 
-    // -- Check changes --
-    if ( !changed || mesh->parameters->noSoftwareVertexUpdate )
+    if ( mesh->parameters->noSoftwareVertexUpdate )
     {
-//        std::cout << "didn't changed" << std::endl;
-        return; // no changes
+        return;
     }
 
+    // -- Undeformed meshes use shared (or per model) vertex buffer --
+    if ( !deformed )
+    {
+        if ( getVertexArray() != getSourceVertexBuffer()
+             || modelVertexBuffer.valid() )
+        {
+            setVertexArray( const_cast< VertexBuffer* >( getSourceVertexBuffer() ) );
+            boundingBox = mesh->data->boundingBox;
+
+            if ( modelVertexBuffer.valid() )
+            {
+                boundingBox = osg::BoundingBox();
+
+                for ( size_t i = 0; i < modelVertexBuffer->size(); i++ )
+                {
+                    boundingBox.expandBy( (*modelVertexBuffer)[ i ] );
+                }
+            }
+
+            dirtyBound();
+        }
+        return;
+    }
+
+    if ( dualQuaternion )
+    {
+        skinDualQuaternion( false );
+        return;
+    }
+
+    makeDeformedBuffers( false );
+
     rotationTranslationMatrices[ 30 ] = // last always identity (see #68)
         std::make_pair( osg::Matrix3( 1, 0, 0,
                                       0, 1, 0,
@@ -513,10 +862,13 @@ HardwareMesh::update()
                         osg::Vec3( 0, 0, 0 ) );
 
     // -- Scan indexes --
+    OSGCAL_PROFILE_SCOPE( SKINNING );
+    OSGCAL_PROFILE_COUNT( VERTICES_SKINNED, getVertexArray()->getNumElements() );
+
     boundingBox = osg::BoundingBox();
     
     VertexBuffer&               vb  = *(VertexBuffer*)getVertexArray();
-    const VertexBuffer&         svb = *mesh->data->vertexBuffer.get();
+    const VertexBuffer&         svb = *getSourceVertexBuffer();
     const WeightBuffer&         wb  = *mesh->data->weightBuffer.get();
     const MatrixIndexBuffer&    mib = *mesh->data->matrixIndexBuffer.get();
    
@@ -641,3 +993,28 @@ HardwareMesh::update()
 
     dirtyBound();
 }
+
+// -- BatchedMesh --
+
+BatchedMesh::BatchedMesh( ModelData*      _modelData,
+                          const CoreMesh* _mesh,
+                          HardwareMesh*   _batch )
+    : Mesh( _modelData, _mesh )
+    , batch( _batch )
+{
+    setVertexArray( mesh->data->vertexBuffer.get() );
+    addPrimitiveSet( mesh->data->indexBuffer.get() );
+    // ^ not drawn, but geometry is available as for other meshes
+}
+
+osg::Object*
+BatchedMesh::cloneType() const
+{
+    throw std::runtime_error( "cloneType() is not implemented" );
+}
+
+osg::Object*
+BatchedMesh::clone( const osg::CopyOp& ) const
+{
+    throw std::runtime_error( "clone() is not implemented" );
+}
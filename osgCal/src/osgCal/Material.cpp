@@ -211,6 +211,17 @@ concatPaths( const std::string& dir,
     return osgDB::getRealPath( osgDB::concatPaths( dir, file ) );
 }
 
+/**
+ * Map path relative to `dir', or map itself when no `dir' specified.
+ */
+inline
+std::string
+mapPath( const std::string& dir,
+         const std::string& map )
+{
+    return dir.empty() ? map : concatPaths( dir, map );
+}
+
 Material::Material( CalCoreMaterial* m,
                     const std::string& dir )
     : normalsMapAmount( 0 )
@@ -242,15 +253,15 @@ Material::Material( CalCoreMaterial* m,
         
         if ( prefix == "DiffuseMap:" || prefix == "" )
         {
-            diffuseMap = concatPaths( dir, suffix );
+            diffuseMap = mapPath( dir, suffix );
         }
         else if ( prefix == "NormalsMap:" )
         {
-            normalsMap = concatPaths( dir, suffix );
+            normalsMap = mapPath( dir, suffix );
         }
         else if ( prefix == "BumpMap:" )
         {
-            bumpMap = concatPaths( dir, suffix );
+            bumpMap = mapPath( dir, suffix );
         }
         else if ( prefix == "BumpMapAmount:" )
         {
@@ -288,3 +299,25 @@ Material::Material( CalCoreMaterial* m,
         diffuseColor.b() = 1.0;
     }
 }
+
+Material::Material( const Material&    m,
+                    const std::string& dir )
+    : SoftwareMaterial( m )
+    , normalsMapAmount( m.normalsMapAmount )
+    , bumpMapAmount( m.bumpMapAmount )
+{
+    if ( !diffuseMap.empty() )
+    {
+        diffuseMap = mapPath( dir, diffuseMap );
+    }
+
+    if ( !m.normalsMap.empty() )
+    {
+        normalsMap = mapPath( dir, m.normalsMap );
+    }
+
+    if ( !m.bumpMap.empty() )
+    {
+        bumpMap = mapPath( dir, m.bumpMap );
+    }
+}
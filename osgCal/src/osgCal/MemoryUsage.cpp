@@ -0,0 +1,302 @@
+/* -*- c++ -*-
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <iomanip>
+
+#include <osg/Texture>
+
+#include <cal3d/coretrack.h>
+#include <cal3d/corekeyframe.h>
+
+#include <osgCal/MemoryUsage>
+#include <osgCal/Mixer>
+
+using namespace osgCal;
+
+static const char* categoryNames[ MemoryUsage::CATEGORIES_COUNT ] =
+{
+    "mesh buffers",
+    "animations",
+    "skeleton",
+    "core meshes",
+    "textures",
+    "cal model",
+    "deformed buffers",
+    "scene graph",
+};
+
+MemoryUsage::MemoryUsage()
+{
+    for ( int i = 0; i < CATEGORIES_COUNT; i++ )
+    {
+        bytes[ i ] = 0;
+    }
+}
+
+size_t
+MemoryUsage::getTotal() const
+{
+    size_t total = 0;
+
+    for ( int i = 0; i < CATEGORIES_COUNT; i++ )
+    {
+        total += bytes[ i ];
+    }
+
+    return total;
+}
+
+const char*
+MemoryUsage::getCategoryName( Category c )
+{
+    return categoryNames[ c ];
+}
+
+MemoryUsage&
+MemoryUsage::operator += ( const MemoryUsage& mu )
+{
+    for ( int i = 0; i < CATEGORIES_COUNT; i++ )
+    {
+        bytes[ i ] += mu.bytes[ i ];
+    }
+
+    return *this;
+}
+
+void
+MemoryUsage::addBufferData( Category               c,
+                            const osg::BufferData* bd )
+{
+    if ( bd )
+    {
+        bytes[ c ] += bd->getTotalDataSize();
+    }
+}
+
+void
+MemoryUsage::addMeshData( const MeshData* md )
+{
+    bytes[ MESH_BUFFERS ] += sizeof ( MeshData )
+        + md->name.capacity()
+        + md->bonesIndices.capacity() * sizeof ( int );
+
+    addBufferData( MESH_BUFFERS, md->indexBuffer.get() );
+    addBufferData( MESH_BUFFERS, md->vertexBuffer.get() );
+    addBufferData( MESH_BUFFERS, md->weightBuffer.get() );
+    addBufferData( MESH_BUFFERS, md->matrixIndexBuffer.get() );
+    addBufferData( MESH_BUFFERS, md->matrixIndexShortBuffer.get() );
+    addBufferData( MESH_BUFFERS, md->normalBuffer.get() );
+    addBufferData( MESH_BUFFERS, md->texCoordBuffer.get() );
+    addBufferData( MESH_BUFFERS, md->tangentAndHandednessBuffer.get() );
+
+    for ( size_t t = 0; t < md->morphTargets.size(); t++ )
+    {
+        if ( md->morphTargets[t].valid() )
+        {
+            bytes[ MESH_BUFFERS ] += sizeof ( MorphTarget );
+            addBufferData( MESH_BUFFERS, md->morphTargets[t]->vertexIndices.get() );
+            addBufferData( MESH_BUFFERS, md->morphTargets[t]->positionDeltas.get() );
+            addBufferData( MESH_BUFFERS, md->morphTargets[t]->normalDeltas.get() );
+        }
+    }
+
+    if ( md->cloth.valid() )
+    {
+        bytes[ MESH_BUFFERS ] += sizeof ( Cloth );
+        addBufferData( MESH_BUFFERS, md->cloth->particleVertices.get() );
+        addBufferData( MESH_BUFFERS, md->cloth->particleWeights.get() );
+        addBufferData( MESH_BUFFERS, md->cloth->springs.get() );
+        addBufferData( MESH_BUFFERS, md->cloth->idleLengths.get() );
+        addBufferData( MESH_BUFFERS, md->cloth->batchEnds.get() );
+    }
+}
+
+template < typename T >
+static size_t
+vectorSize( const std::vector< T >& v )
+{
+    return v.capacity() * sizeof ( T );
+}
+
+void
+MemoryUsage::addCalCoreModel( CalCoreModel* cm )
+{
+    // -- Animations --
+    for ( int i = 0; i < cm->getCoreAnimationCount(); i++ )
+    {
+        CalCoreAnimation* a = cm->getCoreAnimation( i );
+        std::list< CalCoreTrack* >& tracks = a->getListCoreTrack();
+
+        bytes[ ANIMATIONS ] += sizeof ( CalCoreAnimation );
+
+        for ( std::list< CalCoreTrack* >::iterator
+                  t = tracks.begin(),
+                  tEnd = tracks.end();
+              t != tEnd; ++t )
+        {
+            bytes[ ANIMATIONS ] += sizeof ( CalCoreTrack )
+                + sizeof ( void* ) * 3 // list node
+                + (*t)->getCoreKeyframeCount()
+                  * ( sizeof ( CalCoreKeyframe ) + sizeof ( CalCoreKeyframe* ) );
+        }
+    }
+
+    // -- Skeleton --
+    if ( cm->getCoreSkeleton() )
+    {
+        std::vector< CalCoreBone* >& bones =
+            cm->getCoreSkeleton()->getVectorCoreBone();
+
+        bytes[ SKELETON ] += sizeof ( CalCoreSkeleton ) + vectorSize( bones );
+
+        for ( size_t i = 0; i < bones.size(); i++ )
+        {
+            bytes[ SKELETON ] += sizeof ( CalCoreBone )
+                + bones[ i ]->getName().capacity()
+                + bones[ i ]->getListChildId().size()
+                  * ( sizeof ( int ) + sizeof ( void* ) * 2 ); // list nodes
+        }
+    }
+
+    // -- Core meshes --
+    for ( int i = 0; i < cm->getCoreMeshCount(); i++ )
+    {
+        CalCoreMesh* mesh = cm->getCoreMesh( i );
+
+        bytes[ CORE_MESHES ] += sizeof ( CalCoreMesh );
+
+        for ( int j = 0; j < mesh->getCoreSubmeshCount(); j++ )
+        {
+            CalCoreSubmesh* sm = mesh->getCoreSubmesh( j );
+
+            std::vector< CalCoreSubmesh::Vertex >& vertices = sm->getVectorVertex();
+
+            bytes[ CORE_MESHES ] += sizeof ( CalCoreSubmesh )
+                + vectorSize( vertices )
+                + vectorSize( sm->getVectorFace() )
+                + vectorSize( sm->getVectorPhysicalProperty() )
+                + vectorSize( sm->getVectorSpring() );
+
+            for ( size_t v = 0; v < vertices.size(); v++ )
+            {
+                bytes[ CORE_MESHES ] += vectorSize( vertices[ v ].vectorInfluence );
+            }
+
+            for ( size_t m = 0; m < sm->getVectorVectorTextureCoordinate().size(); m++ )
+            {
+                bytes[ CORE_MESHES ] += vectorSize( sm->getVectorVectorTextureCoordinate()[ m ] );
+            }
+
+            for ( size_t m = 0; m < sm->getVectorVectorTangentSpace().size(); m++ )
+            {
+                bytes[ CORE_MESHES ] += vectorSize( sm->getVectorVectorTangentSpace()[ m ] );
+            }
+
+            std::vector< CalCoreSubMorphTarget* >& morphTargets =
+                sm->getVectorCoreSubMorphTarget();
+
+            for ( size_t m = 0; m < morphTargets.size(); m++ )
+            {
+                bytes[ CORE_MESHES ] += sizeof ( CalCoreSubMorphTarget )
+                    + vectorSize( morphTargets[ m ]->getVectorBlendVertex() );
+            }
+        }
+    }
+}
+
+void
+MemoryUsage::addCalModel( CalModel* m )
+{
+    bytes[ CAL_MODEL ] += sizeof ( CalModel )
+        + sizeof ( CalMorphTargetMixer )
+        + sizeof ( CalPhysique )
+        + sizeof ( CalSpringSystem )
+        + sizeof ( CalRenderer );
+
+    Mixer* mixer = dynamic_cast< Mixer* >( m->getAbstractMixer() );
+
+    if ( mixer )
+    {
+        bytes[ CAL_MODEL ] += sizeof ( Mixer )
+            + mixer->getCapacity() * Mixer::getInstanceSize()
+            + mixer->getCallbacksSize()
+            + mixer->getPoseBuffersSize()
+            + m->getCoreModel()->getCoreAnimationCount() * sizeof ( int );
+    }
+
+    CalSkeleton* skeleton = m->getSkeleton();
+
+    if ( skeleton )
+    {
+        bytes[ SKELETON ] += sizeof ( CalSkeleton )
+            + vectorSize( skeleton->getVectorBone() )
+            + skeleton->getVectorBone().size() * sizeof ( CalBone );
+    }
+}
+
+void
+MemoryUsage::addTextures( const osg::StateSet*            ss,
+                          std::set< const osg::Image* >&  counted )
+{
+    if ( !ss )
+    {
+        return;
+    }
+
+    for ( unsigned int unit = 0; unit < ss->getTextureAttributeList().size(); unit++ )
+    {
+        const osg::Texture* t = dynamic_cast< const osg::Texture* >
+            ( ss->getTextureAttribute( unit, osg::StateAttribute::TEXTURE ) );
+
+        if ( !t )
+        {
+            continue;
+        }
+
+        for ( unsigned int i = 0; i < t->getNumImages(); i++ )
+        {
+            const osg::Image* image = t->getImage( i );
+
+            if ( image && counted.insert( image ).second )
+            {
+                bytes[ TEXTURES ] += image->getTotalSizeInBytesIncludingMipmaps();
+            }
+        }
+    }
+}
+
+std::ostream&
+osgCal::operator << ( std::ostream&      os,
+                      const MemoryUsage& mu )
+{
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize precision = os.precision();
+
+    os << std::fixed << std::setprecision( 1 );
+
+    for ( int i = 0; i < MemoryUsage::CATEGORIES_COUNT; i++ )
+    {
+        os << std::setw( 18 ) << std::left << categoryNames[ i ] << ": "
+           << std::setw( 10 ) << std::right << mu.bytes[ i ] / 1024.0 << " KiB" << std::endl;
+    }
+
+    os << std::setw( 18 ) << std::left << "total" << ": "
+       << std::setw( 10 ) << std::right << mu.getTotal() / 1024.0 << " KiB" << std::endl;
+
+    os.flags( flags );
+    os.precision( precision );
+
+    return os;
+}
@@ -15,7 +15,10 @@
     License along with this library; if not, write to the Free Software
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
+#include <osg/Math>
+
 #include <osgCal/Mesh>
+#include <osgCal/Profiler>
 
 using namespace osgCal;
 
@@ -41,6 +44,11 @@ Mesh::Mesh( ModelData*      _modelData,
     // TODO: how to completely disable FLATTEN_STATIC_TRANSFORMS on models?
     // it copies vertex buffer (which is per model) for each submesh
     // which takes too much memory
+
+    if ( mesh->data->cloth.valid() )
+    {
+        clothSimulation = new ClothSimulation( mesh->data.get() );
+    }
 }
 
 void
@@ -53,6 +61,13 @@ Mesh::changeParameters( const MeshParameters* newP )
         throw std::runtime_error(
             "Mesh::changeParameters: software/hardware switching is not supported" );
     }
+
+    if ( mesh->batch.valid() )
+    {
+        throw std::runtime_error(
+            "Mesh::changeParameters: parameters of batched mesh can't be changed "
+            "(disable CoreModel::setRigidMeshesBatching)" );
+    }
     
     mesh = new CoreMesh( modelData->getCoreModel(),
                          mesh.get(),
@@ -66,3 +81,251 @@ Mesh::onParametersChanged( const MeshParameters* previousParameters )
 {
     (void)previousParameters;
 }
+
+void
+Mesh::makeDeformedBuffers( bool normals )
+{
+    // skinning writes to vertex array and reads from source buffer,
+    // so they must not be the same array
+    if ( getVertexArray() == mesh->data->vertexBuffer.get()
+         || getVertexArray() == modelVertexBuffer.get() )
+    {
+        setVertexArray( (VertexBuffer*)mesh->data->vertexBuffer->clone( osg::CopyOp::DEEP_COPY_ALL ) );
+    }
+
+    if ( normals && ( getNormalArray() == mesh->data->normalBuffer.get()
+                      || getNormalArray() == modelNormalBuffer.get() ) )
+    {
+        setNormalArray( (NormalBuffer*)mesh->data->normalBuffer->clone( osg::CopyOp::DEEP_COPY_ALL ) );
+    }
+}
+
+void
+Mesh::makeModelBuffers( bool normals )
+{
+    if ( !modelVertexBuffer.valid() )
+    {
+        modelVertexBuffer = new VertexBuffer( *mesh->data->vertexBuffer );
+    }
+
+    if ( normals && !modelNormalBuffer.valid() )
+    {
+        modelNormalBuffer = new NormalBuffer( *mesh->data->normalBuffer );
+    }
+}
+
+static
+inline
+osg::Vec3f
+convert( const osg::Vec3f& v )
+{
+    return v;
+}
+
+static
+inline
+osg::Vec3f
+convert( const osg::Vec3b& v )
+{
+    return osg::Vec3f( v.x() / 127.0, v.y() / 127.0, v.z() / 127.0 );
+}
+
+static
+inline
+void
+addNormalDelta( osg::Vec3f&       n,
+                const osg::Vec3f& d )
+{
+    n += d;
+}
+
+static
+inline
+void
+addNormalDelta( osg::Vec3b&       n,
+                const osg::Vec3f& d )
+{
+    osg::Vec3f f = convert( n ) + d;
+    n.set( (GLbyte)osg::clampBetween( f.x() * 127.0f, -127.0f, 127.0f ),
+           (GLbyte)osg::clampBetween( f.y() * 127.0f, -127.0f, 127.0f ),
+           (GLbyte)osg::clampBetween( f.z() * 127.0f, -127.0f, 127.0f ) );
+}
+
+bool
+Mesh::morph( bool normals )
+{
+    const std::vector< osg::ref_ptr< MorphTarget > >& targets = mesh->data->morphTargets;
+
+    if ( targets.empty() || !modelData->areMorphTargetsChanged() )
+    {
+        return false;
+    }
+
+    // -- Select active targets --
+    std::vector< int > active;
+
+    for ( size_t t = 0; t < targets.size(); t++ )
+    {
+        if ( targets[t].valid() && modelData->getMorphTargetWeight( t ) != 0.0f )
+        {
+            active.push_back( t );
+        }
+    }
+
+    if ( active.empty() )
+    {
+        if ( activeMorphTargets.empty() )
+        {
+            return false;
+        }
+    }
+
+    if ( active.empty() && !clothSimulation.valid() )
+    {
+        // back to shared mesh data
+        activeMorphTargets.clear();
+        modelVertexBuffer = 0;
+        modelNormalBuffer = 0;
+        return true;
+    }
+
+    OSGCAL_PROFILE_SCOPE( MORPHING );
+
+    const VertexBuffer& svb = *mesh->data->vertexBuffer.get();
+    normals = normals && mesh->data->normalBuffer.valid();
+
+    makeModelBuffers( normals );
+
+    VertexBuffer& vb = *modelVertexBuffer;
+
+    // -- Restore vertices moved by previously active targets --
+    for ( size_t i = 0; i < activeMorphTargets.size(); i++ )
+    {
+        const osg::UIntArray& vi = *targets[ activeMorphTargets[i] ]->vertexIndices;
+
+        for ( size_t j = 0; j < vi.size(); j++ )
+        {
+            vb[ vi[j] ] = svb[ vi[j] ];
+
+            if ( normals )
+            {
+                (*modelNormalBuffer)[ vi[j] ] = (*mesh->data->normalBuffer)[ vi[j] ];
+            }
+        }
+    }
+
+    // -- Add weighted deltas of active targets --
+    for ( size_t i = 0; i < active.size(); i++ )
+    {
+        const MorphTarget& mt = *targets[ active[i] ];
+        const float w = modelData->getMorphTargetWeight( active[i] );
+        const osg::UIntArray& vi = *mt.vertexIndices;
+        const VertexBuffer& pd = *mt.positionDeltas;
+        const VertexBuffer& nd = *mt.normalDeltas;
+
+        OSGCAL_PROFILE_COUNT( VERTICES_MORPHED, vi.size() );
+
+        for ( size_t j = 0; j < vi.size(); j++ )
+        {
+            vb[ vi[j] ] += pd[j] * w;
+
+            if ( normals )
+            {
+                addNormalDelta( (*modelNormalBuffer)[ vi[j] ], nd[j] * w );
+            }
+        }
+    }
+
+    activeMorphTargets.swap( active );
+
+    return true;
+}
+
+bool
+Mesh::simulateCloth( bool normals )
+{
+    if ( !clothSimulation.valid() )
+    {
+        return false;
+    }
+
+    OSGCAL_PROFILE_SCOPE( CLOTH );
+    OSGCAL_PROFILE_COUNT( CLOTH_PARTICLES, mesh->data->cloth->getParticlesCount() );
+
+    normals = normals && mesh->data->normalBuffer.valid();
+
+    makeModelBuffers( normals );
+
+    clothSimulation->update( mesh->data.get(),
+                             modelData.get(),
+                             modelData->getClothDeltaTime(),
+                             *modelVertexBuffer,
+                             normals ? modelNormalBuffer.get() : 0 );
+
+    return true;
+}
+
+void
+Mesh::skinDualQuaternion( bool normals )
+{
+    makeDeformedBuffers( normals );
+
+    // -- Setup bone palette --
+    const DualQuaternion* palette[ Constants::MAX_BONES_PER_MESH_DUAL_QUATERNION + 1 ];
+    
+    for( int boneIndex = 0; boneIndex < mesh->data->getBonesCount(); boneIndex++ )
+    {
+        palette[ boneIndex ] =
+            &modelData->getBoneParams( mesh->data->getBoneId( boneIndex ) ).dualQuaternion;
+    }
+
+    // -- Scan indexes --
+    OSGCAL_PROFILE_SCOPE( SKINNING );
+    OSGCAL_PROFILE_COUNT( VERTICES_SKINNED, getVertexArray()->getNumElements() );
+
+    boundingBox = osg::BoundingBox();
+
+    VertexBuffer&               vb  = *(VertexBuffer*)getVertexArray();
+    const VertexBuffer&         svb = *getSourceVertexBuffer();
+    const WeightBuffer&         wb  = *mesh->data->weightBuffer.get();
+    const MatrixIndexBuffer&    mib = *mesh->data->matrixIndexBuffer.get();
+
+    osg::Vec3f*                 n   = 0; /* dest normal */
+    const NormalBuffer::value_type*
+                                sn  = 0; /* source normal */
+
+    if ( normals )
+    {
+        n  = &((NormalBuffer*)getNormalArray())->front();
+        sn = &getSourceNormalBuffer()->front();
+    }
+
+    const int maxBonesInfluence = mesh->data->maxBonesInfluence;
+
+    for ( size_t i = 0; i < vb.size(); i++ )
+    {
+        const osg::Vec4f& w  = wb[ i ];
+        const MatrixIndexBuffer::value_type& mi = mib[ i ];
+
+        DualQuaternion dq;
+        dq.real = palette[ mi[0] ]->real * w[0];
+        dq.dual = palette[ mi[0] ]->dual * w[0];
+
+        for ( int j = 1; j < maxBonesInfluence && w[j] > 0; j++ )
+        {
+            dq.add( *palette[ mi[j] ], w[j], dq.real );
+        }
+
+        dq.normalize();
+
+        vb[ i ] = dq.transformPoint( svb[ i ] );
+        boundingBox.expandBy( vb[ i ] );
+
+        if ( normals )
+        {
+            n[ i ] = dq.transformVector( convert( sn[ i ] ) );
+        }
+    }
+
+    dirtyBound();
+}
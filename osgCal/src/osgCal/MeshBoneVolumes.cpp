@@ -0,0 +1,438 @@
+/* -*- c++ -*-
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <math.h>
+#include <algorithm>
+
+#include <osgCal/MeshBoneVolumes>
+#include <osgCal/Model>
+
+using namespace osgCal;
+
+MeshBoneVolumes::MeshBoneVolumes( const MeshData* data )
+{
+    const IndexBuffer& ib = *data->indexBuffer.get();
+    int trianglesCount = ib.getNumIndices() / 3;
+
+    // -- Rigid mesh is one group moving with its bone --
+    if ( data->rigid )
+    {
+        Group g;
+        g.boneBoxes.push_back( BoneBox( -1, data->boundingBox ) );
+        g.triangles.resize( trianglesCount );
+
+        for ( int i = 0; i < trianglesCount; i++ )
+        {
+            g.triangles[ i ] = i;
+        }
+
+        groups.push_back( g );
+        return;
+    }
+
+    const VertexBuffer&      vb  = *data->vertexBuffer.get();
+    const WeightBuffer&      wb  = *data->weightBuffer.get();
+    const MatrixIndexBuffer& mib = *data->matrixIndexBuffer.get();
+    const int                bonesCount = data->getBonesCount();
+
+    // -- Group triangles by the bone with the largest influence --
+    std::vector< int > boneGroup( bonesCount, -1 );
+    std::vector< float > influence( bonesCount, 0.0f );
+
+    for ( int t = 0; t < trianglesCount; t++ )
+    {
+        int best = 0;
+
+        for ( int k = 0; k < 3; k++ )
+        {
+            int v = ib.index( t*3 + k );
+
+            for ( int j = 0; j < 4 && wb[ v ][ j ] > 0; j++ )
+            {
+                int b = mib[ v ][ j ];
+                influence[ b ] += wb[ v ][ j ];
+
+                if ( influence[ b ] > influence[ best ] )
+                {
+                    best = b;
+                }
+            }
+        }
+
+        for ( int k = 0; k < 3; k++ )
+        {
+            int v = ib.index( t*3 + k );
+
+            for ( int j = 0; j < 4; j++ )
+            {
+                influence[ mib[ v ][ j ] ] = 0.0f;
+            }
+        }
+
+        if ( boneGroup[ best ] < 0 )
+        {
+            boneGroup[ best ] = groups.size();
+            groups.push_back( Group() );
+        }
+
+        groups[ boneGroup[ best ] ].triangles.push_back( t );
+    }
+
+    // -- Calculate group vertices boxes in bind pose for each bone --
+    // Skinned vertex is a weighted sum of its positions transformed
+    // by each influencing bone, so it lies inside the union of group
+    // boxes transformed by current bones.
+    std::vector< osg::BoundingBox > boxes( bonesCount );
+
+    for ( size_t gi = 0; gi < groups.size(); gi++ )
+    {
+        Group& g = groups[ gi ];
+
+        for ( size_t ti = 0; ti < g.triangles.size(); ti++ )
+        {
+            for ( int k = 0; k < 3; k++ )
+            {
+                int v = ib.index( g.triangles[ ti ]*3 + k );
+
+                for ( int j = 0; j < 4 && wb[ v ][ j ] > 0; j++ )
+                {
+                    boxes[ mib[ v ][ j ] ].expandBy( vb[ v ] );
+                }
+            }
+        }
+
+        for ( int b = 0; b < bonesCount; b++ )
+        {
+            if ( boxes[ b ].valid() )
+            {
+                g.boneBoxes.push_back( BoneBox( b, boxes[ b ] ) );
+                boxes[ b ].init();
+            }
+        }
+    }
+}
+
+static
+inline
+osg::Vec3f
+mul3( const osg::Matrix3& m,
+      const osg::Vec3f& v )
+{
+    return osg::Vec3f( m(0,0)*v.x() + m(1,0)*v.y() + m(2,0)*v.z(),
+                       m(0,1)*v.x() + m(1,1)*v.y() + m(2,1)*v.z(),
+                       m(0,2)*v.x() + m(1,2)*v.y() + m(2,2)*v.z() );
+}
+
+static
+osg::BoundingBox
+transformBox( const osg::BoundingBox& b,
+              const osg::Matrix3&     r,
+              const osg::Vec3f&       t )
+{
+    osg::Vec3f c = mul3( r, b.center() ) + t;
+    osg::Vec3f e = ( b._max - b._min ) * 0.5f;
+    osg::Vec3f ext( fabsf( r(0,0) )*e.x() + fabsf( r(1,0) )*e.y() + fabsf( r(2,0) )*e.z(),
+                    fabsf( r(0,1) )*e.x() + fabsf( r(1,1) )*e.y() + fabsf( r(2,1) )*e.z(),
+                    fabsf( r(0,2) )*e.x() + fabsf( r(1,2) )*e.y() + fabsf( r(2,2) )*e.z() );
+
+    return osg::BoundingBox( c - ext, c + ext );
+}
+
+/**
+ * Segment start + dir * [0, maxRatio] vs box slab test.
+ */
+static
+bool
+intersectBox( const osg::BoundingBox& b,
+              const osg::Vec3f&       start,
+              const osg::Vec3f&       dir,
+              float                   maxRatio )
+{
+    float tmin = 0.0f;
+    float tmax = maxRatio;
+
+    for ( int i = 0; i < 3; i++ )
+    {
+        if ( fabsf( dir[ i ] ) < 1e-12f )
+        {
+            if ( start[ i ] < b._min[ i ] || start[ i ] > b._max[ i ] )
+            {
+                return false;
+            }
+        }
+        else
+        {
+            float t1 = ( b._min[ i ] - start[ i ] ) / dir[ i ];
+            float t2 = ( b._max[ i ] - start[ i ] ) / dir[ i ];
+
+            if ( t1 > t2 )
+            {
+                std::swap( t1, t2 );
+            }
+
+            tmin = std::max( tmin, t1 );
+            tmax = std::min( tmax, t2 );
+
+            if ( tmin > tmax )
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Two-sided segment/triangle test (Moller-Trumbore).
+ */
+static
+bool
+intersectTriangle( const osg::Vec3f& start,
+                   const osg::Vec3f& dir,
+                   const osg::Vec3f& v0,
+                   const osg::Vec3f& v1,
+                   const osg::Vec3f& v2,
+                   float&            ratio,
+                   float&            u,
+                   float&            v )
+{
+    osg::Vec3f e1 = v1 - v0;
+    osg::Vec3f e2 = v2 - v0;
+    osg::Vec3f p = dir ^ e2;
+    float det = e1 * p;
+
+    if ( fabsf( det ) < 1e-12f )
+    {
+        return false;
+    }
+
+    float invDet = 1.0f / det;
+    osg::Vec3f s = start - v0;
+
+    u = ( s * p ) * invDet;
+    if ( u < 0.0f || u > 1.0f )
+    {
+        return false;
+    }
+
+    osg::Vec3f q = s ^ e1;
+
+    v = ( dir * q ) * invDet;
+    if ( v < 0.0f || u + v > 1.0f )
+    {
+        return false;
+    }
+
+    ratio = ( e2 * q ) * invDet;
+
+    return ratio >= 0.0f;
+}
+
+static
+osg::Vec3f
+skinVertex( const MeshData*                      data,
+            const ModelData::BoneParams* const*  palette,
+            bool                                 dualQuaternionSkinning,
+            int                                  v )
+{
+    const osg::Vec3f&  sv = (*data->vertexBuffer)[ v ];
+    const osg::Vec4f&  w  = (*data->weightBuffer)[ v ];
+    const MatrixIndexBuffer::value_type& mi = (*data->matrixIndexBuffer)[ v ];
+
+    if ( dualQuaternionSkinning )
+    {
+        DualQuaternion dq;
+        dq.real = palette[ mi[0] ]->dualQuaternion.real * w[0];
+        dq.dual = palette[ mi[0] ]->dualQuaternion.dual * w[0];
+
+        for ( int j = 1; j < 4 && w[j] > 0; j++ )
+        {
+            dq.add( palette[ mi[j] ]->dualQuaternion, w[j], dq.real );
+        }
+
+        dq.normalize();
+
+        return dq.transformPoint( sv );
+    }
+
+    osg::Vec3f r;
+
+    for ( int j = 0; j < 4 && w[j] > 0; j++ )
+    {
+        const ModelData::BoneParams& bp = *palette[ mi[j] ];
+        r += ( mul3( bp.rotation, sv ) + bp.translation ) * w[j];
+    }
+
+    return r;
+}
+
+bool
+MeshBoneVolumes::intersect( const ModelData*    modelData,
+                            const MeshData*     data,
+                            bool                dualQuaternionSkinning,
+                            const osg::Vec3f&   start,
+                            const osg::Vec3f&   end,
+                            ModelIntersection&  intersection ) const
+{
+    const osg::Vec3f dir = end - start;
+    const IndexBuffer& ib = *data->indexBuffer.get();
+
+    // -- Setup bone palette --
+    const ModelData::BoneParams*
+        palette[ Constants::MAX_BONES_PER_MESH_DUAL_QUATERNION + 1 ];
+
+    static const ModelData::BoneParams noBone; // identity for unrigged meshes
+
+    if ( data->rigid )
+    {
+        palette[ 0 ] = data->rigidBoneId >= 0
+            ? &modelData->getBoneParams( data->rigidBoneId ) : &noBone;
+    }
+    else
+    {
+        for ( int b = 0; b < data->getBonesCount(); b++ )
+        {
+            palette[ b ] = &modelData->getBoneParams( data->getBoneId( b ) );
+        }
+    }
+
+    bool hit = false;
+
+    for ( size_t gi = 0; gi < groups.size(); gi++ )
+    {
+        const Group& g = groups[ gi ];
+
+        // -- Coarse test with current group bounds --
+        osg::BoundingBox bounds;
+
+        for ( size_t bi = 0; bi < g.boneBoxes.size(); bi++ )
+        {
+            const ModelData::BoneParams& bp =
+                *palette[ std::max( g.boneBoxes[ bi ].first, 0 ) ];
+            bounds.expandBy( transformBox( g.boneBoxes[ bi ].second,
+                                           bp.rotation, bp.translation ) );
+        }
+
+        if ( dualQuaternionSkinning && !data->rigid )
+        {
+            // Dual quaternion skinned vertex is not a convex
+            // combination of its positions Ti(p) transformed by each
+            // bone, but (with weights aligned like in skinVertex)
+            // for any point m
+            //   |p' - m| <= sqrt( sum |Ti(p) - m|^2 ).
+            // All Ti(p) are inside the linear bounds, so with m at
+            // their center p' is inside the sphere of radius
+            // sqrt( influences ) * bounds radius.
+            float r = bounds.radius() * sqrtf( (float)data->maxBonesInfluence );
+            osg::Vec3f c = bounds.center();
+            bounds.set( c - osg::Vec3f( r, r, r ), c + osg::Vec3f( r, r, r ) );
+        }
+
+        if ( !intersectBox( bounds, start, dir, intersection.ratio ) )
+        {
+            continue;
+        }
+
+        // -- Skin and test group triangles --
+        for ( size_t ti = 0; ti < g.triangles.size(); ti++ )
+        {
+            int t = g.triangles[ ti ];
+            int vi[ 3 ] = { ib.index( t*3 ), ib.index( t*3 + 1 ), ib.index( t*3 + 2 ) };
+            osg::Vec3f v[ 3 ];
+
+            for ( int k = 0; k < 3; k++ )
+            {
+                if ( data->rigid )
+                {
+                    const ModelData::BoneParams& bp = *palette[ 0 ];
+                    v[ k ] = mul3( bp.rotation, (*data->vertexBuffer)[ vi[ k ] ] )
+                        + bp.translation;
+                }
+                else
+                {
+                    v[ k ] = skinVertex( data, palette, dualQuaternionSkinning, vi[ k ] );
+                }
+            }
+
+            float ratio, u, w;
+
+            if ( !intersectTriangle( start, dir, v[0], v[1], v[2], ratio, u, w )
+                 || ratio > intersection.ratio )
+            {
+                continue;
+            }
+
+            hit = true;
+            intersection.triangleIndex = t;
+            intersection.ratio = ratio;
+            intersection.position = start + dir * ratio;
+            intersection.normal = ( v[1] - v[0] ) ^ ( v[2] - v[0] );
+            intersection.normal.normalize();
+
+            // -- Bone with largest influence at hit point --
+            intersection.boneId = data->rigidBoneId;
+
+            if ( !data->rigid )
+            {
+                float bary[ 3 ] = { 1.0f - u - w, u, w };
+                float bestInfluence = 0.0f;
+                int   best = 0;
+
+                for ( int k = 0; k < 3; k++ )
+                {
+                    const osg::Vec4f& wk = (*data->weightBuffer)[ vi[ k ] ];
+                    const MatrixIndexBuffer::value_type& mk =
+                        (*data->matrixIndexBuffer)[ vi[ k ] ];
+
+                    for ( int j = 0; j < 4 && wk[j] > 0; j++ )
+                    {
+                        float influence = 0.0f;
+
+                        for ( int l = 0; l < 3; l++ )
+                        {
+                            const osg::Vec4f& wl = (*data->weightBuffer)[ vi[ l ] ];
+                            const MatrixIndexBuffer::value_type& ml =
+                                (*data->matrixIndexBuffer)[ vi[ l ] ];
+
+                            for ( int m = 0; m < 4 && wl[m] > 0; m++ )
+                            {
+                                if ( ml[m] == mk[j] )
+                                {
+                                    influence += bary[ l ] * wl[m];
+                                }
+                            }
+                        }
+
+                        if ( influence > bestInfluence )
+                        {
+                            bestInfluence = influence;
+                            best = mk[j];
+                        }
+                    }
+                }
+
+                intersection.boneId = data->getBoneId( best );
+
+                if ( modelData->getBoneParams( intersection.boneId ).bone == 0 )
+                {
+                    intersection.boneId = -1; // unrigged vertices bone
+                }
+            }
+        }
+    }
+
+    return hit;
+}
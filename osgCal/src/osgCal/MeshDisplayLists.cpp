@@ -17,6 +17,7 @@
 */
 
 #include <osgCal/MeshDisplayLists>
+#include <osgCal/Profiler>
 
 using namespace osgCal;
 
@@ -46,10 +47,31 @@ MeshDisplayLists::checkAllDisplayListsCompiled( MeshData* data ) const
         }
     }
 
+    if ( !data->morphTargets.empty() || data->cloth.valid() )
+    {
+        return; // morphed or simulated mesh is drawn from buffers
+    }
+
+    if ( !data->batchRanges.empty() )
+    {
+        return; // batch with hidden meshes is drawn from buffers
+    }
+
     // -- Free buffers that are no more needed --
+    OSGCAL_PROFILE_COUNT( BYTES_FREED,
+                          ( data->normalBuffer.valid()
+                            ? data->normalBuffer->getTotalDataSize() : 0 )
+                          + ( data->texCoordBuffer.valid()
+                              ? data->texCoordBuffer->getTotalDataSize() : 0 )
+                          + ( data->tangentAndHandednessBuffer.valid()
+                              ? data->tangentAndHandednessBuffer->getTotalDataSize() : 0 )
+                          + ( data->matrixIndexShortBuffer.valid()
+                              ? data->matrixIndexShortBuffer->getTotalDataSize() : 0 ) );
+
     data->normalBuffer = 0;
     data->texCoordBuffer = 0;
     data->tangentAndHandednessBuffer = 0;
+    data->matrixIndexShortBuffer = 0;
 }
 
 void
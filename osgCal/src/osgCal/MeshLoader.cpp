@@ -16,6 +16,13 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 #include <memory>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include <osg/io_utils>
 
 #include <osgCal/MeshLoader>
@@ -91,6 +98,16 @@ checkRigidness( osgCal::MeshData* m,
         m->rigidBoneId = -1; // no bone
     }
 
+    if ( m->rigid && ( !m->morphTargets.empty() || m->cloth.valid() ) )
+    {
+        // morphed (or cloth) mesh is deformed per model, so it can't
+        // be drawn with shared display list, we skin it as usual
+        // (unrigged vertices are handled below)
+        m->rigid = false;
+        m->rigidBoneId = -1;
+        m->maxBonesInfluence = std::max( m->maxBonesInfluence, 1 );
+    }
+
     // -- Remove unneded for rigid mesh --
     if ( m->rigid )
     {
@@ -151,6 +168,181 @@ checkForEmptyTexCoord( osgCal::MeshData* m )
     m->tangentAndHandednessBuffer = 0;
 }
 
+// -- Tangent space generation --
+
+static inline
+float
+dot3( const float* a,
+      const float* b )
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static inline
+void
+cross3( const float* a,
+        const float* b,
+        float*       r )
+{
+    r[0] = a[1] * b[2] - a[2] * b[1];
+    r[1] = a[2] * b[0] - a[0] * b[2];
+    r[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+/**
+ * Normalize vector, return its length before normalization. Zero
+ * length vectors are left unchanged if \c skipZero is true.
+ */
+static inline
+float
+normalize3( float* v,
+            bool   skipZero = false )
+{
+    float length = sqrtf( dot3( v, v ) );
+
+    if ( length > 0 || !skipZero )
+    {
+        v[0] /= length;
+        v[1] /= length;
+        v[2] /= length;
+    }
+
+    return length;
+}
+
+/**
+ * Add normalized sdir & tdir of the face corner to the vertex tangent
+ * and bitangent sums.
+ */
+static inline
+void
+addCornerTangents( const GLfloat*  vb,
+                   const GLfloat*  tb,
+                   const CalIndex* indexBuffer,
+                   int             corner,
+                   float*          tan1,
+                   float*          tan2 )
+{
+    static const int next[3] = { 1, 2, 0 };
+    static const int prev[3] = { 2, 0, 1 };
+
+    // there seems to be no visual difference in calculating
+    // tangent per vertex (as is tan1[i1] += spos(j=0,1,2))
+    // or per face (tan1[i1,i2,i3] += spos)
+    int face = corner - corner % 3;
+    int j    = corner - face;
+    CalIndex i1 = indexBuffer[face + j];
+    CalIndex i2 = indexBuffer[face + next[j]];
+    CalIndex i3 = indexBuffer[face + prev[j]];
+
+    const float* v1 = &vb[i1*3];
+    const float* v2 = &vb[i2*3];
+    const float* v3 = &vb[i3*3];
+
+    const float* w1 = &tb[i1*2];
+    const float* w2 = &tb[i2*2];
+    const float* w3 = &tb[i3*2];
+
+    float x1 = v2[0] - v1[0];
+    float x2 = v3[0] - v1[0];
+    float y1 = v2[1] - v1[1];
+    float y2 = v3[1] - v1[1];
+    float z1 = v2[2] - v1[2];
+    float z2 = v3[2] - v1[2];
+
+    float s1 = w2[0] - w1[0];
+    float s2 = w3[0] - w1[0];
+    float t1 = w2[1] - w1[1];
+    float t2 = w3[1] - w1[1];
+
+    //float r = 1.0F / (s1 * t2 - s2 * t1);
+    float r = (s1 * t2 - s2 * t1) < 0 ? -1.0 : 1.0;
+    float sdir[3] = { (t2 * x1 - t1 * x2) * r,
+                      (t2 * y1 - t1 * y2) * r,
+                      (t2 * z1 - t1 * z2) * r };
+    float tdir[3] = { (s1 * x2 - s2 * x1) * r,
+                      (s1 * y2 - s2 * y1) * r,
+                      (s1 * z2 - s2 * z1) * r };
+
+    // sdir & tdir can be 0 (when UV unwrap doesn't exists
+    // or has errors like coincide points)
+    // we ignore them
+    if ( normalize3( sdir, true ) > 0 )
+    {
+        tan1[0] += sdir[0];
+        tan1[1] += sdir[1];
+        tan1[2] += sdir[2];
+    }
+
+    if ( normalize3( tdir, true ) > 0 )
+    {
+        tan2[0] += tdir[0];
+        tan2[1] += tdir[1];
+        tan2[2] += tdir[2];
+    }
+}
+
+/**
+ * Calculate tangent & handedness from the summed tangent & bitangent
+ * and vertex normal.
+ */
+static inline
+void
+orthogonalizeTangent( float*       t,
+                      float*       b,
+                      const float* n,
+                      GLfloat*     th )
+{
+    float tangent[3]  = { 0, 0, 0 };
+    float binormal[3] = { 0, 0, 0 };
+    float nxt[3];
+
+    // tangent & bitangent can be zero when UV unwrap doesn't exists
+    // or has errors like coincide points
+    if ( normalize3( t, true ) > 0 )
+    {
+        // Gram-Schmidt orthogonalize
+        float nt = dot3( n, t );
+        tangent[0] = t[0] - n[0] * nt;
+        tangent[1] = t[1] - n[1] * nt;
+        tangent[2] = t[2] - n[2] * nt;
+        normalize3( tangent );
+
+        // Calculate handedness
+        cross3( n, t, nxt );
+        float h = (dot3( nxt, b ) < 0.0F) ? -1.0f : 1.0f;
+        cross3( n, tangent, binormal );
+        binormal[0] *= h;
+        binormal[1] *= h;
+        binormal[2] *= h;
+        normalize3( binormal );
+    }
+    else if ( normalize3( b, true ) > 0 )
+    {
+        // Gram-Schmidt orthogonalize
+        float nb = dot3( n, b );
+        binormal[0] = b[0] - n[0] * nb;
+        binormal[1] = b[1] - n[1] * nb;
+        binormal[2] = b[2] - n[2] * nb;
+        normalize3( binormal );
+
+        // Calculate handedness
+        cross3( n, b, nxt );
+        float h = (dot3( nxt, t ) < 0.0F) ? -1.0f : 1.0f;
+        cross3( n, binormal, tangent );
+        tangent[0] *= h;
+        tangent[1] *= h;
+        tangent[2] *= h;
+        normalize3( tangent );
+    }
+
+    cross3( n, tangent, nxt );
+    th[0] = tangent[0];
+    th[1] = tangent[1];
+    th[2] = tangent[2];
+    th[3] = ((dot3( nxt, binormal ) > 0.0F) ? -1.0f : 1.0f); // handedness
+}
+
 static
 void
 generateTangentAndHandednessBuffer( osgCal::MeshData* m,
@@ -163,12 +355,10 @@ generateTangentAndHandednessBuffer( osgCal::MeshData* m,
 
     int vertexCount = m->vertexBuffer->size();
     int faceCount   = m->getIndicesCount() / 3;    
+    int cornerCount = faceCount * 3;
 
     m->tangentAndHandednessBuffer = new TangentAndHandednessBuffer( vertexCount );
 
-    CalVector* tan1 = new CalVector[vertexCount];
-    CalVector* tan2 = new CalVector[vertexCount];
-
     const GLfloat* texCoordBufferData = (GLfloat*) m->texCoordBuffer->getDataPointer();
 
     const GLfloat* vb = (GLfloat*) m->vertexBuffer->getDataPointer();
@@ -181,130 +371,68 @@ generateTangentAndHandednessBuffer( osgCal::MeshData* m,
     const GLfloat* nb = (GLfloat*) m->normalBuffer->getDataPointer();
 #endif
 
-    for ( int face = 0; face < faceCount; face++ )
+    // tan1 & tan2 sums per vertex
+    std::vector< float > tangentSums( vertexCount * 6 + 1, 0.0f );
+    float* ts = &tangentSums.front();
+
+#ifdef _OPENMP
+    if ( omp_get_max_threads() > 1 )
     {
-        for ( int j = 0; j < 3; j++ )
+        // Each face corner contributes only to its own vertex, so
+        // instead of scattering per-face results we gather face
+        // corners per vertex. Corners are sorted by vertex (counting
+        // sort, stable), so every vertex sums its corners in the same
+        // order as the sequential loop below. This makes the result
+        // independent of the number of threads.
+        std::vector< int > vertexCorners( vertexCount + 1, 0 );
+        std::vector< int > corners( cornerCount + 1 );
+
+        for ( int c = 0; c < cornerCount; c++ )
         {
-            // there seems to be no visual difference in calculating
-            // tangent per vertex (as is tan1[i1] += spos(j=0,1,2))
-            // or per face (tan1[i1,i2,i3] += spos)
-            CalIndex i1 = indexBuffer[face*3+(j+0)%3];
-            CalIndex i2 = indexBuffer[face*3+(j+1)%3];
-            CalIndex i3 = indexBuffer[face*3+(j+2)%3];
-        
-            const float* v1 = &vb[i1*3];
-            const float* v2 = &vb[i2*3];
-            const float* v3 = &vb[i3*3];
+            vertexCorners[ indexBuffer[c] ]++;
+        }
 
-            const float* w1 = &texCoordBufferData[i1*2];
-            const float* w2 = &texCoordBufferData[i2*2];
-            const float* w3 = &texCoordBufferData[i3*2];
+        for ( int v = 1; v <= vertexCount; v++ )
+        {
+            vertexCorners[ v ] += vertexCorners[ v - 1 ];
+        }
 
-#define x(_a) (_a[0])
-#define y(_a) (_a[1])
-#define z(_a) (_a[2])
-        
-            float x1 = x(v2) - x(v1);
-            float x2 = x(v3) - x(v1);
-            float y1 = y(v2) - y(v1);
-            float y2 = y(v3) - y(v1);
-            float z1 = z(v2) - z(v1);
-            float z2 = z(v3) - z(v1);
-        
-            float s1 = x(w2) - x(w1);
-            float s2 = x(w3) - x(w1);
-            float t1 = y(w2) - y(w1);
-            float t2 = y(w3) - y(w1);
-
-#undef x
-#undef y
-#undef z
-        
-            //float r = 1.0F / (s1 * t2 - s2 * t1);
-            float r = (s1 * t2 - s2 * t1) < 0 ? -1.0 : 1.0;
-            CalVector sdir((t2 * x1 - t1 * x2) * r, (t2 * y1 - t1 * y2) * r,
-                           (t2 * z1 - t1 * z2) * r);
-            CalVector tdir((s1 * x2 - s2 * x1) * r, (s1 * y2 - s2 * y1) * r,
-                           (s1 * z2 - s2 * z1) * r);
-
-            // sdir & tdir can be 0 (when UV unwrap doesn't exists
-            // or has errors like coincide points)
-            // we ignore them
-            if ( sdir.length() > 0 )
-            {
-                sdir.normalize(); 
+        // filling backwards turns the vertex end offsets into start
+        // offsets and keeps corners of each vertex in ascending order
+        for ( int c = cornerCount - 1; c >= 0; c-- )
+        {
+            corners[ --vertexCorners[ indexBuffer[c] ] ] = c;
+        }
 
-                tan1[i1] += sdir;
-                //tan1[i2] += sdir;
-                //tan1[i3] += sdir;
-            }
+        const int* vc = &vertexCorners.front();
+        const int* cs = &corners.front();
 
-            if ( tdir.length() > 0 )
+#pragma omp parallel for schedule(static)
+        for ( int a = 0; a < vertexCount; a++ )
+        {
+            for ( int k = vc[a]; k < vc[a+1]; k++ )
             {
-                tdir.normalize();
-
-                tan2[i1] += tdir;
-                //tan2[i2] += tdir;
-                //tan2[i3] += tdir;
+                addCornerTangents( vb, texCoordBufferData, indexBuffer, cs[k],
+                                   &ts[a*6], &ts[a*6+3] );
             }
         }
     }
-    
-    for (long a = 0; a < vertexCount; a++)
+    else
+#endif
     {
-        CalVector tangent;
-        CalVector binormal;
-        CalVector t = tan1[a];
-        CalVector b = tan2[a];
-        CalVector n = CalVector( nb[a*3+0],
-                                 nb[a*3+1],
-                                 nb[a*3+2] );
-
-        // tangent & bitangent can be zero when UV unwrap doesn't exists
-        // or has errors like coincide points
-        if ( t.length() > 0 )
-        {
-            t.normalize();
-        
-            // Gram-Schmidt orthogonalize
-            tangent = t - n * (n*t);
-            tangent.normalize();
-
-            // Calculate handedness
-            binormal = CalVector(n % tangent) *
-                ((((n % t) * b) < 0.0F) ? -1.0f : 1.0f);
-            binormal.normalize();
-        }
-        else if ( b.length() > 0 )
+        for ( int c = 0; c < cornerCount; c++ )
         {
-            b.normalize();
-        
-            // Gram-Schmidt orthogonalize
-            binormal = b - n * (n*b);
-            binormal.normalize();
-
-            // Calculate handedness
-            tangent = CalVector(n % binormal) *
-                ((((n % b) * t) < 0.0F) ? -1.0f : 1.0f);
-            tangent.normalize();
+            int a = indexBuffer[c];
+            addCornerTangents( vb, texCoordBufferData, indexBuffer, c,
+                               &ts[a*6], &ts[a*6+3] );
         }
+    }
 
-//         std::cout << "t = " << tangent.x  << '\t' << tangent.y  << '\t' << tangent.z  << '\n';
-//         std::cout << "b = " << binormal.x << '\t' << binormal.y << '\t' << binormal.z << '\n';
-//            std::cout << "n = " << n.x        << '\t' << n.y        << '\t' << n.z        << '\n';
-
-//         thb[a*4+0] = floatToHalf( tangent.x ); //tangent.x * 0x7FFF;
-//         thb[a*4+1] = floatToHalf( tangent.y ); //tangent.y * 0x7FFF;
-//         thb[a*4+2] = floatToHalf( tangent.z ); //tangent.z * 0x7FFF;
-//         thb[a*4+3] = floatToHalf((((n % tangent) * binormal) > 0.0F) ? -1.0f : 1.0f); // handedness
-        thb[a*4+0] = tangent.x; 
-        thb[a*4+1] = tangent.y;
-        thb[a*4+2] = tangent.z;
-        thb[a*4+3] = ((((n % tangent) * binormal) > 0.0F) ? -1.0f : 1.0f); // handedness
+#pragma omp parallel for schedule(static)
+    for ( int a = 0; a < vertexCount; a++ )
+    {
+        orthogonalizeTangent( &ts[a*6], &ts[a*6+3], &nb[a*3], &thb[a*4] );
     }
-    
-    delete[] tan1;
-    delete[] tan2;
 
 #ifdef OSG_CAL_BYTE_BUFFERS
     GLbyte* tangents = (GLbyte*) tangentBuffer->getDataPointer();
@@ -322,13 +450,340 @@ generateTangentAndHandednessBuffer( osgCal::MeshData* m,
 #endif
 }
 
+/**
+ * Map hardware mesh vertices to core submesh vertices. Hardware
+ * model doesn't keep this mapping, so we repeat its work: faces are
+ * emitted in the submesh order (skipping faces of other partitions)
+ * and each new vertex gets next local index.
+ */
+static
+void
+mapHardwareVertices( const osgCal::MeshData* m,
+                     CalCoreSubmesh*         coreSubmesh,
+                     const CalIndex*         indices,
+                     int                     faceCount,
+                     std::vector< int >&     submeshVertexIds )
+{
+    std::vector< CalCoreSubmesh::Face >& faces = coreSubmesh->getVectorFace();
+    std::vector< CalCoreSubmesh::Vertex >& vertices = coreSubmesh->getVectorVertex();
+
+    submeshVertexIds.assign( m->vertexBuffer->size(), -1 );
+    std::vector< int > localIds( vertices.size(), -1 );
+    int nextLocalId = 0;
+    int face = 0;
+
+    for ( size_t f = 0; f < faces.size() && face < faceCount; f++ )
+    {
+        const CalIndex* fi = &indices[ face*3 ];
+        int added[3];
+        int addedCount = 0;
+        bool match = true;
+
+        for ( int c = 0; c < 3 && match; c++ )
+        {
+            int v = faces[f].vertexId[c];
+            int l = fi[c];
+
+            if ( localIds[v] >= 0 )
+            {
+                match = ( localIds[v] == l );
+                continue;
+            }
+
+            const CalVector& p = vertices[v].position;
+
+            match = ( l == nextLocalId && l < (int)submeshVertexIds.size()
+                      && (*m->vertexBuffer)[l] == osg::Vec3f( p.x, p.y, p.z ) );
+
+            if ( match )
+            {
+                localIds[v] = l;
+                submeshVertexIds[l] = v;
+                added[ addedCount++ ] = v;
+                nextLocalId++;
+            }
+        }
+
+        if ( !match ) // face from other partition, rollback
+        {
+            for ( int i = 0; i < addedCount; i++ )
+            {
+                submeshVertexIds[ localIds[ added[i] ] ] = -1;
+                localIds[ added[i] ] = -1;
+            }
+
+            nextLocalId -= addedCount;
+            continue;
+        }
+
+        face++;
+    }
+
+    if ( face != faceCount )
+    {
+        throw std::runtime_error( "Can't map hardware mesh vertices of mesh "
+                                  + m->name + " to morph targets" );
+    }
+}
+
+/**
+ * Load submesh morph targets as sparse deltas of mesh vertices.
+ */
+static
+void
+loadMorphTargets( osgCal::MeshData*         m,
+                  CalCoreSubmesh*           coreSubmesh,
+                  const std::vector< int >& submeshVertexIds )
+{
+    std::vector< CalCoreSubMorphTarget* >& targets =
+        coreSubmesh->getVectorCoreSubMorphTarget();
+
+    if ( targets.empty() )
+    {
+        return;
+    }
+
+    std::vector< CalCoreSubmesh::Vertex >& vertices = coreSubmesh->getVectorVertex();
+    const float eps = 1e-6f;
+    bool hasDeltas = false;
+
+    m->morphTargets.resize( targets.size() );
+
+    for ( size_t t = 0; t < targets.size(); t++ )
+    {
+        std::vector< CalCoreSubMorphTarget::BlendVertex >& bv =
+            targets[t]->getVectorBlendVertex();
+
+        osg::ref_ptr< MorphTarget > mt( new MorphTarget );
+
+        for ( size_t i = 0; i < submeshVertexIds.size(); i++ )
+        {
+            int v = submeshVertexIds[i];
+
+            if ( v < 0 || v >= (int)bv.size() )
+            {
+                continue;
+            }
+
+            CalVector dp = bv[v].position - vertices[v].position;
+            CalVector dn = bv[v].normal - vertices[v].normal;
+
+            if ( dp.length() <= eps && dn.length() <= eps )
+            {
+                continue; // vertex is not moved by target
+            }
+
+            mt->vertexIndices->push_back( i );
+            mt->positionDeltas->push_back( osg::Vec3f( dp.x, dp.y, dp.z ) );
+            mt->normalDeltas->push_back( osg::Vec3f( dn.x, dn.y, dn.z ) );
+        }
+
+        if ( !mt->empty() )
+        {
+            m->morphTargets[t] = mt;
+            hasDeltas = true;
+        }
+    }
+
+    if ( !hasDeltas )
+    {
+        m->morphTargets.clear();
+    }
+}
+
+static
+int
+addPinnedParticle( Cloth*              cloth,
+                   std::vector< int >& particleIds,
+                   int                 vertex )
+{
+    if ( particleIds[ vertex ] < 0 )
+    {
+        particleIds[ vertex ] = cloth->particleVertices->size();
+        cloth->particleVertices->push_back( vertex );
+        cloth->particleWeights->push_back( 0.0f );
+    }
+
+    return particleIds[ vertex ];
+}
+
+/**
+ * Load submesh springs as cloth, springs are sorted into batches
+ * using greedy edge coloring.
+ */
+static
+void
+loadCloth( osgCal::MeshData*         m,
+           CalCoreSubmesh*           coreSubmesh,
+           const std::vector< int >& submeshVertexIds )
+{
+    std::vector< CalCoreSubmesh::Spring >& coreSprings = coreSubmesh->getVectorSpring();
+    std::vector< CalCoreSubmesh::PhysicalProperty >& properties =
+        coreSubmesh->getVectorPhysicalProperty();
+
+    if ( coreSprings.empty() || properties.empty() )
+    {
+        return;
+    }
+
+    const int vertexCount = submeshVertexIds.size();
+    std::vector< int > meshVertexIds( properties.size(), -1 );
+
+    for ( int i = 0; i < vertexCount; i++ )
+    {
+        if ( submeshVertexIds[i] >= 0 && submeshVertexIds[i] < (int)properties.size() )
+        {
+            meshVertexIds[ submeshVertexIds[i] ] = i;
+        }
+    }
+
+    osg::ref_ptr< Cloth > cloth( new Cloth );
+    std::vector< int > particleIds( vertexCount, -1 );
+
+    // -- Dynamic particles --
+    for ( int i = 0; i < vertexCount; i++ )
+    {
+        int v = submeshVertexIds[i];
+
+        if ( v >= 0 && v < (int)properties.size() && properties[v].weight > 0.0f )
+        {
+            particleIds[i] = cloth->particleVertices->size();
+            cloth->particleVertices->push_back( i );
+            cloth->particleWeights->push_back( properties[v].weight );
+        }
+    }
+
+    const int dynamicCount = cloth->particleVertices->size();
+
+    // -- Springs --
+    std::vector< std::pair< int, int > > springs;
+    std::vector< float >                 idleLengths;
+
+    for ( size_t s = 0; s < coreSprings.size(); s++ )
+    {
+        int a = meshVertexIds[ coreSprings[s].vertexId[0] ];
+        int b = meshVertexIds[ coreSprings[s].vertexId[1] ];
+
+        if ( a < 0 || b < 0 )
+        {
+            continue; // spring in other hardware mesh
+        }
+
+        if ( particleIds[a] < 0 && particleIds[b] < 0 )
+        {
+            continue; // both vertices are pinned
+        }
+
+        springs.push_back( std::make_pair( addPinnedParticle( cloth.get(), particleIds, a ),
+                                           addPinnedParticle( cloth.get(), particleIds, b ) ) );
+        idleLengths.push_back( coreSprings[s].idleLength );
+    }
+
+    if ( springs.empty() )
+    {
+        return;
+    }
+
+    // -- Pinned vertices of triangles with dynamic ones (for normals) --
+    for ( unsigned int i = 0; i + 2 < m->indexBuffer->getNumIndices(); i += 3 )
+    {
+        unsigned int t[3] = { m->indexBuffer->index( i ),
+                              m->indexBuffer->index( i + 1 ),
+                              m->indexBuffer->index( i + 2 ) };
+
+        for ( int c = 0; c < 3; c++ )
+        {
+            if ( particleIds[ t[c] ] >= 0 && particleIds[ t[c] ] < dynamicCount )
+            {
+                for ( int j = 0; j < 3; j++ )
+                {
+                    addPinnedParticle( cloth.get(), particleIds, t[j] );
+                }
+                break;
+            }
+        }
+    }
+
+    // -- Batches --
+    std::vector< std::vector< int > > particleBatches( cloth->getParticlesCount() );
+    std::vector< std::vector< int > > batches;
+
+    for ( size_t s = 0; s < springs.size(); s++ )
+    {
+        std::vector< int >& a = particleBatches[ springs[s].first ];
+        std::vector< int >& b = particleBatches[ springs[s].second ];
+        int batch = 0;
+
+        while ( std::find( a.begin(), a.end(), batch ) != a.end()
+                || std::find( b.begin(), b.end(), batch ) != b.end() )
+        {
+            batch++;
+        }
+
+        if ( batch == (int)batches.size() )
+        {
+            batches.push_back( std::vector< int >() );
+        }
+
+        batches[ batch ].push_back( s );
+        a.push_back( batch );
+        b.push_back( batch );
+    }
+
+    for ( size_t i = 0; i < batches.size(); i++ )
+    {
+        for ( size_t j = 0; j < batches[i].size(); j++ )
+        {
+            cloth->springs->push_back( springs[ batches[i][j] ].first );
+            cloth->springs->push_back( springs[ batches[i][j] ].second );
+            cloth->idleLengths->push_back( idleLengths[ batches[i][j] ] );
+        }
+
+        cloth->batchEnds->push_back( cloth->idleLengths->size() );
+    }
+
+    // -- Rig dynamic vertices to identity bone (see checkRigidness) --
+    for ( int p = 0; p < dynamicCount; p++ )
+    {
+        int v = (*cloth->particleVertices)[p];
+
+        (*m->weightBuffer)[v] = osg::Vec4f( 0, 0, 0, 0 );
+        (*m->matrixIndexBuffer)[v] = MatrixIndexBuffer::value_type( 0, 0, 0, 0 );
+    }
+
+    m->cloth = cloth;
+}
+
+static
+int
+getTotalFaceCount( CalCoreModel* calCoreModel )
+{
+    int faceCount = 0;
+
+    for ( int i = 0; i < calCoreModel->getCoreMeshCount(); i++ )
+    {
+        CalCoreMesh* cm = calCoreModel->getCoreMesh( i );
+
+        for ( int j = 0; j < cm->getCoreSubmeshCount(); j++ )
+        {
+            faceCount += cm->getCoreSubmesh( j )->getFaceCount();
+        }
+    }
+
+    return faceCount;
+}
+
 void
 loadMeshes( CalCoreModel* calCoreModel,
-            MeshesVector& meshes )
+            MeshesVector& meshes,
+            int           maxBonesPerMesh )
     throw (std::runtime_error)
 {
-    const int maxVertices = Constants::MAX_VERTEX_PER_MODEL;
-    const int maxFaces    = Constants::MAX_VERTEX_PER_MODEL * 3;
+    // Each face adds at most three vertices to hardware meshes (even
+    // with duplication on hardware mesh borders), so we don't need
+    // to allocate buffers for MAX_VERTEX_PER_MODEL vertices.
+    const int maxFaces    = std::max( getTotalFaceCount( calCoreModel ), 1 );
+    const int maxVertices = maxFaces * 3;
 
     std::auto_ptr< CalHardwareModel > calHardwareModel( new CalHardwareModel( calCoreModel ) );
     
@@ -366,7 +821,7 @@ loadMeshes( CalCoreModel* calCoreModel,
     // if ids not set all meshes will be used at load() time
 
     //std::cout << "calHardwareModel->load" << std::endl;
-    calHardwareModel->load( 0, 0, Constants::MAX_BONES_PER_MESH );
+    calHardwareModel->load( 0, 0, maxBonesPerMesh );
     //std::cout << "calHardwareModel->load ok" << std::endl;
 
     int vertexCount = calHardwareModel->getTotalVertexCount();
@@ -403,6 +858,8 @@ loadMeshes( CalCoreModel* calCoreModel,
     // -- And now create meshes data --
     int unriggedBoneIndex = calCoreModel->getCoreSkeleton()->getVectorCoreBone().size();
     // we add empty bone in ModelData to handle unrigged vertices;
+
+    std::map< CalCoreMaterial*, osg::ref_ptr< Material > > materials;
     
     for( int hardwareMeshId = 0; hardwareMeshId < calHardwareModel->getHardwareMeshCount(); hardwareMeshId++ )
     {
@@ -435,6 +892,13 @@ loadMeshes( CalCoreModel* calCoreModel,
             throw std::runtime_error( buf );
         }
 
+        osg::ref_ptr< Material >& material = materials[ m->coreMaterial ];
+        if ( !material.valid() )
+        {
+            material = new Material( m->coreMaterial, "" );
+        }
+        m->material = material;
+
         // -- Create index buffer --
         int indexesCount = faceCount * 3;
         int startIndex = calHardwareModel->getStartIndex();
@@ -495,6 +959,20 @@ loadMeshes( CalCoreModel* calCoreModel,
 
         m->bonesIndices = hardwareMesh->m_vectorBonesIndices;
 
+        CalCoreSubmesh* coreSubmesh = calCoreModel->getCoreMesh( hardwareMesh->meshId )
+            ->getCoreSubmesh( hardwareMesh->submeshId );
+
+        if ( coreSubmesh->getCoreSubMorphTargetCount() > 0
+             || coreSubmesh->getSpringCount() > 0 )
+        {
+            std::vector< int > submeshVertexIds;
+            mapHardwareVertices( m.get(), coreSubmesh, &indexBuffer[ startIndex ],
+                                 faceCount, submeshVertexIds );
+
+            loadMorphTargets( m.get(), coreSubmesh, submeshVertexIds );
+            loadCloth( m.get(), coreSubmesh, submeshVertexIds );
+        }
+
         checkRigidness( m.get(), unriggedBoneIndex );
         checkForEmptyTexCoord( m.get() );
         generateTangentAndHandednessBuffer( m.get(), &indexBuffer[ startIndex ] );
@@ -503,6 +981,126 @@ loadMeshes( CalCoreModel* calCoreModel,
     }
 }
 
+template < typename Buffer >
+static
+void
+appendBuffer( osg::ref_ptr< Buffer >& dst,
+              const Buffer*           src )
+{
+    if ( src )
+    {
+        if ( !dst.valid() )
+        {
+            dst = new Buffer;
+        }
+
+        dst->insert( dst->end(), src->begin(), src->end() );
+    }
+}
+
+bool
+canMergeMeshes( const MeshData* a,
+                const MeshData* b )
+{
+    return a->material == b->material
+        && a->rigid == b->rigid
+        && ( a->rigid
+             ? a->rigidBoneId == b->rigidBoneId
+             : a->bonesIndices == b->bonesIndices
+               && a->maxBonesInfluence == b->maxBonesInfluence )
+        && a->texCoordBuffer.valid() == b->texCoordBuffer.valid()
+        && a->tangentAndHandednessBuffer.valid()
+           == b->tangentAndHandednessBuffer.valid()
+        && a->weightBuffer.valid() == b->weightBuffer.valid()
+        && a->matrixIndexBuffer.valid() == b->matrixIndexBuffer.valid()
+        && a->morphTargets.empty() && b->morphTargets.empty()
+        && !a->cloth.valid() && !b->cloth.valid();
+}
+
+MeshData*
+mergeMeshes( const std::vector< const MeshData* >& meshes )
+    throw (std::runtime_error)
+{
+    if ( meshes.empty() )
+    {
+        throw std::runtime_error( "mergeMeshes: no meshes to merge" );
+    }
+
+    osg::ref_ptr< MeshData > m( new MeshData );
+    const MeshData* front = meshes.front();
+
+    m->coreMaterial      = front->coreMaterial;
+    m->material          = front->material;
+    m->rigid             = front->rigid;
+    m->rigidBoneId       = front->rigidBoneId;
+    m->maxBonesInfluence = front->maxBonesInfluence;
+    m->bonesIndices      = front->bonesIndices;
+
+    osg::DrawElementsUInt* indexBuffer =
+        new osg::DrawElementsUInt( osg::PrimitiveSet::TRIANGLES );
+    m->indexBuffer = indexBuffer;
+    m->vertexBuffer = new VertexBuffer;
+
+    for ( std::vector< const MeshData* >::const_iterator
+              s = meshes.begin(),
+              sEnd = meshes.end();
+          s != sEnd; ++s )
+    {
+        const MeshData* d = *s;
+
+        if ( !canMergeMeshes( front, d ) )
+        {
+            throw std::runtime_error( "mergeMeshes: mesh '" + d->name
+                                      + "' can't be merged with '"
+                                      + front->name + "'" );
+        }
+
+        // -- Indices shifted by vertices of previous meshes --
+        const unsigned int vertexOffset = m->vertexBuffer->size();
+        IndexRange range;
+
+        range.first = indexBuffer->size();
+        range.count = d->getIndicesCount();
+
+        for ( int i = 0; i < range.count; i++ )
+        {
+            indexBuffer->push_back( vertexOffset + d->indexBuffer->index( i ) );
+        }
+
+        m->batchRanges.push_back( range );
+
+        // -- Vertex buffers --
+        appendBuffer( m->vertexBuffer, d->vertexBuffer.get() );
+        appendBuffer( m->weightBuffer, d->weightBuffer.get() );
+        appendBuffer( m->matrixIndexBuffer, d->matrixIndexBuffer.get() );
+        appendBuffer( m->normalBuffer, d->normalBuffer.get() );
+        appendBuffer( m->texCoordBuffer, d->texCoordBuffer.get() );
+        appendBuffer( m->tangentAndHandednessBuffer, d->tangentAndHandednessBuffer.get() );
+
+        m->boundingBox.expandBy( d->boundingBox );
+        m->name += ( s == meshes.begin() ? "" : "+" ) + d->name;
+
+        // -- Source names, once each (hardware meshes of one source
+        //    mesh have the same name) --
+        std::vector< std::string > names( d->mergedNames );
+        if ( names.empty() )
+        {
+            names.push_back( d->name );
+        }
+
+        for ( size_t n = 0; n < names.size(); n++ )
+        {
+            if ( std::find( m->mergedNames.begin(), m->mergedNames.end(), names[n] )
+                 == m->mergedNames.end() )
+            {
+                m->mergedNames.push_back( names[n] );
+            }
+        }
+    }
+
+    return m.release();
+}
+
 // -- Meshes I/O --
 
 std::string
@@ -592,10 +1190,10 @@ struct FileBuffer
  *  - we free some buffers after display list is created for all
  *    contexts and it's much better to keep these buffer in contiguous
  *    memory block to reduce memory fragmentation, so we place 
- *    index/vertex/weight/matrixIndex buffers first (they are needed
- *    for picking and vertex position calculation) and then
- *    normal/texCoord/tangent buffers for all meshes (these ones will
- *    be freed)
+ *    index/vertex/weight/matrixIndex, morph target & cloth buffers
+ *    first (they are needed for picking and vertex position
+ *    calculation) and then normal/texCoord/tangent buffers for all
+ *    meshes (these ones will be freed)
  */
 enum BufferType
 {
@@ -607,7 +1205,20 @@ enum BufferType
     BT_NORMAL                   = 0x050000,
     BT_TEX_COORD                = 0x060000,
     BT_TANGENT_AND_HANDEDNESS   = 0x070000,
+    BT_MORPH_INDICES            = 0x080000,
+    BT_MORPH_POSITION           = 0x090000,
+    BT_MORPH_NORMAL             = 0x0A0000,
+    BT_CLOTH_PARTICLES          = 0x0B0000,
+    BT_CLOTH_WEIGHTS            = 0x0C0000,
+    BT_CLOTH_SPRINGS            = 0x0D0000,
+    BT_CLOTH_IDLE_LENGTHS       = 0x0E0000,
+    BT_CLOTH_BATCHES            = 0x0F0000,
 };
+
+/**
+ * Morph target buffers keep target id in low bits of buffer type.
+ */
+static const int BT_MORPH_TARGET_MASK = 0xFFFF;
     
 
 enum BufferElementType
@@ -705,6 +1316,47 @@ readBuffer( MeshesVector& meshes,
         CASE( TEX_COORD, texCoordBuffer, TexCoordBuffer );
         CASE( TANGENT_AND_HANDEDNESS, tangentAndHandednessBuffer, TangentAndHandednessBuffer );
 
+#define MORPH_CASE( _type, _name, _data_type )                          \
+        case BT_##_type:                                                \
+        {                                                               \
+            size_t t = bufferType & BT_MORPH_TARGET_MASK;               \
+            if ( t >= m->morphTargets.size() )                          \
+            {                                                           \
+                throw std::runtime_error( "Incorrect morph target id in " + fn ); \
+            }                                                           \
+            if ( !m->morphTargets[t].valid() )                          \
+            {                                                           \
+                m->morphTargets[t] = new MorphTarget;                   \
+            }                                                           \
+            m->morphTargets[t]->_name = new _data_type( bufferSize );   \
+            READ( m->morphTargets[t]->_name );                          \
+            break;                                                      \
+        }
+
+        MORPH_CASE( MORPH_INDICES, vertexIndices, osg::UIntArray );
+        MORPH_CASE( MORPH_POSITION, positionDeltas, VertexBuffer );
+        MORPH_CASE( MORPH_NORMAL, normalDeltas, VertexBuffer );
+
+#undef MORPH_CASE
+
+#define CLOTH_CASE( _type, _name, _data_type )                          \
+        case BT_##_type:                                                \
+            if ( !m->cloth.valid() )                                    \
+            {                                                           \
+                m->cloth = new Cloth;                                   \
+            }                                                           \
+            m->cloth->_name = new _data_type( bufferSize );             \
+            READ( m->cloth->_name );                                    \
+            break
+
+        CLOTH_CASE( CLOTH_PARTICLES, particleVertices, osg::UIntArray );
+        CLOTH_CASE( CLOTH_WEIGHTS, particleWeights, osg::FloatArray );
+        CLOTH_CASE( CLOTH_SPRINGS, springs, osg::UIntArray );
+        CLOTH_CASE( CLOTH_IDLE_LENGTHS, idleLengths, osg::FloatArray );
+        CLOTH_CASE( CLOTH_BATCHES, batchEnds, osg::UIntArray );
+
+#undef CLOTH_CASE
+
         default:
         {
             char err[ 1024 ];
@@ -716,7 +1368,85 @@ readBuffer( MeshesVector& meshes,
 #undef CASE
 }
 
-static const int HW_MODEL_FILE_VERSION = 0xCA3D0003;
+static const int HW_MODEL_FILE_VERSION = 0xCA3D0007;
+
+static
+void
+readString( std::string&       s,
+            FILE*              f,
+            const std::string& fn )
+{
+    int size;
+    READ_I32( size );
+    if ( size < 0 || size > 4096 )
+    {
+        throw std::runtime_error( "Too long string (incorrect meshes.cache file?)." );
+    }
+    char buf[ 4096 ];
+    if ( size > 0 ) // fread of zero size returns 0
+    {
+        READ_( s, buf, size );
+    }
+    s = std::string( &buf[0], &buf[ size ] );
+}
+
+static
+void
+writeString( const std::string& s,
+             FILE*              f,
+             const std::string& fn )
+{
+    WRITE_I32( s.size() );
+    if ( !s.empty() ) // fwrite of zero size returns 0
+    {
+        WRITE_( s, s.data(), s.size() );
+    }
+}
+
+/**
+ * Material is saved already parsed, so cached load doesn't need
+ * core materials (.xrf files) at all.
+ */
+static
+Material*
+readMaterial( FILE*              f,
+              const std::string& fn )
+{
+    osg::ref_ptr< Material > m = new Material;
+
+    assert( sizeof ( m->ambientColor ) == 4 * 4 ); // must be 4 floats
+    READ_STRUCT( m->ambientColor );
+    READ_STRUCT( m->diffuseColor );
+    READ_STRUCT( m->specularColor );
+    READ_STRUCT( m->glossiness );
+    READ_I32( m->sides );
+    readString( m->diffuseMap, f, fn );
+    readString( m->normalsMap, f, fn );
+    readString( m->bumpMap, f, fn );
+    READ_STRUCT( m->normalsMapAmount );
+    READ_STRUCT( m->bumpMapAmount );
+
+    return m.release();
+}
+
+static
+void
+writeMaterial( const Material*    m,
+               FILE*              f,
+               const std::string& fn )
+{
+    assert( sizeof ( m->ambientColor ) == 4 * 4 ); // must be 4 floats
+    WRITE_STRUCT( m->ambientColor );
+    WRITE_STRUCT( m->diffuseColor );
+    WRITE_STRUCT( m->specularColor );
+    WRITE_STRUCT( m->glossiness );
+    WRITE_I32( m->sides );
+    writeString( m->diffuseMap, f, fn );
+    writeString( m->normalsMap, f, fn );
+    writeString( m->bumpMap, f, fn );
+    WRITE_STRUCT( m->normalsMapAmount );
+    WRITE_STRUCT( m->bumpMapAmount );
+}
 
 void
 loadMeshes( const std::string&  fn,
@@ -744,6 +1474,17 @@ loadMeshes( const std::string&  fn,
         throw std::runtime_error( "Incorrect file version " + fn + ". Try rerun osgCalPreparer." );
     }
 
+    // -- Read materials --
+    int materialsCount = 0;
+
+    READ_I32( materialsCount );
+    std::vector< osg::ref_ptr< Material > > materials( materialsCount );
+
+    for ( int i = 0; i < materialsCount; i++ )
+    {
+        materials[i] = readMaterial( f, fn );
+    }
+
     // -- Read mesh descriptions --
     int meshesCount = 0;
 
@@ -766,12 +1507,33 @@ loadMeshes( const std::string&  fn,
         READ_( m->name, name, nameBufSize );
         m->name = std::string( &name[0], &name[ nameBufSize ] );
 
-        // -- Read material --
-        int coreMaterialThreadId;
-        READ_I32( coreMaterialThreadId );
+        // -- Read merged meshes names --
+        int mergedNamesCount;
+        READ_I32( mergedNamesCount );
+        if ( mergedNamesCount < 0 || mergedNamesCount > 1024 )
+        {
+            throw std::runtime_error( "Incorrect merged meshes count in " + fn );
+        }
+        m->mergedNames.resize( mergedNamesCount );
+        for ( int n = 0; n < mergedNamesCount; n++ )
+        {
+            READ_I32( nameBufSize );
+            if ( nameBufSize > 1024 )
+            {
+                throw std::runtime_error( "Too long mesh name (incorrect meshes.cache file?)." );
+            }
+            READ_( m->mergedNames, name, nameBufSize );
+            m->mergedNames[n] = std::string( &name[0], &name[ nameBufSize ] );
+        }
 
-        m->coreMaterial = const_cast< CalCoreModel* >( calCoreModel )->
-            getCoreMaterial( coreMaterialThreadId );
+        // -- Read material --
+        int materialIndex;
+        READ_I32( materialIndex );
+        if ( materialIndex < 0 || materialIndex >= materialsCount )
+        {
+            throw std::runtime_error( "Incorrect material index in " + fn );
+        }
+        m->material = materials[ materialIndex ];
 
         // -- Read bone parameters --
         READ_I32( m->rigid );
@@ -790,6 +1552,11 @@ loadMeshes( const std::string&  fn,
         // -- Read boundingBox --
         assert( sizeof ( m->boundingBox ) == 6 * 4 ); // must be 6 floats
         READ_STRUCT( m->boundingBox );
+
+        // -- Read morph targets count --
+        int morphTargetsCount = 0;
+        READ_I32( morphTargetsCount );
+        m->morphTargets.resize( morphTargetsCount );
     }
 
     // -- Read meshes buffers --
@@ -800,21 +1567,6 @@ loadMeshes( const std::string&  fn,
 }
 
 
-int
-getCoreMaterialThreadId( CalCoreModel* model,
-                         const CalCoreMaterial* material )
-{
-    for ( int i = 0; i < model->getCoreMaterialCount(); i++ )
-    {
-        if ( model->getCoreMaterial( i ) == material )
-        {
-            return i;
-        }
-    }
-    return (-1);
-}
-
-
 void saveMeshes( const CalCoreModel* calCoreModel,
                  const MeshesVector& meshes,
                  const std::string&  fn )
@@ -832,6 +1584,33 @@ void saveMeshes( const CalCoreModel* calCoreModel,
 
     WRITE_I32( HW_MODEL_FILE_VERSION );
 
+    // -- Write materials --
+    std::map< const Material*, int > materialIndices;
+    std::vector< const Material* >   materials;
+
+    for ( size_t i = 0; i < meshes.size(); i++ )
+    {
+        const Material* material = meshes[i]->material.get();
+
+        if ( material == 0 )
+        {
+            throw std::runtime_error( "Mesh " + meshes[i]->name + " has no material" );
+        }
+
+        if ( materialIndices.insert( std::make_pair( material,
+                                                     (int)materials.size() ) ).second )
+        {
+            materials.push_back( material );
+        }
+    }
+
+    WRITE_I32( materials.size() );
+
+    for ( size_t i = 0; i < materials.size(); i++ )
+    {
+        writeMaterial( materials[i], f, fn );
+    }
+
     // -- Write meshes --
     WRITE_I32( meshes.size() );
 
@@ -844,15 +1623,16 @@ void saveMeshes( const CalCoreModel* calCoreModel,
         WRITE_I32( name.size() );
         WRITE_( m->name, name.data(), name.size() );
 
-        // -- Write material --
-        int coreMaterialThreadId = getCoreMaterialThreadId(
-            const_cast< CalCoreModel* >( calCoreModel ), m->coreMaterial );
-        if ( coreMaterialThreadId < 0 )
+        // -- Write merged meshes names --
+        WRITE_I32( m->mergedNames.size() );
+        for ( size_t n = 0; n < m->mergedNames.size(); n++ )
         {
-            fclose( f );
-            throw std::runtime_error( "Can't get coreMaterialThreadId (mesh.pCoreMaterial not found in coreModel?" );            
+            WRITE_I32( m->mergedNames[n].size() );
+            WRITE_( m->mergedNames, m->mergedNames[n].data(), m->mergedNames[n].size() );
         }
-        WRITE_I32( coreMaterialThreadId );
+
+        // -- Write material --
+        WRITE_I32( materialIndices[ m->material.get() ] );
 
         // -- Read bone parameters --
         WRITE_I32( m->rigid );
@@ -869,6 +1649,9 @@ void saveMeshes( const CalCoreModel* calCoreModel,
         // -- Write boundingBox --
         assert( sizeof ( m->boundingBox ) == 6 * 4 ); // must be 6 floats
         WRITE_STRUCT( m->boundingBox );
+
+        // -- Write morph targets count --
+        WRITE_I32( m->morphTargets.size() );
     }
 
 #define WRITE_BUFFER( _bufferType, _buffer )    \
@@ -910,6 +1693,25 @@ void saveMeshes( const CalCoreModel* calCoreModel,
         WRITE_BUFFER( BT_VERTEX, vertexBuffer );
         WRITE_BUFFER( BT_WEIGHT, weightBuffer );
         WRITE_BUFFER( BT_MATRIX_INDEX, matrixIndexBuffer );
+
+        for ( size_t t = 0; t < m->morphTargets.size(); t++ )
+        {
+            if ( m->morphTargets[t].valid() )
+            {
+                WRITE_BUFFER( BT_MORPH_INDICES + t, morphTargets[t]->vertexIndices );
+                WRITE_BUFFER( BT_MORPH_POSITION + t, morphTargets[t]->positionDeltas );
+                WRITE_BUFFER( BT_MORPH_NORMAL + t, morphTargets[t]->normalDeltas );
+            }
+        }
+
+        if ( m->cloth.valid() )
+        {
+            WRITE_BUFFER( BT_CLOTH_PARTICLES, cloth->particleVertices );
+            WRITE_BUFFER( BT_CLOTH_WEIGHTS, cloth->particleWeights );
+            WRITE_BUFFER( BT_CLOTH_SPRINGS, cloth->springs );
+            WRITE_BUFFER( BT_CLOTH_IDLE_LENGTHS, cloth->idleLengths );
+            WRITE_BUFFER( BT_CLOTH_BATCHES, cloth->batchEnds );
+        }
     }
 
     // -- Write mesh buffers that will be freed after display list created --
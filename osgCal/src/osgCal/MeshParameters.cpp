@@ -25,6 +25,8 @@ MeshParameters::MeshParameters()
     , fogMode( (osg::Fog::Mode)0 )
     , useDepthFirstMesh( false )
     , noSoftwareVertexUpdate( false )
+    , dualQuaternionSkinning( false )
+    , transformFeedbackSkinning( false )
 {
 }
 
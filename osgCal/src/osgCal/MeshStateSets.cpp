@@ -33,8 +33,18 @@ MeshStateSets::MeshStateSets( StateSetCache*  c,
     }
     else
     {
+        bool transformFeedback = p->transformFeedbackSkinning && d->rigid == false;
+        // ^ vertices are skinned before drawing, so all passes use
+        // zero bones state sets
+
         staticStateSet = c->hwMeshStateSetCache->get( ncm, 0, ncp );
-        if ( d->rigid == false )
+        if ( transformFeedback )
+        {
+            stateSet = staticStateSet;
+            skinningProgram = c->getSkinningProgram( d->maxBonesInfluence,
+                                                     p->dualQuaternionSkinning );
+        }
+        else if ( d->rigid == false )
         {
             stateSet = c->hwMeshStateSetCache->get( ncm, d->maxBonesInfluence, ncp );
         }
@@ -43,9 +53,14 @@ MeshStateSets::MeshStateSets( StateSetCache*  c,
         {
             staticDepthOnly = c->depthMeshStateSetCache->get( ncm, 0 );
 
-            if ( d->rigid == false )
+            if ( transformFeedback )
+            {
+                depthOnly = staticDepthOnly;
+            }
+            else if ( d->rigid == false )
             {
-                depthOnly = c->depthMeshStateSetCache->get( ncm, d->maxBonesInfluence );
+                depthOnly = c->depthMeshStateSetCache->get( ncm, d->maxBonesInfluence,
+                                                            p->dualQuaternionSkinning );
             }
         }
     }
@@ -66,4 +81,9 @@ MeshStateSets::releaseGLObjects( osg::State* state ) const
     release( staticStateSet, state );
     release( depthOnly, state );
     release( staticDepthOnly, state );
+
+    if ( skinningProgram.valid() )
+    {
+        skinningProgram->releaseGLObjects( state );
+    }
 }
@@ -0,0 +1,918 @@
+/* -*- c++ -*-
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <math.h>
+#include <algorithm>
+
+#include <cal3d/coretrack.h>
+#include <cal3d/corekeyframe.h>
+#include <cal3d/animcallback.h>
+
+#include <osgCal/Mixer>
+
+using namespace osgCal;
+
+Mixer::Mixer( CalModel* m )
+    : model( m )
+    , cycleIndices( m->getCoreModel()->getCoreAnimationCount(), -1 )
+    , animationTime( 0 )
+    , animationDuration( 0 )
+    , allBonesDirty( true )
+    , firedCallbacks( 0 )
+{
+    // usually there are few simultaneous animations, arrays grow
+    // when more are needed and never shrink
+    cycles.reserve( 4 );
+    actions.reserve( 4 );
+}
+
+Mixer::~Mixer()
+{
+}
+
+size_t
+Mixer::getInstanceSize()
+{
+    return sizeof ( Instance );
+}
+
+size_t
+Mixer::getCallbacksSize() const
+{
+    size_t bytes = callbackTimesPool.capacity() * sizeof ( std::vector< float > )
+        + freeCallbackTimes.capacity() * sizeof ( int )
+        + pendingCallbacks.capacity() * sizeof ( PendingCallback );
+
+    for ( size_t i = 0; i < callbackTimesPool.size(); i++ )
+    {
+        bytes += callbackTimesPool[i].capacity() * sizeof ( float );
+    }
+
+    return bytes;
+}
+
+Mixer::Instance&
+Mixer::addInstance( std::vector< Instance >& instances,
+                    int                      id,
+                    State                    state )
+{
+    instances.push_back( Instance() );
+
+    Instance& i = instances.back();
+
+    i.coreAnimation = model->getCoreModel()->getCoreAnimation( id );
+    i.id = id;
+    i.state = state;
+    i.time = 0;
+    i.timeFactor = 1;
+    i.weight = 0;
+    i.targetWeight = 0;
+    i.targetDelay = 0;
+    i.mapped = false;
+    i.closed = false;
+    i.delayIn = 0;
+    i.delayOut = 0;
+    i.weightTarget = 0;
+    i.autoLock = false;
+    i.callbackTimes = -1;
+
+    return i;
+}
+
+void
+Mixer::releaseInstance( Instance& i )
+{
+    if ( i.callbackTimes >= 0 )
+    {
+        freeCallbackTimes.push_back( i.callbackTimes );
+        i.callbackTimes = -1;
+    }
+}
+
+bool
+Mixer::closeCycle( CalCoreAnimation* a )
+{
+    std::list< CalCoreTrack* >& tracks = a->getListCoreTrack();
+
+    if ( tracks.empty() || tracks.front()->getCoreKeyframeCount() == 0 )
+    {
+        return false; // not loaded yet (streamed animation)
+    }
+
+    CalCoreTrack* front = tracks.front();
+
+    if ( front->getCoreKeyframe( front->getCoreKeyframeCount() - 1 )->getTime()
+         >= a->getDuration() )
+    {
+        return true; // already closed
+    }
+
+    for ( std::list< CalCoreTrack* >::iterator
+              t = tracks.begin(),
+              tEnd = tracks.end();
+          t != tEnd; ++t )
+    {
+        CalCoreKeyframe* first = (*t)->getCoreKeyframe( 0 );
+        CalCoreKeyframe* k = new CalCoreKeyframe();
+
+        k->setTranslation( first->getTranslation() );
+        k->setRotation( first->getRotation() );
+        k->setTime( a->getDuration() );
+
+        (*t)->addCoreKeyframe( k );
+    }
+
+    return true;
+}
+
+bool
+Mixer::blendCycle( int   id,
+                   float weight,
+                   float delay,
+                   float timeFactor )
+{
+    if ( id < 0 || id >= (int)cycleIndices.size() )
+    {
+        CalError::setLastError( CalError::INVALID_HANDLE, __FILE__, __LINE__ );
+        return false;
+    }
+
+    Instance* c;
+
+    if ( cycleIndices[ id ] < 0 )
+    {
+        if ( weight == 0.0f )
+        {
+            return true;
+        }
+
+        if ( model->getCoreModel()->getCoreAnimation( id ) == 0 )
+        {
+            return false;
+        }
+
+        c = &addInstance( cycles, id, STATE_SYNC );
+        c->closed = closeCycle( c->coreAnimation );
+        c->mapped = true;
+        cycleIndices[ id ] = cycles.size() - 1;
+    }
+    else
+    {
+        c = &cycles[ cycleIndices[ id ] ];
+
+        if ( weight == 0.0f )
+        {
+            c->mapped = false;
+            cycleIndices[ id ] = -1;
+        }
+
+        checkCallbacks( *c, 0 );
+    }
+
+    c->targetWeight = weight;
+    c->targetDelay = delay;
+    c->timeFactor = timeFactor;
+
+    fireCallbacks();
+
+    return true;
+}
+
+bool
+Mixer::clearCycle( int   id,
+                   float delay )
+{
+    if ( id < 0 || id >= (int)cycleIndices.size() )
+    {
+        CalError::setLastError( CalError::INVALID_HANDLE, __FILE__, __LINE__ );
+        return false;
+    }
+
+    if ( cycleIndices[ id ] < 0 )
+    {
+        return true;
+    }
+
+    Instance& c = cycles[ cycleIndices[ id ] ];
+
+    c.mapped = false;
+    cycleIndices[ id ] = -1;
+
+    // -- Continue with the current speed out of sync --
+    if ( c.state != STATE_ASYNC )
+    {
+        if ( animationDuration == 0.0f )
+        {
+            c.timeFactor = 1.0f;
+            c.time = 0.0f;
+        }
+        else
+        {
+            c.timeFactor = c.coreAnimation->getDuration() / animationDuration;
+            c.time = animationTime * c.timeFactor;
+        }
+
+        c.state = STATE_ASYNC;
+    }
+
+    c.targetWeight = 0.0f;
+    c.targetDelay = delay;
+
+    checkCallbacks( c, 0 );
+    fireCallbacks();
+
+    return true;
+}
+
+bool
+Mixer::executeAction( int   id,
+                      float delayIn,
+                      float delayOut,
+                      float weightTarget,
+                      bool  autoLock,
+                      float timeFactor )
+{
+    if ( id < 0 || id >= (int)cycleIndices.size()
+         || model->getCoreModel()->getCoreAnimation( id ) == 0 )
+    {
+        return false;
+    }
+
+    Instance& a = addInstance( actions, id, STATE_IN );
+
+    a.delayIn = delayIn;
+    a.delayOut = delayOut;
+    a.weightTarget = weightTarget;
+    a.autoLock = autoLock;
+    a.timeFactor = timeFactor;
+
+    checkCallbacks( a, 0 );
+    fireCallbacks();
+
+    return true;
+}
+
+bool
+Mixer::removeAction( int id )
+{
+    // the newest one, as in CalMixer
+    for ( int i = actions.size() - 1; i >= 0; i-- )
+    {
+        if ( actions[i].id == id )
+        {
+            completeCallbacks( actions[i] );
+            releaseInstance( actions[i] );
+            actions.erase( actions.begin() + i ); // keeps capacity
+            fireCallbacks();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+Mixer::clear()
+{
+    cycles.clear();
+    actions.clear();
+    std::fill( cycleIndices.begin(), cycleIndices.end(), -1 );
+
+    freeCallbackTimes.clear();
+    for ( size_t i = 0; i < callbackTimesPool.size(); i++ )
+    {
+        freeCallbackTimes.push_back( i );
+    }
+    animationTime = 0;
+    animationDuration = 0;
+}
+
+bool
+Mixer::isPlaying( int id ) const
+{
+    for ( size_t i = 0; i < cycles.size(); i++ )
+    {
+        if ( cycles[i].id == id )
+        {
+            return true;
+        }
+    }
+
+    for ( size_t i = 0; i < actions.size(); i++ )
+    {
+        if ( actions[i].id == id )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool
+Mixer::updateCycle( Instance& c,
+                    float     deltaTime )
+{
+    // same as CalAnimationCycle::update
+    if ( c.targetDelay <= fabsf( deltaTime ) )
+    {
+        c.weight = c.targetWeight;
+        c.targetDelay = 0.0f;
+
+        if ( c.weight == 0.0f )
+        {
+            return false;
+        }
+    }
+    else
+    {
+        float factor = deltaTime / c.targetDelay;
+        c.weight = ( 1.0f - factor ) * c.weight + factor * c.targetWeight;
+        c.targetDelay -= deltaTime;
+    }
+
+    if ( c.state == STATE_ASYNC )
+    {
+        const float duration = c.coreAnimation->getDuration();
+
+        c.time += deltaTime * c.timeFactor;
+
+        if ( c.time >= duration )
+        {
+            c.time = fmodf( c.time, duration );
+        }
+
+        if ( c.time < 0 )
+        {
+            c.time += duration;
+        }
+    }
+
+    return true;
+}
+
+bool
+Mixer::updateAction( Instance& a,
+                     float     deltaTime )
+{
+    // same as CalAnimationAction::update
+    const float duration = a.coreAnimation->getDuration();
+
+    if ( a.state != STATE_STOPPED )
+    {
+        a.time += deltaTime * a.timeFactor;
+    }
+
+    if ( a.state == STATE_IN )
+    {
+        if ( a.time < a.delayIn )
+        {
+            a.weight = a.time / a.delayIn * a.weightTarget;
+        }
+        else
+        {
+            a.state = STATE_STEADY;
+            a.weight = a.weightTarget;
+        }
+    }
+
+    if ( a.state == STATE_STEADY )
+    {
+        if ( !a.autoLock && a.time >= duration - a.delayOut )
+        {
+            a.state = STATE_OUT;
+        }
+        else if ( a.autoLock && a.time > duration )
+        {
+            a.state = STATE_STOPPED;
+            a.time = duration;
+        }
+    }
+
+    if ( a.state == STATE_OUT )
+    {
+        if ( a.time < duration )
+        {
+            a.weight = ( duration - a.time ) / a.delayOut * a.weightTarget;
+        }
+        else
+        {
+            a.weight = 0.0f;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void
+Mixer::updateAnimation( float deltaTime )
+{
+    // -- Synchronized cycles time --
+    if ( animationDuration == 0.0f )
+    {
+        animationTime = 0.0f;
+    }
+    else
+    {
+        animationTime += deltaTime;
+
+        if ( animationTime >= animationDuration )
+        {
+            animationTime = fmodf( animationTime, animationDuration );
+        }
+
+        if ( animationTime < 0 )
+        {
+            animationTime += animationDuration;
+        }
+    }
+
+    // -- Actions (finished are removed by compacting array) --
+    size_t n = 0;
+
+    for ( size_t i = 0; i < actions.size(); i++ )
+    {
+        Instance& a = actions[i];
+
+        if ( updateAction( a, deltaTime ) )
+        {
+            checkCallbacks( a, animationTime );
+
+            if ( n != i )
+            {
+                actions[n] = a;
+            }
+            n++;
+        }
+        else
+        {
+            completeCallbacks( a );
+            releaseInstance( a );
+        }
+    }
+
+    actions.erase( actions.begin() + n, actions.end() );
+
+    // -- Cycles --
+    float accumulatedWeight = 0.0f;
+    float accumulatedDuration = 0.0f;
+
+    n = 0;
+
+    for ( size_t i = 0; i < cycles.size(); i++ )
+    {
+        Instance& c = cycles[i];
+
+        if ( updateCycle( c, deltaTime ) )
+        {
+            if ( c.state == STATE_SYNC )
+            {
+                accumulatedWeight += c.weight;
+                accumulatedDuration += c.weight * c.coreAnimation->getDuration();
+            }
+
+            checkCallbacks( c, animationTime );
+
+            if ( n != i )
+            {
+                cycles[n] = c;
+
+                if ( cycles[n].mapped )
+                {
+                    cycleIndices[ cycles[n].id ] = n;
+                }
+            }
+            n++;
+        }
+        else
+        {
+            completeCallbacks( c );
+            releaseInstance( c );
+        }
+    }
+
+    cycles.erase( cycles.begin() + n, cycles.end() );
+
+    animationDuration =
+        accumulatedWeight > 0.0f ? accumulatedDuration / accumulatedWeight : 0.0f;
+
+    // instances arrays are consistent now, callbacks can change them
+    fireCallbacks();
+}
+
+void
+Mixer::sampleTracks( const Instance& i,
+                     float           time )
+{
+    if ( poseCache.valid() )
+    {
+        time = poseCache->quantize( time );
+
+        if ( poseCache->find( i.coreAnimation, time, sample ) )
+        {
+            return;
+        }
+    }
+
+    std::fill( sample.weight.begin(), sample.weight.end(), 0.0f );
+
+    std::list< CalCoreTrack* >& tracks = i.coreAnimation->getListCoreTrack();
+
+    for ( std::list< CalCoreTrack* >::iterator
+              t = tracks.begin(),
+              tEnd = tracks.end();
+          t != tEnd; ++t )
+    {
+        CalVector     translation;
+        CalQuaternion rotation;
+
+        (*t)->getState( time, translation, rotation );
+
+        int b = (*t)->getCoreBoneId();
+
+        sample.tx[b] = translation.x;
+        sample.ty[b] = translation.y;
+        sample.tz[b] = translation.z;
+        sample.qx[b] = rotation.x;
+        sample.qy[b] = rotation.y;
+        sample.qz[b] = rotation.z;
+        sample.qw[b] = rotation.w;
+        sample.weight[b] = 1.0f;
+    }
+
+    if ( poseCache.valid() )
+    {
+        poseCache->store( i.coreAnimation, time, sample );
+    }
+}
+
+void
+Mixer::accumulateSample( float weight )
+{
+    const int n = sample.weight.size();
+
+    const float* stx = &sample.tx[0];
+    const float* sty = &sample.ty[0];
+    const float* stz = &sample.tz[0];
+    const float* sqx = &sample.qx[0];
+    const float* sqy = &sample.qy[0];
+    const float* sqz = &sample.qz[0];
+    const float* sqw = &sample.qw[0];
+    const float* sw  = &sample.weight[0];
+
+    float* ltx = &layer.tx[0];
+    float* lty = &layer.ty[0];
+    float* ltz = &layer.tz[0];
+    float* lqx = &layer.qx[0];
+    float* lqy = &layer.qy[0];
+    float* lqz = &layer.qz[0];
+    float* lqw = &layer.qw[0];
+    float* lw  = &layer.weight[0];
+
+    const float* pqx = &pose.qx[0];
+    const float* pqy = &pose.qy[0];
+    const float* pqz = &pose.qz[0];
+    const float* pqw = &pose.qw[0];
+
+    for ( int b = 0; b < n; b++ )
+    {
+        float w = sw[b] * weight;
+
+        // q and -q are the same rotation, take the one closer to
+        // already accumulated rotations (as CalQuaternion::blend)
+        float d =
+            sqx[b] * ( lqx[b] + pqx[b] ) + sqy[b] * ( lqy[b] + pqy[b] )
+            + sqz[b] * ( lqz[b] + pqz[b] ) + sqw[b] * ( lqw[b] + pqw[b] );
+        float wq = d < 0.0f ? -w : w;
+
+        ltx[b] += w * stx[b];
+        lty[b] += w * sty[b];
+        ltz[b] += w * stz[b];
+        lqx[b] += wq * sqx[b];
+        lqy[b] += wq * sqy[b];
+        lqz[b] += wq * sqz[b];
+        lqw[b] += wq * sqw[b];
+        lw[b] += w;
+    }
+}
+
+void
+Mixer::lockLayer()
+{
+    const int n = layer.weight.size();
+
+    const float* ltx = &layer.tx[0];
+    const float* lty = &layer.ty[0];
+    const float* ltz = &layer.tz[0];
+    const float* lqx = &layer.qx[0];
+    const float* lqy = &layer.qy[0];
+    const float* lqz = &layer.qz[0];
+    const float* lqw = &layer.qw[0];
+    const float* lw  = &layer.weight[0];
+
+    float* ptx = &pose.tx[0];
+    float* pty = &pose.ty[0];
+    float* ptz = &pose.tz[0];
+    float* pqx = &pose.qx[0];
+    float* pqy = &pose.qy[0];
+    float* pqz = &pose.qz[0];
+    float* pqw = &pose.qw[0];
+    float* pw  = &pose.weight[0];
+
+    for ( int b = 0; b < n; b++ )
+    {
+        float limit = std::max( 1.0f - pw[b], 0.0f );
+        float f = lw[b] > limit ? limit / lw[b] : 1.0f;
+
+        ptx[b] += f * ltx[b];
+        pty[b] += f * lty[b];
+        ptz[b] += f * ltz[b];
+        pqx[b] += f * lqx[b];
+        pqy[b] += f * lqy[b];
+        pqz[b] += f * lqz[b];
+        pqw[b] += f * lqw[b];
+        pw[b] += f * lw[b];
+    }
+
+    layer.clear();
+}
+
+void
+Mixer::updateSkeleton()
+{
+    CalSkeleton* skeleton = model->getSkeleton();
+
+    if ( skeleton == 0 )
+    {
+        return;
+    }
+
+    std::vector< CalBone* >& bones = skeleton->getVectorBone();
+    const int bonesCount = bones.size();
+
+    if ( bonesCount == 0 )
+    {
+        return;
+    }
+
+    if ( (int)pose.weight.size() != bonesCount )
+    {
+        sample.resize( bonesCount );
+        layer.resize( bonesCount );
+        pose.resize( bonesCount );
+
+        // -- Bones hierarchy --
+        CalCoreSkeleton* coreSkeleton = skeleton->getCoreSkeleton();
+
+        boneParents.resize( bonesCount );
+        bonesOrder = coreSkeleton->getVectorRootCoreBoneId();
+
+        for ( size_t i = 0; i < bonesOrder.size(); i++ )
+        {
+            std::list< int >& children =
+                coreSkeleton->getCoreBone( bonesOrder[i] )->getListChildId();
+
+            bonesOrder.insert( bonesOrder.end(), children.begin(), children.end() );
+        }
+
+        for ( int b = 0; b < bonesCount; b++ )
+        {
+            boneParents[b] = coreSkeleton->getCoreBone( b )->getParentId();
+        }
+
+        animatedBones.assign( bonesCount, 0 );
+        dirtyBones.assign( bonesCount, 1 );
+        dirtyRoots.reserve( bonesCount );
+        allBonesDirty = true;
+    }
+    else
+    {
+        pose.clear();
+    }
+
+    // CalMixer blends the newest animations first (they are in the
+    // lists front), so we go backwards to get the same result
+
+    // -- Actions --
+    for ( int i = actions.size() - 1; i >= 0; i-- )
+    {
+        if ( actions[i].weight > 0.0f )
+        {
+            sampleTracks( actions[i], actions[i].time );
+            accumulateSample( actions[i].weight );
+        }
+    }
+
+    lockLayer();
+
+    // -- Cycles --
+    for ( int i = cycles.size() - 1; i >= 0; i-- )
+    {
+        Instance& c = cycles[i];
+
+        if ( !c.closed )
+        {
+            // streamed animation loaded after blendCycle
+            c.closed = closeCycle( c.coreAnimation );
+        }
+
+        float time = c.time;
+
+        if ( c.state == STATE_SYNC )
+        {
+            time = animationDuration == 0.0f ? 0.0f
+                : animationTime * c.coreAnimation->getDuration() / animationDuration;
+        }
+
+        if ( c.weight > 0.0f )
+        {
+            sampleTracks( c, time );
+            accumulateSample( c.weight );
+        }
+    }
+
+    lockLayer();
+
+    updateDirtyBones();
+
+    // -- Pose to bones --
+    skeleton->clearState();
+
+    for ( int b = 0; b < bonesCount; b++ )
+    {
+        float w = pose.weight[b];
+        float l = sqrtf( pose.qx[b] * pose.qx[b] + pose.qy[b] * pose.qy[b]
+                         + pose.qz[b] * pose.qz[b] + pose.qw[b] * pose.qw[b] );
+
+        if ( w <= 0.0f || l == 0.0f )
+        {
+            continue; // calculateState uses core bone state
+        }
+
+        bones[b]->blendState( w,
+                              CalVector( pose.tx[b] / w,
+                                         pose.ty[b] / w,
+                                         pose.tz[b] / w ),
+                              CalQuaternion( pose.qx[b] / l,
+                                             pose.qy[b] / l,
+                                             pose.qz[b] / l,
+                                             pose.qw[b] / l ) );
+    }
+
+    skeleton->lockState();
+
+    if ( allBonesDirty )
+    {
+        skeleton->calculateState();
+        allBonesDirty = false;
+    }
+    else
+    {
+        // clean bones keep state of the previous update
+        for ( std::vector< int >::const_iterator
+                  r = dirtyRoots.begin(),
+                  rEnd = dirtyRoots.end();
+              r != rEnd; ++r )
+        {
+            bones[ *r ]->calculateState();
+        }
+    }
+}
+
+void
+Mixer::updateDirtyBones()
+{
+    dirtyRoots.clear();
+
+    for ( std::vector< int >::const_iterator
+              o = bonesOrder.begin(),
+              oEnd = bonesOrder.end();
+          o != oEnd; ++o )
+    {
+        int  b = *o;
+        int  parent = boneParents[b];
+        char animated = pose.weight[b] > 0.0f;
+
+        // bone returns to core state when animation stops, so it
+        // is dirty on one more update
+        dirtyBones[b] = animated | animatedBones[b];
+        animatedBones[b] = animated;
+
+        if ( parent >= 0 && dirtyBones[ parent ] )
+        {
+            dirtyBones[b] = 1;
+        }
+        else if ( dirtyBones[b] )
+        {
+            dirtyRoots.push_back( b );
+        }
+    }
+}
+
+void
+Mixer::checkCallbacks( Instance& i,
+                       float     time )
+{
+    // same as CalAnimation::checkCallbacks
+    std::vector< CalCoreAnimation::CallbackRecord >& list =
+        i.coreAnimation->getCallbackList();
+
+    if ( list.empty() )
+    {
+        return;
+    }
+
+    if ( i.callbackTimes < 0 )
+    {
+        if ( freeCallbackTimes.empty() )
+        {
+            i.callbackTimes = callbackTimesPool.size();
+            callbackTimesPool.push_back( std::vector< float >() );
+        }
+        else
+        {
+            i.callbackTimes = freeCallbackTimes.back();
+            freeCallbackTimes.pop_back();
+            callbackTimesPool[ i.callbackTimes ].clear();
+        }
+    }
+
+    std::vector< float >& times = callbackTimesPool[ i.callbackTimes ];
+
+    if ( times.size() < list.size() )
+    {
+        times.resize( list.size(), 0.0f );
+    }
+
+    for ( size_t c = 0; c < list.size(); c++ )
+    {
+        float& last = times[ c ];
+
+        if ( time > 0 && time < last ) // looped
+        {
+            last -= i.coreAnimation->getDuration();
+        }
+        else if ( time < 0 && time > last ) // reverse looped
+        {
+            last += i.coreAnimation->getDuration();
+        }
+
+        if ( ( time >= 0 && time >= last + list[c].min_interval )
+             || ( time < 0 && time <= last - list[c].min_interval ) )
+        {
+            PendingCallback p = { list[c].callback, time, false };
+            pendingCallbacks.push_back( p );
+            last = time;
+        }
+    }
+}
+
+void
+Mixer::completeCallbacks( Instance& i )
+{
+    std::vector< CalCoreAnimation::CallbackRecord >& list =
+        i.coreAnimation->getCallbackList();
+
+    for ( size_t c = 0; c < list.size(); c++ )
+    {
+        PendingCallback p = { list[c].callback, 0.0f, true };
+        pendingCallbacks.push_back( p );
+    }
+}
+
+void
+Mixer::fireCallbacks()
+{
+    // callbacks can add pending callbacks and fire them recursively
+    // (by executeAction etc.), so array is indexed on each step and
+    // the shared counter makes each callback called once
+    while ( firedCallbacks < pendingCallbacks.size() )
+    {
+        PendingCallback p = pendingCallbacks[ firedCallbacks++ ];
+
+        if ( p.complete )
+        {
+            p.callback->AnimationComplete( model );
+        }
+        else
+        {
+            p.callback->AnimationUpdate( p.time, model );
+        }
+    }
+
+    pendingCallbacks.clear(); // keeps capacity
+    firedCallbacks = 0;
+}
@@ -30,6 +30,7 @@
 #include <osgCal/Model>
 #include <osgCal/HardwareMesh>
 #include <osgCal/SoftwareMesh>
+#include <osgCal/Profiler>
 
 using namespace osgCal;
 
@@ -177,9 +178,62 @@ Model::load( CoreModel*      _coreModel,
 }
 
 
+template < typename T >
+void
+removeElement( std::vector< T* >& v,
+               T*                 e )
+{
+    typename std::vector< T* >::iterator i =
+        std::find( v.begin(), v.end(), e );
+
+    if ( i == v.end() )
+    {
+        throw std::runtime_error( "osgCal. removeElement: element not found" );
+    }
+    else
+    {
+        v.erase( i );
+    }
+}
+
+/**
+ * Remember mesh under its name and names of meshes merged into it
+ * (see MeshData::mergedNames).
+ */
+static void
+rememberMesh( Model::MeshMap& meshes,
+              const MeshData* data,
+              Mesh*           mesh )
+{
+    meshes[ data->name ].push_back( mesh );
+
+    for ( size_t i = 0; i < data->mergedNames.size(); i++ )
+    {
+        meshes[ data->mergedNames[i] ].push_back( mesh );
+    }
+}
+
+static void
+forgetMesh( Model::MeshMap& meshes,
+            const MeshData* data,
+            Mesh*           mesh )
+{
+    removeElement( meshes[ data->name ], mesh );
+
+    for ( size_t i = 0; i < data->mergedNames.size(); i++ )
+    {
+        removeElement( meshes[ data->mergedNames[i] ], mesh );
+    }
+}
+
 Mesh*
 Model::addMesh( const CoreMesh* mesh )
 {
+    if ( mesh->batch.valid() )
+    {
+        return addBatchedMesh( mesh );
+    }
+
     Mesh* g = 0;
 
     // -- Create mesh drawable --
@@ -193,7 +247,7 @@ Model::addMesh( const CoreMesh* mesh )
     }
 
     // -- Remember drawable --
-    meshes[ mesh->data->name ].push_back( g );
+    rememberMesh( meshes, mesh->data.get(), g );
 
     // -- Remember Updatable (and update) --
     if ( mesh->data->rigid == false )
@@ -211,29 +265,17 @@ Model::addMesh( const CoreMesh* mesh )
     return g;
 }
 
-template < typename T >
 void
-removeElement( std::vector< T* >& v,
-               T*                 e )
+Model::removeMesh( Mesh* mesh )
 {
-    typename std::vector< T* >::iterator i =
-        std::find( v.begin(), v.end(), e );
-
-    if ( i == v.end() )
+    if ( mesh->getCoreMesh()->batch.valid() )
     {
-        throw std::runtime_error( "osgCal. removeElement: element not found" );
+        removeBatchedMesh( mesh );
+        return;
     }
-    else
-    {
-        v.erase( i );
-    }
-}
 
-void
-Model::removeMesh( Mesh* mesh )
-{
     // -- UnRemember drawable --
-    removeElement( meshes[ mesh->getCoreMesh()->data->name ], mesh );
+    forgetMesh( meshes, mesh->getCoreMesh()->data.get(), mesh );
 
     // -- Remember Updatable (and update) --
     if ( mesh->getCoreMesh()->data->rigid == false )
@@ -248,6 +290,70 @@ Model::removeMesh( Mesh* mesh )
     removeMeshDrawable( mesh->getCoreMesh(), mesh );
 }
 
+Mesh*
+Model::addBatchedMesh( const CoreMesh* mesh )
+{
+    Batch& b = batches[ mesh->batch.get() ];
+
+    // -- Add batch drawable with the first batched mesh --
+    if ( !b.drawable.valid() )
+    {
+        b.drawable = new HardwareMesh( modelData.get(), mesh->batch.get() );
+        nonUpdatableMeshes.push_back( b.drawable.get() );
+        addMeshDrawable( mesh->batch.get(), b.drawable.get() );
+    }
+
+    HardwareMesh* batch = static_cast< HardwareMesh* >( b.drawable.get() );
+    batch->setRangeVisible( mesh->batchRange, true );
+
+    Mesh* g = new BatchedMesh( modelData.get(), mesh, batch );
+    b.meshes.push_back( g );
+    rememberMesh( meshes, mesh->data.get(), g );
+
+    return g;
+}
+
+void
+Model::removeBatchedMesh( Mesh* mesh )
+{
+    const CoreMesh* coreMesh = mesh->getCoreMesh();
+
+    forgetMesh( meshes, coreMesh->data.get(), mesh );
+
+    BatchesMap::iterator b = batches.find( coreMesh->batch.get() );
+    HardwareMesh* batch = static_cast< HardwareMesh* >( b->second.drawable.get() );
+
+    batch->setRangeVisible( coreMesh->batchRange, false );
+
+    // -- Remove batch drawable with the last batched mesh --
+    if ( batch->getVisibleRangesCount() == 0 )
+    {
+        removeElement( nonUpdatableMeshes, (Mesh*)batch );
+        removeMeshDrawable( coreMesh->batch.get(), batch );
+
+        if ( batch->getDepthMesh() )
+        {
+            removeDepthMesh( batch->getDepthMesh() );
+        }
+
+        batches.erase( b ); // deletes handle
+        return;
+    }
+
+    // -- Forget handle (deletes it) --
+    for ( std::vector< osg::ref_ptr< Mesh > >::iterator
+              h = b->second.meshes.begin(),
+              hEnd = b->second.meshes.end();
+          h != hEnd; ++h )
+    {
+        if ( h->get() == mesh )
+        {
+            b->second.meshes.erase( h );
+            break;
+        }
+    }
+}
+
 void
 Model::addMeshDrawable( const CoreMesh* mesh,
                         osg::Drawable*  drawable )
@@ -411,6 +517,12 @@ Model::getCalModel()
     return modelData->getCalModel();
 }
 
+Mixer*
+Model::getMixer()
+{
+    return modelData->getMixer();
+}
+
 void
 Model::setAutoUpdate( bool enabled )
 {
@@ -420,6 +532,9 @@ Model::setAutoUpdate( bool enabled )
 void
 Model::update( double deltaTime ) 
 {
+    OSGCAL_PROFILE_SCOPE( MODEL_UPDATE );
+    OSGCAL_PROFILE_COUNT( MODELS_UPDATED, 1 );
+
     if ( modelData->update( deltaTime * timeFactor ) == true )
     {
         updateMeshes();
@@ -429,6 +544,9 @@ Model::update( double deltaTime )
 void
 Model::update() 
 {
+    OSGCAL_PROFILE_SCOPE( MODEL_UPDATE );
+    OSGCAL_PROFILE_COUNT( MODELS_UPDATED, 1 );
+
     if ( modelData->update() == true )
     {
         updateMeshes();
@@ -459,6 +577,8 @@ Model::updateMeshes()
             t->second.first->setMatrix( modelData->getBoneMatrix( t->first ) );
         }
     }
+
+    modelData->meshesUpdated();
 }
 
 void
@@ -467,24 +587,15 @@ Model::blendCycle( int id,
                    float delay,
                    float timeFactor )
 {
-    modelData->getCalMixer()->blendCycle( id, weight, delay );
-
-    if ( timeFactor != 1.0f )
-    {
-        std::vector<CalAnimation *>& av = modelData->getCalMixer()->getAnimationVector();
-
-        if ( av[id] != 0 )
-        {
-            av[id]->setTimeFactor( timeFactor );
-        }
-    }
+    modelData->requestAnimation( id );
+    modelData->getMixer()->blendCycle( id, weight, delay, timeFactor );
 }
 
 void
 Model::clearCycle( int id,
                    float delay )
 {
-    modelData->getCalMixer()->clearCycle( id, delay );
+    modelData->getMixer()->clearCycle( id, delay );
 }
 
 void
@@ -495,25 +606,15 @@ Model::executeAction( int id,
                       bool autoLock,
                       float timeFactor )
 {
-    modelData->getCalMixer()->executeAction( id, delayIn, delayOut, weightTarget, autoLock );
-
-    if ( timeFactor != 1.0f )
-    {
-        std::list<CalAnimationAction *>& aal =
-            modelData->getCalMixer()->getAnimationActionList();
-
-        if ( !aal.empty() )
-        {
-            aal.front()->setTimeFactor( timeFactor );
-            // last added action live in first element of list
-        }
-    }
+    modelData->requestAnimation( id );
+    modelData->getMixer()->executeAction( id, delayIn, delayOut, weightTarget,
+                                          autoLock, timeFactor );
 }
 
 void
 Model::removeAction( int id )
 {
-    modelData->getCalMixer()->removeAction( id );
+    modelData->getMixer()->removeAction( id );
     modelData->setUpdateForced();
 }
 
@@ -529,6 +630,79 @@ Model::getTimeFactor() const
     return timeFactor;
 }
 
+void
+Model::setMorphTargetWeight( int id,
+                             float weight )
+    throw (std::runtime_error)
+{
+    modelData->setMorphTargetWeight( id, weight );
+}
+
+float
+Model::getMorphTargetWeight( int id ) const
+{
+    return modelData->getMorphTargetWeight( id );
+}
+
+void
+Model::setClothGravity( const osg::Vec3f& gravity )
+{
+    modelData->setClothGravity( gravity );
+}
+
+const osg::Vec3f&
+Model::getClothGravity() const
+{
+    return modelData->getClothGravity();
+}
+
+void
+Model::setClothForce( const osg::Vec3f& force )
+{
+    modelData->setClothForce( force );
+}
+
+const osg::Vec3f&
+Model::getClothForce() const
+{
+    return modelData->getClothForce();
+}
+
+void
+Model::setClothCollision( bool enabled )
+{
+    modelData->setClothCollision( enabled );
+}
+
+bool
+Model::getClothCollision() const
+{
+    return modelData->getClothCollision();
+}
+
+void
+Model::reset()
+{
+    timeFactor = 1.0;
+    setAutoUpdate( true );
+
+    for ( std::vector< Mesh* >::iterator
+              m    = updatableMeshes.begin(),
+              mEnd = updatableMeshes.end();
+          m != mEnd; ++m )
+    {
+        if ( (*m)->clothSimulation.valid() )
+        {
+            (*m)->clothSimulation->reset();
+        }
+    }
+
+    if ( modelData->reset() == true )
+    {
+        updateMeshes();
+    }
+}
+
 const CoreModel*
 Model::getCoreModel() const
 {
@@ -588,6 +762,105 @@ Model::releaseGLObjects( osg::State* state ) const
     osg::Group::releaseGLObjects( state ); // for user nodes
 }
 
+bool
+Model::intersect( const osg::Vec3f&  start,
+                  const osg::Vec3f&  end,
+                  ModelIntersection& intersection ) const
+{
+    intersection = ModelIntersection();
+
+    bool hit = false;
+
+    for ( MeshMap::const_iterator
+              m = meshes.begin(),
+              mEnd = meshes.end();
+          m != mEnd; ++m )
+    {
+        for ( MeshesList::const_iterator
+                  mesh = m->second.begin(),
+                  meshEnd = m->second.end();
+              mesh != meshEnd; ++mesh )
+        {
+            const CoreMesh* cm = (*mesh)->getCoreMesh();
+
+            if ( cm->getBoneVolumes()->intersect( modelData.get(),
+                                                  cm->data.get(),
+                                                  cm->parameters->dualQuaternionSkinning,
+                                                  start, end,
+                                                  intersection ) )
+            {
+                intersection.mesh = *mesh;
+                hit = true;
+            }
+        }
+    }
+
+    return hit;
+}
+
+MemoryUsage
+Model::getMemoryUsage() const
+{
+    MemoryUsage mu;
+
+    CalModel* calModel = modelData->getCalModel();
+
+    mu.addCalModel( calModel );
+
+    // -- Scene graph --
+    mu.bytes[ MemoryUsage::SCENE_GRAPH ] += sizeof ( Model )
+        + sizeof ( ModelData )
+        + ( calModel->getSkeleton()->getVectorBone().size() + 1 )
+          * sizeof ( ModelData::BoneParams )
+        + rigidTransforms.size()
+          * ( sizeof ( osg::MatrixTransform ) + sizeof ( osg::Geode ) )
+        + ( geode.valid() ? sizeof ( osg::Geode ) : 0 );
+
+    for ( MeshMap::const_iterator
+              m = meshes.begin(),
+              mEnd = meshes.end();
+          m != mEnd; ++m )
+    {
+        for ( size_t i = 0; i < m->second.size(); i++ )
+        {
+            Mesh*           mesh = m->second[ i ];
+            const MeshData* data = mesh->getCoreMesh()->data.get();
+
+            mu.bytes[ MemoryUsage::SCENE_GRAPH ] +=
+                ( mesh->getCoreMesh()->parameters->software
+                  ? sizeof ( SoftwareMesh )
+                  : mesh->getCoreMesh()->batch.valid()
+                  ? sizeof ( BatchedMesh ) : sizeof ( HardwareMesh ) )
+                + ( mesh->getDepthMesh() ? sizeof ( DepthMesh ) : 0 );
+
+            // -- Deformed buffers (rigid meshes share MeshData ones) --
+            if ( mesh->getVertexArray() != data->vertexBuffer.get() )
+            {
+                mu.addBufferData( MemoryUsage::DEFORMED_BUFFERS,
+                                  mesh->getVertexArray() );
+            }
+
+            if ( mesh->getNormalArray()
+                 && mesh->getNormalArray() != data->normalBuffer.get() )
+            {
+                mu.addBufferData( MemoryUsage::DEFORMED_BUFFERS,
+                                  mesh->getNormalArray() );
+            }
+        }
+    }
+
+    for ( BatchesMap::const_iterator
+              b = batches.begin(),
+              bEnd = batches.end();
+          b != bEnd; ++b )
+    {
+        mu.bytes[ MemoryUsage::SCENE_GRAPH ] += sizeof ( HardwareMesh )
+            + ( b->second.drawable->getDepthMesh() ? sizeof ( DepthMesh ) : 0 );
+    }
+
+    return mu;
+}
+
 // -- MeshAdder --
 
 void
@@ -600,15 +873,48 @@ DefaultMeshAdder::add( Model* model,
 
 // -- ModelData --
 
+// same as in CalSpringSystem
+static
+osg::Vec3f
+defaultClothGravity( const CoreModel* cm )
+{
+    return osg::Vec3f( 0, 0, -98.1f ) * cm->getScale();
+}
+
+static
+osg::Vec3f
+defaultClothForce( const CoreModel* cm )
+{
+    return osg::Vec3f( 0, 0.5f, 0 ) * cm->getScale();
+}
+
 ModelData::ModelData( CoreModel* cm,
                       Model*     m )
     : coreModel( cm )
     , model( m )
     , updateForced( false )
+    , morphTargetWeights( cm->getMorphTargetsCount(), 0.0f )
+    , morphTargetsChanged( false )
+    , clothDeltaTime( 0 )
+    , clothGravity( defaultClothGravity( cm ) )
+    , clothForce( defaultClothForce( cm ) )
+    , clothCollision( true )
 {
     calModel = new CalModel( coreModel->getCalCoreModel() );
-    calModel->update( 0 );
-    calMixer = (CalMixer*)calModel->getAbstractMixer();
+
+    // CalModel deletes its mixer, but doesn't delete the previous
+    // one on setAbstractMixer
+    delete calModel->getAbstractMixer();
+    mixer = new Mixer( calModel );
+    mixer->setPoseCache( coreModel->getPoseCache() );
+    calModel->setAbstractMixer( mixer );
+
+    // No meshes are attached to calModel and we only use its
+    // skeleton and mixer, so we don't call calModel->update( 0 ),
+    // which also updates unused morph target mixer, physique and
+    // spring system.
+    mixer->updateAnimation( 0 );
+    mixer->updateSkeleton();
 
     const std::vector< CalBone* >& vectorBone = calModel->getSkeleton()->getVectorBone();
 
@@ -624,13 +930,107 @@ ModelData::ModelData( CoreModel* cm,
     {
         bp->bone = *b;
     }
+
+    // later updates check only bones dirtied by mixer
+    updateBones( false );
 }
 
 ModelData::~ModelData()
 {
+    releaseAnimations( true );
     delete calModel;
 }
 
+bool
+ModelData::reset()
+{
+    mixer->clear();
+    mixer->updateSkeleton(); // no animations => bind pose
+
+    updateForced = false;
+    clothDeltaTime = 0;
+    clothGravity = defaultClothGravity( coreModel.get() );
+    clothForce = defaultClothForce( coreModel.get() );
+    clothCollision = true;
+
+    releaseAnimations( true );
+
+    for ( size_t i = 0; i < morphTargetWeights.size(); i++ )
+    {
+        if ( morphTargetWeights[i] != 0.0f )
+        {
+            morphTargetWeights[i] = 0.0f;
+            morphTargetsChanged = true;
+        }
+    }
+
+    return update();
+}
+
+void
+ModelData::setMorphTargetWeight( int id,
+                                 float weight )
+    throw (std::runtime_error)
+{
+    if ( id < 0 || id >= (int)morphTargetWeights.size() )
+    {
+        throw std::runtime_error( "ModelData::setMorphTargetWeight() -- incorrect morph target id" );
+    }
+
+    if ( morphTargetWeights[ id ] != weight )
+    {
+        morphTargetWeights[ id ] = weight;
+        morphTargetsChanged = true;
+        updateForced = true;
+    }
+}
+
+void
+ModelData::requestAnimation( int id )
+{
+    AnimationStreamer* s = coreModel->getAnimationStreamer();
+
+    if ( s == 0 )
+    {
+        return;
+    }
+
+    s->request( id );
+
+    if ( std::find( pinnedAnimations.begin(), pinnedAnimations.end(), id )
+         == pinnedAnimations.end() )
+    {
+        s->pin( id );
+        pinnedAnimations.push_back( id );
+    }
+}
+
+void
+ModelData::releaseAnimations( bool all )
+{
+    if ( pinnedAnimations.empty() )
+    {
+        return;
+    }
+
+    AnimationStreamer* s = coreModel->getAnimationStreamer();
+
+    for ( std::vector< int >::iterator
+              id = pinnedAnimations.begin();
+          id != pinnedAnimations.end(); )
+    {
+        if ( !all && mixer->isPlaying( *id ) )
+        {
+            ++id;
+        }
+        else
+        {
+            s->unpin( *id );
+            id = pinnedAnimations.erase( id );
+        }
+    }
+}
+
 Model*
 ModelData::getModel()
     throw (std::runtime_error)
@@ -645,6 +1045,14 @@ ModelData::getModel()
     }
 }
 
+CalMixer*
+ModelData::getCalMixer()
+    throw (std::runtime_error)
+{
+    throw std::runtime_error( "ModelData::getCalMixer() -- CalMixer is replaced "
+                              "by osgCal::Mixer, use getMixer() instead" );
+}
+
 inline
 float
 square( float x )
@@ -655,25 +1063,55 @@ square( float x )
 bool
 ModelData::update( float deltaTime )
 {
-    // -- Update calMixer & skeleton --
+    // -- Streamed animations --
+    if ( coreModel->getAnimationStreamer() )
+    {
+        releaseAnimations( false );
+        coreModel->getAnimationStreamer()->update();
+    }
+
+    if ( coreModel->hasCloth() )
+    {
+        clothDeltaTime += deltaTime;
+    }
+
+    // -- Update mixer & skeleton --
     if ( !updateForced &&
-         //calMixer->getAnimationVector().size() == <total animations count>
-         calMixer->getAnimationActionList().size() == 0 &&
-         calMixer->getAnimationCycle().size() == 0 )
+         mixer->getActionsCount() == 0 &&
+         mixer->getCyclesCount() == 0 )
     {
-        return false; // no animations, nothing to update
+        // no animations, nothing to update (except cloth, which
+        // moves even on still skeleton)
+        return coreModel->hasCloth() ? update() : false;
     }
 
     updateForced = false;
-    calMixer->updateAnimation( deltaTime ); 
-    calMixer->updateSkeleton();
+    {
+        OSGCAL_PROFILE_SCOPE( MIXER_UPDATE_ANIMATION );
+        mixer->updateAnimation( deltaTime );
+    }
+    {
+        OSGCAL_PROFILE_SCOPE( MIXER_UPDATE_SKELETON );
+        mixer->updateSkeleton();
+    }
 
-    return update();
+    return updateBones( true );
 }
 
 bool
 ModelData::update()
 {
+    return updateBones( false );
+}
+
+bool
+ModelData::updateBones( bool dirtyOnly )
+{
+    OSGCAL_PROFILE_SCOPE( BONES_UPDATE );
+#ifdef OSGCAL_PROFILING
+    int changedCount = 0;
+#endif
+
     // -- Update bone parameters --
     bool anythingChanged = false;
     for ( BoneParamsVector::iterator
@@ -681,6 +1119,12 @@ ModelData::update()
               bEnd = bones.end() - 1;
           b < bEnd; ++b )
     {
+        if ( dirtyOnly && !mixer->isBoneDirty( b - bones.begin() ) )
+        {
+            b->changed = false;
+            continue;
+        }
+
         const CalQuaternion& rotation = b->bone->getRotationBoneSpace();
         const CalVector&     translation = b->bone->getTranslationBoneSpace();
         const CalMatrix&     rm = b->bone->getTransformMatrix();
@@ -722,8 +1166,12 @@ ModelData::update()
         {
             b->changed = true;
             anythingChanged = true;
+#ifdef OSGCAL_PROFILING
+            changedCount++;
+#endif
             b->rotation = r;
             b->translation = t;
+            b->dualQuaternion = DualQuaternion( r, t );
         }
         
 //         std::cout << "bone: " << b->bone->getCoreBone()->getName() << std::endl
@@ -742,5 +1190,13 @@ ModelData::update()
 //                   << std::endl;
     }
 
-    return anythingChanged;
+    OSGCAL_PROFILE_COUNT( BONES_CHANGED, changedCount );
+
+    // -- Move cloth colliders --
+    if ( getClothColliders() )
+    {
+        clothColliders.update( coreModel->getClothCapsules(), this );
+    }
+
+    return anythingChanged || morphTargetsChanged || coreModel->hasCloth();
 }
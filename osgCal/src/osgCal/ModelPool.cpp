@@ -0,0 +1,110 @@
+/* -*- c++ -*-
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <OpenThreads/ScopedLock>
+
+#include <osgCal/ModelPool>
+
+using namespace osgCal;
+
+ModelPool::ModelPool( CoreModel*      cm,
+                      BasicMeshAdder* ma,
+                      unsigned int    prewarmCount )
+    : coreModel( cm )
+    , meshAdder( ma )
+{
+    prewarm( prewarmCount );
+}
+
+ModelPool::~ModelPool()
+{
+}
+
+Model*
+ModelPool::load() const
+{
+    Model* model = new Model();
+    model->load( coreModel.get(), meshAdder.get() );
+    return model;
+}
+
+void
+ModelPool::prewarm( unsigned int count )
+{
+    unsigned int free = getNumFree();
+
+    // load outside of lock, it is the slow part
+    std::vector< osg::ref_ptr< Model > > models;
+    for ( ; free < count; free++ )
+    {
+        models.push_back( load() );
+    }
+
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+    freeModels.insert( freeModels.end(), models.begin(), models.end() );
+}
+
+Model*
+ModelPool::acquire()
+{
+    {
+        OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+        if ( !freeModels.empty() )
+        {
+            osg::ref_ptr< Model > model = freeModels.back();
+            freeModels.pop_back();
+            return model.release(); // unreferenced, as if just created
+        }
+    }
+
+    return load();
+}
+
+void
+ModelPool::release( Model* model )
+    throw (std::runtime_error)
+{
+    if ( model->getCoreModel() != coreModel.get() )
+    {
+        throw std::runtime_error( "ModelPool::release: model of different core model" );
+    }
+
+    osg::ref_ptr< Model > m( model ); // to not delete it when removing from parents
+
+    while ( m->getNumParents() > 0 )
+    {
+        m->getParent( 0 )->removeChild( m.get() );
+    }
+
+    m->reset();
+
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+    freeModels.push_back( m );
+}
+
+void
+ModelPool::clear()
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+    freeModels.clear();
+}
+
+unsigned int
+ModelPool::getNumFree() const
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+    return freeModels.size();
+}
@@ -0,0 +1,233 @@
+/* -*- c++ -*-
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <math.h>
+#include <algorithm>
+
+#include <OpenThreads/ScopedLock>
+
+#include <cal3d/coretrack.h>
+
+#include <osgCal/PoseCache>
+
+using namespace osgCal;
+
+void
+Pose::resize( int bonesCount )
+{
+    tx.assign( bonesCount, 0.0f );
+    ty.assign( bonesCount, 0.0f );
+    tz.assign( bonesCount, 0.0f );
+    qx.assign( bonesCount, 0.0f );
+    qy.assign( bonesCount, 0.0f );
+    qz.assign( bonesCount, 0.0f );
+    qw.assign( bonesCount, 0.0f );
+    weight.assign( bonesCount, 0.0f );
+}
+
+void
+Pose::clear()
+{
+    std::fill( tx.begin(), tx.end(), 0.0f );
+    std::fill( ty.begin(), ty.end(), 0.0f );
+    std::fill( tz.begin(), tz.end(), 0.0f );
+    std::fill( qx.begin(), qx.end(), 0.0f );
+    std::fill( qy.begin(), qy.end(), 0.0f );
+    std::fill( qz.begin(), qz.end(), 0.0f );
+    std::fill( qw.begin(), qw.end(), 0.0f );
+    std::fill( weight.begin(), weight.end(), 0.0f );
+}
+
+void
+Pose::copy( const Pose& p )
+{
+    std::copy( p.tx.begin(), p.tx.end(), tx.begin() );
+    std::copy( p.ty.begin(), p.ty.end(), ty.begin() );
+    std::copy( p.tz.begin(), p.tz.end(), tz.begin() );
+    std::copy( p.qx.begin(), p.qx.end(), qx.begin() );
+    std::copy( p.qy.begin(), p.qy.end(), qy.begin() );
+    std::copy( p.qz.begin(), p.qz.end(), qz.begin() );
+    std::copy( p.qw.begin(), p.qw.end(), qw.begin() );
+    std::copy( p.weight.begin(), p.weight.end(), weight.begin() );
+}
+
+PoseCache::Stats::Stats()
+    : hits( 0 )
+    , misses( 0 )
+{
+}
+
+PoseCache::PoseCache( float q,
+                      int   capacity )
+    : quantum( q )
+    , entries( std::max( capacity, 1 ) )
+{
+    for ( std::vector< Entry >::iterator
+              e = entries.begin(),
+              eEnd = entries.end();
+          e != eEnd; ++e )
+    {
+        e->key.animation = 0;
+    }
+}
+
+PoseCache::~PoseCache()
+{
+}
+
+float
+PoseCache::quantize( float time ) const
+{
+    if ( quantum <= 0.0f )
+    {
+        return time;
+    }
+
+    return floorf( time / quantum + 0.5f ) * quantum;
+}
+
+bool
+PoseCache::makeKey( CalCoreAnimation* animation,
+                    float             time,
+                    Key&              key ) const
+{
+    std::list< CalCoreTrack* >& tracks = animation->getListCoreTrack();
+
+    if ( quantum <= 0.0f
+         || tracks.empty() || tracks.front()->getCoreKeyframeCount() == 0 )
+    {
+        return false; // disabled or not loaded yet (streamed animation)
+    }
+
+    key.animation = animation;
+    key.quantumIndex = (int) floorf( time / quantum + 0.5f );
+    key.keyframesCount = tracks.front()->getCoreKeyframeCount();
+
+    return true;
+}
+
+PoseCache::Entry&
+PoseCache::getEntry( const Key& key )
+{
+    size_t h = ( (size_t) key.animation >> 4 ) * 2654435761u
+        ^ (size_t) key.quantumIndex * 40503u;
+
+    return entries[ h % entries.size() ];
+}
+
+bool
+PoseCache::find( CalCoreAnimation* animation,
+                 float             time,
+                 Pose&             pose )
+{
+    Key key;
+
+    if ( !makeKey( animation, time, key ) )
+    {
+        return false;
+    }
+
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    Entry& e = getEntry( key );
+
+    if ( e.key.animation != key.animation
+         || e.key.quantumIndex != key.quantumIndex
+         || e.key.keyframesCount != key.keyframesCount
+         || e.pose.weight.size() != pose.weight.size() )
+    {
+        stats.misses++;
+        return false;
+    }
+
+    stats.hits++;
+    pose.copy( e.pose );
+
+    return true;
+}
+
+void
+PoseCache::store( CalCoreAnimation* animation,
+                  float             time,
+                  const Pose&       pose )
+{
+    Key key;
+
+    if ( !makeKey( animation, time, key ) )
+    {
+        return;
+    }
+
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    Entry& e = getEntry( key );
+
+    e.key = key;
+
+    if ( e.pose.weight.size() != pose.weight.size() )
+    {
+        e.pose.resize( pose.weight.size() );
+    }
+
+    e.pose.copy( pose );
+}
+
+void
+PoseCache::clear()
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    for ( std::vector< Entry >::iterator
+              e = entries.begin(),
+              eEnd = entries.end();
+          e != eEnd; ++e )
+    {
+        e->key.animation = 0;
+    }
+}
+
+PoseCache::Stats
+PoseCache::getStats() const
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    return stats;
+}
+
+void
+PoseCache::resetStats()
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    stats = Stats();
+}
+
+size_t
+PoseCache::getMemoryUsage() const
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    size_t bytes = sizeof ( PoseCache ) + entries.capacity() * sizeof ( Entry );
+
+    for ( std::vector< Entry >::const_iterator
+              e = entries.begin(),
+              eEnd = entries.end();
+          e != eEnd; ++e )
+    {
+        bytes += e->pose.getBufferSize();
+    }
+
+    return bytes;
+}
@@ -0,0 +1,303 @@
+/* -*- c++ -*-
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <stdio.h>
+#include <vector>
+
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <osgCal/Profiler>
+
+using namespace osgCal;
+
+static const char* timingStatsNames[ Profiler::TIMINGS_COUNT ] =
+{
+    "osgCal model update time taken",
+    "osgCal mixer animation time taken",
+    "osgCal mixer skeleton time taken",
+    "osgCal bones update time taken",
+    "osgCal skinning time taken",
+    "osgCal bone uniforms time taken",
+    "osgCal display lists compile time taken",
+    "osgCal morphing time taken",
+    "osgCal cloth time taken",
+};
+
+// names without " time taken" for trace events
+static const char* timingTraceNames[ Profiler::TIMINGS_COUNT ] =
+{
+    "Model::update",
+    "CalMixer::updateAnimation",
+    "CalMixer::updateSkeleton",
+    "ModelData::update",
+    "Mesh::update skinning",
+    "bone uniforms",
+    "display list compile",
+    "Mesh::update morphing",
+    "Mesh::update cloth",
+};
+
+static const char* counterStatsNames[ Profiler::COUNTERS_COUNT ] =
+{
+    "osgCal models updated",
+    "osgCal bones changed",
+    "osgCal vertices skinned",
+    "osgCal draw calls",
+    "osgCal display lists compiled",
+    "osgCal bytes freed",
+    "osgCal feedback vertices skinned",
+    "osgCal vertices morphed",
+    "osgCal cloth particles",
+};
+
+struct TraceEvent
+{
+        int          timing; ///< -1 for counters event
+        osg::Timer_t start;
+        osg::Timer_t end;
+        int          threadId;
+        double       counters[ Profiler::COUNTERS_COUNT ];
+};
+
+/**
+ * All profiler state. It is created on first use to not depend on
+ * static initialization order.
+ */
+struct ProfilerData
+{
+        ProfilerData()
+            : tracing( false )
+            , traceStart( 0 )
+        {
+            reset();
+        }
+
+        void reset()
+        {
+            for ( int i = 0; i < Profiler::TIMINGS_COUNT; i++ )
+            {
+                times[ i ] = 0;
+            }
+            for ( int i = 0; i < Profiler::COUNTERS_COUNT; i++ )
+            {
+                counts[ i ] = 0;
+            }
+        }
+
+        OpenThreads::Mutex        mutex;
+        double                    times[ Profiler::TIMINGS_COUNT ]; ///< seconds
+        double                    counts[ Profiler::COUNTERS_COUNT ];
+
+        bool                      tracing;
+        osg::Timer_t              traceStart;
+        std::vector< TraceEvent > traceEvents;
+};
+
+static ProfilerData&
+profilerData()
+{
+    static ProfilerData data;
+    return data;
+}
+
+static int
+currentThreadId()
+{
+#ifdef _OPENMP
+    if ( omp_in_parallel() )
+    {
+        // OpenMP threads are not OpenThreads ones
+        return 1000 + omp_get_thread_num();
+    }
+#endif
+    OpenThreads::Thread* t = OpenThreads::Thread::CurrentThread();
+    return t ? t->getThreadId() : 0;
+}
+
+bool
+Profiler::isCompiledIn()
+{
+#ifdef OSGCAL_PROFILING
+    return true;
+#else
+    return false;
+#endif
+}
+
+const char*
+Profiler::getTimingStatsName( Timing t )
+{
+    return timingStatsNames[ t ];
+}
+
+const char*
+Profiler::getCounterStatsName( Counter c )
+{
+    return counterStatsNames[ c ];
+}
+
+void
+Profiler::addTime( Timing       t,
+                   osg::Timer_t start,
+                   osg::Timer_t end )
+{
+    ProfilerData& d = profilerData();
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( d.mutex );
+
+    d.times[ t ] += osg::Timer::instance()->delta_s( start, end );
+
+    if ( d.tracing )
+    {
+        TraceEvent e;
+        e.timing = t;
+        e.start = start;
+        e.end = end;
+        e.threadId = currentThreadId();
+        d.traceEvents.push_back( e );
+    }
+}
+
+void
+Profiler::addCount( Counter c,
+                    int     n )
+{
+    ProfilerData& d = profilerData();
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( d.mutex );
+
+    d.counts[ c ] += n;
+}
+
+void
+Profiler::recordFrame( osg::Stats*  stats,
+                       unsigned int frameNumber )
+{
+    ProfilerData& d = profilerData();
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( d.mutex );
+
+    if ( stats )
+    {
+        for ( int i = 0; i < TIMINGS_COUNT; i++ )
+        {
+            stats->setAttribute( frameNumber, timingStatsNames[ i ], d.times[ i ] );
+        }
+        for ( int i = 0; i < COUNTERS_COUNT; i++ )
+        {
+            stats->setAttribute( frameNumber, counterStatsNames[ i ], d.counts[ i ] );
+        }
+    }
+
+    if ( d.tracing )
+    {
+        TraceEvent e;
+        e.timing = -1;
+        e.start = e.end = osg::Timer::instance()->tick();
+        e.threadId = currentThreadId();
+        for ( int i = 0; i < COUNTERS_COUNT; i++ )
+        {
+            e.counters[ i ] = d.counts[ i ];
+        }
+        d.traceEvents.push_back( e );
+    }
+
+    d.reset();
+}
+
+void
+Profiler::startTrace()
+{
+    ProfilerData& d = profilerData();
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( d.mutex );
+
+    d.tracing = true;
+    d.traceStart = osg::Timer::instance()->tick();
+    d.traceEvents.clear();
+}
+
+bool
+Profiler::isTracing()
+{
+    ProfilerData& d = profilerData();
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( d.mutex );
+
+    return d.tracing;
+}
+
+bool
+Profiler::stopTrace( const std::string& fileName )
+{
+    std::vector< TraceEvent > events;
+    osg::Timer_t              traceStart;
+
+    {
+        ProfilerData& d = profilerData();
+        OpenThreads::ScopedLock< OpenThreads::Mutex > lock( d.mutex );
+
+        d.tracing = false;
+        events.swap( d.traceEvents );
+        traceStart = d.traceStart;
+    }
+
+    FILE* f = fopen( fileName.c_str(), "w" );
+
+    if ( !f )
+    {
+        return false;
+    }
+
+    const osg::Timer* timer = osg::Timer::instance();
+
+    fputs( "{\"traceEvents\":[\n", f );
+
+    for ( size_t i = 0; i < events.size(); i++ )
+    {
+        const TraceEvent& e = events[ i ];
+        const char* separator = ( i + 1 < events.size() ) ? ",\n" : "\n";
+
+        if ( e.timing >= 0 )
+        {
+            fprintf( f, "{\"name\":\"%s\",\"cat\":\"osgCal\",\"ph\":\"X\","
+                     "\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d}%s",
+                     timingTraceNames[ e.timing ],
+                     timer->delta_u( traceStart, e.start ),
+                     timer->delta_u( e.start, e.end ),
+                     e.threadId, separator );
+        }
+        else
+        {
+            fprintf( f, "{\"name\":\"osgCal counters\",\"cat\":\"osgCal\",\"ph\":\"C\","
+                     "\"ts\":%.3f,\"pid\":0,\"tid\":%d,\"args\":{",
+                     timer->delta_u( traceStart, e.start ), e.threadId );
+
+            for ( int j = 0; j < COUNTERS_COUNT; j++ )
+            {
+                fprintf( f, "%s\"%s\":%.0f", j ? "," : "",
+                         // skip "osgCal " prefix
+                         counterStatsNames[ j ] + 7, e.counters[ j ] );
+            }
+
+            fprintf( f, "}}%s", separator );
+        }
+    }
+
+    fputs( "]}\n", f );
+
+    return fclose( f ) == 0;
+}
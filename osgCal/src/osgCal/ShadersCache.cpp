@@ -15,11 +15,21 @@
    License along with this library; if not, write to the Free Software
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <osg/GLExtensions>
 #include <osg/Notify>
 #include <osg/observer_ptr>
+#include <OpenThreads/ScopedLock>
 
 #include <osgCal/ShadersCache>
 
+#ifndef GL_INTERLEAVED_ATTRIBS
+    #define GL_INTERLEAVED_ATTRIBS 0x8C8C
+#endif
+
 using namespace osgCal;
 
 int
@@ -61,6 +71,305 @@ osgCal::materialShaderFlags( const Material& material )
 }
 
 
+// -- Program binaries cache --
+
+/**
+ * FNV-1a hash, used to key program binaries files.
+ */
+static unsigned int
+hashString( const std::string& s,
+            unsigned int       hash = 2166136261u )
+{
+    for ( size_t i = 0; i < s.size(); i++ )
+    {
+        hash ^= (unsigned char)s[ i ];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static std::string&
+programBinariesDirectory()
+{
+    static std::string dir( getenv( "OSGCAL_PROGRAM_CACHE_DIR" )
+                            ? getenv( "OSGCAL_PROGRAM_CACHE_DIR" ) : "" );
+    return dir;
+}
+
+void
+ShadersCache::setProgramBinariesDirectory( const std::string& dir )
+{
+    programBinariesDirectory() = dir;
+}
+
+const std::string&
+ShadersCache::getProgramBinariesDirectory()
+{
+    return programBinariesDirectory();
+}
+
+/**
+ * Vendor, renderer and version of current context's driver.
+ * Binaries produced by one driver are not valid for another one.
+ */
+static std::string
+driverString()
+{
+    const char* vendor   = (const char*)glGetString( GL_VENDOR );
+    const char* renderer = (const char*)glGetString( GL_RENDERER );
+    const char* version  = (const char*)glGetString( GL_VERSION );
+
+    return std::string( vendor ? vendor : "" ) + "|"
+        + ( renderer ? renderer : "" ) + "|"
+        + ( version ? version : "" );
+}
+
+// binary file layout:
+//   char[8]      "OSGCALPB"
+//   int          PROGRAM_BINARY_FILE_VERSION
+//   int          flags
+//   unsigned int sourceHash
+//   GLenum       binary format
+//   int          driver string length, followed by string
+//   int          binary size, followed by binary data
+#define PROGRAM_BINARY_FILE_VERSION 1
+
+static const char programBinaryMagic[ 8 ] = { 'O','S','G','C','A','L','P','B' };
+
+struct ProgramBinaryFileCloser
+{
+        FILE* f;
+        ProgramBinaryFileCloser( FILE* f )
+            : f( f )
+        {}
+        ~ProgramBinaryFileCloser()
+        {
+            if ( f )
+            {
+                fclose( f );
+            }
+        }
+};
+
+static osg::Program::ProgramBinary*
+readProgramBinary( const std::string& fileName,
+                   int                flags,
+                   unsigned int       sourceHash,
+                   const std::string& driver )
+{
+    FILE* f = fopen( fileName.c_str(), "rb" );
+
+    if ( !f )
+    {
+        return 0;
+    }
+
+    ProgramBinaryFileCloser closer( f );
+
+    char         magic[ 8 ];
+    int          version;
+    int          fileFlags;
+    unsigned int fileSourceHash;
+    GLenum       format;
+    int          driverLength;
+
+    if (    fread( magic, sizeof( magic ), 1, f ) != 1
+         || memcmp( magic, programBinaryMagic, sizeof( magic ) ) != 0
+         || fread( &version, sizeof( version ), 1, f ) != 1
+         || version != PROGRAM_BINARY_FILE_VERSION
+         || fread( &fileFlags, sizeof( fileFlags ), 1, f ) != 1
+         || fileFlags != flags
+         || fread( &fileSourceHash, sizeof( fileSourceHash ), 1, f ) != 1
+         || fileSourceHash != sourceHash
+         || fread( &format, sizeof( format ), 1, f ) != 1
+         || fread( &driverLength, sizeof( driverLength ), 1, f ) != 1
+         || driverLength != (int)driver.size() )
+    {
+        return 0;
+    }
+
+    std::string fileDriver( driverLength, '\0' );
+    int         size;
+
+    if (    ( driverLength > 0
+              && fread( &fileDriver[ 0 ], driverLength, 1, f ) != 1 )
+         || fileDriver != driver
+         || fread( &size, sizeof( size ), 1, f ) != 1
+         || size <= 0 )
+    {
+        return 0;
+    }
+
+    osg::ref_ptr< osg::Program::ProgramBinary > binary =
+        new osg::Program::ProgramBinary;
+    binary->allocate( size );
+    binary->setFormat( format );
+
+    if ( fread( binary->getData(), size, 1, f ) != 1 )
+    {
+        return 0;
+    }
+
+    return binary.release();
+}
+
+static void
+writeProgramBinary( const std::string&                  fileName,
+                    int                                 flags,
+                    unsigned int                        sourceHash,
+                    const std::string&                  driver,
+                    const osg::Program::ProgramBinary*  binary )
+{
+    // write to temporary file and then rename it, so concurrently
+    // running applications never see partially written binaries
+    std::string tmpFileName = fileName + ".tmp";
+
+    {
+        FILE* f = fopen( tmpFileName.c_str(), "wb" );
+
+        if ( !f )
+        {
+            osg::notify( osg::WARN )
+                << "can't write program binary " << tmpFileName << std::endl;
+            return;
+        }
+
+        ProgramBinaryFileCloser closer( f );
+
+        int    version = PROGRAM_BINARY_FILE_VERSION;
+        GLenum format = binary->getFormat();
+        int    driverLength = driver.size();
+        int    size = binary->getSize();
+
+        if (    fwrite( programBinaryMagic, sizeof( programBinaryMagic ), 1, f ) != 1
+             || fwrite( &version, sizeof( version ), 1, f ) != 1
+             || fwrite( &flags, sizeof( flags ), 1, f ) != 1
+             || fwrite( &sourceHash, sizeof( sourceHash ), 1, f ) != 1
+             || fwrite( &format, sizeof( format ), 1, f ) != 1
+             || fwrite( &driverLength, sizeof( driverLength ), 1, f ) != 1
+             || ( driverLength > 0
+                  && fwrite( driver.data(), driverLength, 1, f ) != 1 )
+             || fwrite( &size, sizeof( size ), 1, f ) != 1
+             || fwrite( binary->getData(), size, 1, f ) != 1 )
+        {
+            osg::notify( osg::WARN )
+                << "can't write program binary " << tmpFileName << std::endl;
+            fclose( f );
+            closer.f = 0;
+            remove( tmpFileName.c_str() );
+            return;
+        }
+    }
+
+    remove( fileName.c_str() ); // rename() doesn't overwrite on win32
+    if ( rename( tmpFileName.c_str(), fileName.c_str() ) != 0 )
+    {
+        remove( tmpFileName.c_str() );
+    }
+}
+
+CachedProgram::CachedProgram( int          flags,
+                              unsigned int sourceHash )
+    : flags( flags )
+    , sourceHash( sourceHash )
+{
+}
+
+CachedProgram::CachedProgram( const CachedProgram&  program,
+                              const osg::CopyOp&    copyop )
+    : osg::Program( program, copyop )
+    , flags( program.flags )
+    , sourceHash( program.sourceHash )
+{
+}
+
+std::string
+CachedProgram::getBinaryFileName() const
+{
+    const std::string& dir = ShadersCache::getProgramBinariesDirectory();
+
+    if ( dir.empty() )
+    {
+        return "";
+    }
+
+    char fileName[ 64 ];
+    sprintf( fileName, "/program_%08x_%08x_%08x.bin",
+             flags, sourceHash, hashString( driverString() ) );
+
+    return dir + fileName;
+}
+
+void
+CachedProgram::compileGLObjects( osg::State& state ) const
+{
+    const std::string& dir = ShadersCache::getProgramBinariesDirectory();
+
+    if ( dir.empty()
+         || !state.get< osg::GLExtensions >()->isGetProgramBinarySupported )
+    {
+        osg::Program::compileGLObjects( state );
+        return;
+    }
+
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    int& lookedUp = binaryLookedUp[ state.getContextID() ];
+
+    if ( lookedUp )
+    {
+        // relinking after dirtyProgram(), binary (if any) is already set
+        osg::Program::compileGLObjects( state );
+        return;
+    }
+
+    lookedUp = 1;
+
+    std::string driver = driverString();
+    std::string path = getBinaryFileName();
+
+    CachedProgram* self = const_cast< CachedProgram* >( this );
+    // ^ program binary is a part of program's GL state,
+    // so we set it in const compileGLObjects() like osg does
+    // with its per context programs
+
+    osg::ref_ptr< ProgramBinary > binary =
+        readProgramBinary( path, flags, sourceHash, driver );
+
+    if ( binary.valid() )
+    {
+        self->setProgramBinary( binary.get() );
+        osg::Program::compileGLObjects( state );
+
+        if ( getPCP( state )->isLinked() )
+        {
+            return;
+        }
+
+        osg::notify( osg::NOTICE )
+            << "program binary " << path << " rejected by driver, relinking "
+            << getName() << std::endl;
+
+        self->setProgramBinary( 0 );
+        self->dirtyProgram();
+        remove( path.c_str() );
+    }
+
+    osg::Program::compileGLObjects( state );
+
+    if ( getPCP( state )->isLinked() )
+    {
+        binary = getPCP( state )->compileProgramBinary( state );
+
+        if ( binary.valid() && binary->getSize() > 0 )
+        {
+            writeProgramBinary( path, flags, sourceHash, driver, binary.get() );
+        }
+    }
+}
+
+
 ShadersCache::~ShadersCache()
 {
     osg::notify( osg::DEBUG_FP ) << "destroying ShadersCache... " << std::endl;
@@ -87,7 +396,11 @@ ShadersCache::get( int flags )
     // weight/matrixIndex arrays element size when constructing
     // display list, so no values for additional bones exists.
 
-    if ( flags & SHADER_FLAG_DEPTH_ONLY )
+    if ( flags & SHADER_FLAG_TRANSFORM_FEEDBACK )
+    {
+        flags &= TRANSFORM_FEEDBACK_MASK;
+    }
+    else if ( flags & SHADER_FLAG_DEPTH_ONLY )
     {
         flags &= DEPTH_ONLY_MASK; 
     }
@@ -111,16 +424,27 @@ ShadersCache::get( int flags )
         int BUMP_MAPPING = ( SHADER_FLAG_BUMP_MAPPING & flags ) ? 1 : 0; \
         int SHINING = ( SHADER_FLAG_SHINING & flags ) ? 1 : 0;          \
         int DEPTH_ONLY = ( SHADER_FLAG_DEPTH_ONLY & flags ) ? 1 : 0;    \
-        int TWO_SIDED = ( SHADER_FLAG_TWO_SIDED & flags ) ? 1 : 0
+        int TWO_SIDED = ( SHADER_FLAG_TWO_SIDED & flags ) ? 1 : 0;      \
+        int DUAL_QUATERNION = ( SHADER_FLAG_DUAL_QUATERNION & flags ) ? 1 : 0; \
+        int TRANSFORM_FEEDBACK = ( SHADER_FLAG_TRANSFORM_FEEDBACK & flags ) ? 1 : 0
         
         PARSE_FLAGS;
         (void)FOG; // remove unused variable warning
                 
-        osg::Program* p = new osg::Program;
+        osg::Shader* vs = getVertexShader( flags );
+        osg::Shader* fs = getFragmentShader( TRANSFORM_FEEDBACK
+                                             ? SHADER_FLAG_DEPTH_ONLY : flags );
+        // ^ nothing is rasterized when skinning to transform feedback buffer
+
+        osg::Program* p = new CachedProgram(
+            flags, hashString( vs->getShaderSource(),
+                               hashString( fs->getShaderSource() ) ) );
 
         char name[ 256 ];
-        sprintf( name, "skeletal shader (%d bones%s%s%s%s%s%s%s%s%s)",
+        sprintf( name, "skeletal shader (%d bones%s%s%s%s%s%s%s%s%s%s%s)",
                  BONES_COUNT,
+                 DUAL_QUATERNION ? ", dual quaternion" : "",
+                 TRANSFORM_FEEDBACK ? ", transform feedback" : "",
                  DEPTH_ONLY ? ", depth_only" : "",
                  (FOG_MODE == SHADER_FLAG_FOG_MODE_EXP ? ", fog_exp"
                   : (FOG_MODE == SHADER_FLAG_FOG_MODE_EXP2 ? ", fog_exp2"
@@ -137,8 +461,18 @@ ShadersCache::get( int flags )
         //p->setThreadSafeRefUnref( true );
         p->setName( name );
 
-        p->addShader( getVertexShader( flags ) );
-        p->addShader( getFragmentShader( flags ) );
+        p->addShader( vs );
+        p->addShader( fs );
+
+        if ( TRANSFORM_FEEDBACK )
+        {
+            // interleaved layout expected by HardwareMesh
+            p->addTransformFeedBackVarying( "skinnedPosition" );
+            p->addTransformFeedBackVarying( "skinnedNormal" );
+            p->addTransformFeedBackVarying( "skinnedTexCoord" );
+            p->addTransformFeedBackVarying( "skinnedTangent" );
+            p->setTransformFeedBackMode( GL_INTERLEAVED_ATTRIBS );
+        }
 
         //p->addBindAttribLocation( "position", 0 );
         // Attribute location binding is needed for ATI.
@@ -183,7 +517,11 @@ ShadersCache::getVertexShader( int flags )
 
         std::string shaderText;
 
-        if ( DEPTH_ONLY )
+        if ( TRANSFORM_FEEDBACK )
+        {
+            #include "shaders/SkeletalFeedback_vert.h"
+        }
+        else if ( DEPTH_ONLY )
         {
             #include "shaders/SkeletalDepthOnly_vert.h"
         }
@@ -205,7 +543,9 @@ ShadersCache::getFragmentShader( int flags )
 {
     flags &= ~SHADER_FLAG_BONES(0)
         & ~SHADER_FLAG_BONES(1) & ~SHADER_FLAG_BONES(2)
-        & ~SHADER_FLAG_BONES(3) & ~SHADER_FLAG_BONES(4);
+        & ~SHADER_FLAG_BONES(3) & ~SHADER_FLAG_BONES(4)
+        & ~SHADER_FLAG_DUAL_QUATERNION
+        & ~SHADER_FLAG_TRANSFORM_FEEDBACK;
     // remove irrelevant flags that can lead to
     // duplicate shaders in map  
 
@@ -218,7 +558,8 @@ ShadersCache::getFragmentShader( int flags )
     else
     {                
         PARSE_FLAGS;
-        (void)BONES_COUNT; // remove unused variable warning
+        (void)BONES_COUNT, (void)DUAL_QUATERNION, (void)TRANSFORM_FEEDBACK;
+        // remove unused variable warning
 
         std::string shaderText;
 
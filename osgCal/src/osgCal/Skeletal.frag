@@ -31,7 +31,8 @@ varying vec3 binormal;
 
 uniform float glossiness;
 
-#if TWO_SIDED == 1
+#if TWO_SIDED == 1 && ( OPACITY == 1 || RGBA == 1 )
+// transparent meshes are drawn in two passes (back faces first)
 uniform float frontFacing;
 #endif
 
@@ -60,12 +61,17 @@ void main()
     // precision errors on meshes with high glossiness, so we reverted to full precision.
 #endif
 
-#if TWO_SIDED == 1
-//    if ( !gl_FrontFacing ) // gl_FrontFacing is not always available,
+#if TWO_SIDED == 1 && ( OPACITY == 1 || RGBA == 1 )
     if ( frontFacing == 0.0 )
     {
         normal = -normal;
     }
+#elseif TWO_SIDED == 1
+    // opaque meshes are drawn in one pass without culling
+    if ( !gl_FrontFacing )
+    {
+        normal = -normal;
+    }
 #endif
     
 
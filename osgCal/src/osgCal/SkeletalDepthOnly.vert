@@ -4,12 +4,56 @@
 # define weight gl_MultiTexCoord2
 # define index  gl_MultiTexCoord3
 
+#if DUAL_QUATERNION
+// MAX_BONES_PER_MESH_DUAL_QUATERNION + 1 (identity) bones
+uniform vec4 realQuaternions[61];
+uniform vec4 dualQuaternions[61];
+#else
 uniform mat3 rotationMatrices[31];
 uniform vec3 translationVectors[31];
+#endif // DUAL_QUATERNION
 #endif
 void main()
 {
 #if BONES_COUNT >= 1
+#if DUAL_QUATERNION
+    vec4 realQuaternion = weight.x * realQuaternions[int(index.x)];
+    vec4 dualQuaternion = weight.x * dualQuaternions[int(index.x)];
+    // quaternions in the other hemisphere than the first one are
+    // negated, so blending goes by the shortest path
+    vec4 pivot = realQuaternions[int(index.x)];
+    float w;
+
+#if BONES_COUNT >= 2
+    w = dot( pivot, realQuaternions[int(index.y)] ) < 0.0 ? -weight.y : weight.y;
+    realQuaternion += w * realQuaternions[int(index.y)];
+    dualQuaternion += w * dualQuaternions[int(index.y)];
+
+#if BONES_COUNT >= 3
+    w = dot( pivot, realQuaternions[int(index.z)] ) < 0.0 ? -weight.z : weight.z;
+    realQuaternion += w * realQuaternions[int(index.z)];
+    dualQuaternion += w * dualQuaternions[int(index.z)];
+
+#if BONES_COUNT >= 4
+    w = dot( pivot, realQuaternions[int(index.w)] ) < 0.0 ? -weight.w : weight.w;
+    realQuaternion += w * realQuaternions[int(index.w)];
+    dualQuaternion += w * dualQuaternions[int(index.w)];
+#endif // BONES_COUNT >= 4
+#endif // BONES_COUNT >= 3
+#endif // BONES_COUNT >= 2
+
+    float len = length( realQuaternion );
+    vec3  r  = realQuaternion.xyz / len;
+    float rw = realQuaternion.w / len;
+    vec3  d  = dualQuaternion.xyz / len;
+    float dw = dualQuaternion.w / len;
+
+    mat3 totalRotation =
+        mat3( 1.0 - 2.0 * (r.y*r.y + r.z*r.z), 2.0 * (r.x*r.y + rw*r.z), 2.0 * (r.x*r.z - rw*r.y),
+              2.0 * (r.x*r.y - rw*r.z), 1.0 - 2.0 * (r.x*r.x + r.z*r.z), 2.0 * (r.y*r.z + rw*r.x),
+              2.0 * (r.x*r.z + rw*r.y), 2.0 * (r.y*r.z - rw*r.x), 1.0 - 2.0 * (r.x*r.x + r.y*r.y) );
+    vec3 totalTranslation = 2.0 * (rw * d - dw * r + cross( r, d ));
+#else
     mat3 totalRotation = weight.x * rotationMatrices[int(index.x)];
     vec3 totalTranslation = weight.x * translationVectors[int(index.x)];
     // can't use W*(M*V+TV) here due to precision problems
@@ -28,6 +72,7 @@ void main()
 #endif // BONES_COUNT >= 4
 #endif // BONES_COUNT >= 3
 #endif // BONES_COUNT >= 2
+#endif // DUAL_QUATERNION
 
     vec3 transformedPosition = totalRotation * gl_Vertex.xyz + totalTranslation;
     gl_Position = gl_ModelViewProjectionMatrix * vec4(transformedPosition, 1.0);
@@ -0,0 +1,105 @@
+// -*-c++-*-
+
+// Skinning only shader for transform feedback. Skinned model space
+// vertices are captured to a buffer once per update and then drawn
+// by all passes (depth, color, two-sided, etc.) with zero bones
+// shaders. Captured varyings layout (see HardwareMesh):
+//   skinnedPosition, skinnedNormal, skinnedTexCoord, skinnedTangent
+
+#if BONES_COUNT >= 1
+# define weight gl_MultiTexCoord2
+# define index  gl_MultiTexCoord3
+
+#if DUAL_QUATERNION
+// MAX_BONES_PER_MESH_DUAL_QUATERNION + 1 (identity) bones
+uniform vec4 realQuaternions[61];
+uniform vec4 dualQuaternions[61];
+#else
+uniform mat3 rotationMatrices[31];
+uniform vec3 translationVectors[31];
+#endif // DUAL_QUATERNION
+#endif
+
+varying vec3 skinnedPosition;
+varying vec3 skinnedNormal;
+varying vec2 skinnedTexCoord;
+varying vec4 skinnedTangent;
+
+void main()
+{
+#if BONES_COUNT >= 1
+#if DUAL_QUATERNION
+    vec4 realQuaternion = weight.x * realQuaternions[int(index.x)];
+    vec4 dualQuaternion = weight.x * dualQuaternions[int(index.x)];
+    // quaternions in the other hemisphere than the first one are
+    // negated, so blending goes by the shortest path
+    vec4 pivot = realQuaternions[int(index.x)];
+    float w;
+
+#if BONES_COUNT >= 2
+    w = dot( pivot, realQuaternions[int(index.y)] ) < 0.0 ? -weight.y : weight.y;
+    realQuaternion += w * realQuaternions[int(index.y)];
+    dualQuaternion += w * dualQuaternions[int(index.y)];
+
+#if BONES_COUNT >= 3
+    w = dot( pivot, realQuaternions[int(index.z)] ) < 0.0 ? -weight.z : weight.z;
+    realQuaternion += w * realQuaternions[int(index.z)];
+    dualQuaternion += w * dualQuaternions[int(index.z)];
+
+#if BONES_COUNT >= 4
+    w = dot( pivot, realQuaternions[int(index.w)] ) < 0.0 ? -weight.w : weight.w;
+    realQuaternion += w * realQuaternions[int(index.w)];
+    dualQuaternion += w * dualQuaternions[int(index.w)];
+#endif // BONES_COUNT >= 4
+#endif // BONES_COUNT >= 3
+#endif // BONES_COUNT >= 2
+
+    float len = length( realQuaternion );
+    vec3  r  = realQuaternion.xyz / len;
+    float rw = realQuaternion.w / len;
+    vec3  d  = dualQuaternion.xyz / len;
+    float dw = dualQuaternion.w / len;
+
+    mat3 totalRotation =
+        mat3( 1.0 - 2.0 * (r.y*r.y + r.z*r.z), 2.0 * (r.x*r.y + rw*r.z), 2.0 * (r.x*r.z - rw*r.y),
+              2.0 * (r.x*r.y - rw*r.z), 1.0 - 2.0 * (r.x*r.x + r.z*r.z), 2.0 * (r.y*r.z + rw*r.x),
+              2.0 * (r.x*r.z + rw*r.y), 2.0 * (r.y*r.z - rw*r.x), 1.0 - 2.0 * (r.x*r.x + r.y*r.y) );
+    vec3 totalTranslation = 2.0 * (rw * d - dw * r + cross( r, d ));
+#else
+    mat3 totalRotation = weight.x * rotationMatrices[int(index.x)];
+    vec3 totalTranslation = weight.x * translationVectors[int(index.x)];
+    // can't use W*(M*V+TV) here due to precision problems
+
+#if BONES_COUNT >= 2
+    totalRotation += weight.y * rotationMatrices[int(index.y)];
+    totalTranslation += weight.y * translationVectors[int(index.y)];
+
+#if BONES_COUNT >= 3
+    totalRotation += weight.z * rotationMatrices[int(index.z)];
+    totalTranslation += weight.z * translationVectors[int(index.z)];
+
+#if BONES_COUNT >= 4
+    totalRotation += weight.w * rotationMatrices[int(index.w)];
+    totalTranslation += weight.w * translationVectors[int(index.w)];
+#endif // BONES_COUNT >= 4
+#endif // BONES_COUNT >= 3
+#endif // BONES_COUNT >= 2
+#endif // DUAL_QUATERNION
+
+    skinnedPosition = totalRotation * gl_Vertex.xyz + totalTranslation;
+    skinnedNormal = totalRotation * gl_Normal;
+    skinnedTangent = vec4( totalRotation * gl_MultiTexCoord1.xyz, gl_MultiTexCoord1.w );
+
+#else // no bones
+
+    skinnedPosition = gl_Vertex.xyz;
+    skinnedNormal = gl_Normal;
+    skinnedTangent = gl_MultiTexCoord1;
+
+#endif // BONES_COUNT >= 1
+
+    skinnedTexCoord = gl_MultiTexCoord0.st;
+
+    // nothing is rasterized (GL_RASTERIZER_DISCARD)
+    gl_Position = vec4( skinnedPosition, 1.0 );
+}
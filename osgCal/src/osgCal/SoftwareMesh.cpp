@@ -20,6 +20,7 @@
 
 #include <osg/Notify>
 #include <osgCal/SoftwareMesh>
+#include <osgCal/Profiler>
 
 #include <iostream>
 
@@ -54,16 +55,9 @@ SoftwareMesh::SoftwareMesh( ModelData*      _modelData,
                                   "software meshes are for testing purpouses only" );
     }
     
-    if ( mesh->data->rigid )
-    {
-        setVertexArray( mesh->data->vertexBuffer.get() );
-        setNormalArray( mesh->data->normalBuffer.get() );
-    }
-    else
-    {
-        setVertexArray( (VertexBuffer*)mesh->data->vertexBuffer->clone( osg::CopyOp::DEEP_COPY_ALL ) );
-        setNormalArray( (NormalBuffer*)mesh->data->normalBuffer->clone( osg::CopyOp::DEEP_COPY_ALL ) );
-    }
+    setVertexArray( mesh->data->vertexBuffer.get() );
+    setNormalArray( mesh->data->normalBuffer.get() );
+    // ^ buffers are copied on first deformation (see update())
     setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
     setTexCoordArray( 0, const_cast< TexCoordBuffer* >( mesh->data->texCoordBuffer.get() ) );
 
@@ -131,7 +125,9 @@ SoftwareMesh::update()
     // them to correct data
     RTPair* rotationTranslationMatrices = (RTPair*)(void*)&rotationTranslationMatricesData;
 
-    bool changed = false;
+    bool changed = morph( true );
+    changed |= simulateCloth( true );
+    const bool dualQuaternion = mesh->parameters->dualQuaternionSkinning;
 
     for( int boneIndex = 0; boneIndex < mesh->data->getBonesCount(); boneIndex++ )
     {
@@ -140,6 +136,11 @@ SoftwareMesh::update()
 
         changed  |= bp.changed;
 
+        if ( dualQuaternion )
+        {
+            continue; // palette is set up in skinDualQuaternion
+        }
+
         RTPair& rt = rotationTranslationMatrices[ boneIndex ];
 
         rt.first  = bp.rotation;
@@ -152,6 +153,15 @@ SoftwareMesh::update()
         return; // no changes
     }
 
+    if ( dualQuaternion )
+    {
+        skinDualQuaternion( true );
+        dirtyDisplayList();
+        return;
+    }
+
+    makeDeformedBuffers( true );
+
     rotationTranslationMatrices[ 30 ] = // last always identity (see #68)
         std::make_pair( osg::Matrix3( 1, 0, 0,
                                       0, 1, 0,
@@ -159,12 +169,15 @@ SoftwareMesh::update()
                         osg::Vec3( 0, 0, 0 ) );
 
     // -- Scan indexes --
+    OSGCAL_PROFILE_SCOPE( SKINNING );
+    OSGCAL_PROFILE_COUNT( VERTICES_SKINNED, getVertexArray()->getNumElements() );
+
     boundingBox = osg::BoundingBox();
     
     VertexBuffer&               vb  = *(VertexBuffer*)getVertexArray();
     NormalBuffer&               nb  = *(NormalBuffer*)getNormalArray();
-    const VertexBuffer&         svb = *mesh->data->vertexBuffer.get();
-    const NormalBuffer&         snb = *mesh->data->normalBuffer.get();
+    const VertexBuffer&         svb = *getSourceVertexBuffer();
+    const NormalBuffer&         snb = *getSourceNormalBuffer();
     const WeightBuffer&         wb  = *mesh->data->weightBuffer.get();
     const MatrixIndexBuffer&    mib = *mesh->data->matrixIndexBuffer.get();
 
@@ -25,6 +25,7 @@
 //#include <osg/VertexProgram> // GL_VERTEX_PROGRAM_TWO_SIDE_ARB
 
 #include <osgDB/ReadFile>
+#include <osgDB/FileUtils>
 
 #include <osgCal/StateSetCache>
 
@@ -42,6 +43,16 @@ StateSetCache::StateSetCache()
                                                    texturesCache,
                                                    ShadersCache::instance() );
     depthMeshStateSetCache = new DepthMeshStateSetCache( ShadersCache::instance() );
+    shadersCache = ShadersCache::instance();
+}
+
+osg::Program*
+StateSetCache::getSkinningProgram( int  bonesCount,
+                                   bool dualQuaternionSkinning )
+{
+    return shadersCache->get( SHADER_FLAG_BONES( bonesCount )
+                              | SHADER_FLAG_TRANSFORM_FEEDBACK
+                              | ( dualQuaternionSkinning ? SHADER_FLAG_DUAL_QUATERNION : 0 ) );
 }
 
 static osg::observer_ptr< StateSetCache >  stateSetCache;
@@ -146,12 +157,30 @@ TexturesCache::get( const TextureDesc& td )
     return getOrCreate< Map, TexturesCache >( cache, td, this, &TexturesCache::createTexture );
 }
 
+std::string
+TexturesCache::cacheFileName( const TextureDesc& td )
+{
+    return td + ".cache.dds";
+}
+
 osg::Texture2D*
 TexturesCache::createTexture( const TextureDesc& fileName )
     throw ( std::runtime_error )
 {
 //    std::cout << "load texture: " << fileName << std::endl;
-    osg::Image* img = osgDB::readImageFile( fileName );
+    osg::Image* img = 0;
+
+    // as with meshes cache we don't check file dates, rerun
+    // osgCalTexturesCache after textures change
+    if ( osgDB::fileExists( cacheFileName( fileName ) ) )
+    {
+        img = osgDB::readImageFile( cacheFileName( fileName ) );
+    }
+
+    if ( !img )
+    {
+        img = osgDB::readImageFile( fileName );
+    }
     //img->setThreadSafeRefUnref( true );
 
     if ( !img )
@@ -192,7 +221,9 @@ isRGBAStateSet( const osg::StateSet* stateSet )
     return ( texture && 
 //               ( osg::Image::computeNumComponents( texture->getInternalFormat() ) == 4 )
              (    texture->getInternalFormat() == 4
-               || texture->getInternalFormat() == GL_RGBA )
+               || texture->getInternalFormat() == GL_RGBA
+               || texture->getInternalFormat() == GL_COMPRESSED_RGBA_S3TC_DXT3_EXT
+               || texture->getInternalFormat() == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT )
         );
 }
 
@@ -386,7 +417,9 @@ bool osgCal::operator < ( const HwMeshStateSetCache::HWKey& k1,
                lt( k1.fogMode,
                    k2.fogMode,
                    lt( k1.useDepthFirstMesh,
-                       k2.useDepthFirstMesh, false )));
+                       k2.useDepthFirstMesh,
+                       lt( k1.dualQuaternionSkinning,
+                           k2.dualQuaternionSkinning, false ))));
     
 }
 
@@ -407,7 +440,9 @@ HwMeshStateSetCache::get( const MKey& swsd,
                         std::make_pair( swsd,
                                         HWKey( bonesCount,
                                                p->fogMode,
-                                               p->useDepthFirstMesh ) ),
+                                               p->useDepthFirstMesh,
+                                               p->dualQuaternionSkinning
+                                               && bonesCount > 0 ) ),
                         this,
                         &HwMeshStateSetCache::createHwMeshStateSet );
 }
@@ -438,6 +473,8 @@ HwMeshStateSetCache::createHwMeshStateSet( const Key& matAndBones )
                                         |
                                         SHADER_FLAG_BONES( params.bonesCount )
                                         |
+                                        params.dualQuaternionSkinning * SHADER_FLAG_DUAL_QUATERNION
+                                        |
                                         fogFlags
                                         |
                                         rgba * SHADER_FLAG_RGBA
@@ -446,6 +483,16 @@ HwMeshStateSetCache::createHwMeshStateSet( const Key& matAndBones )
                                         ),
                                     osg::StateAttribute::ON );
 
+    if ( twoSided && !transparent )
+    {
+        // opaque two-sided mesh is drawn in one pass, shader flips
+        // back faces normals using gl_FrontFacing (transparent
+        // meshes still need two passes to draw back faces first)
+        stateSet->setAttributeAndModes( stateAttributes.backFaceCulling.get(),
+                                        osg::StateAttribute::OFF |
+                                        osg::StateAttribute::PROTECTED );
+    }
+
     stateSet->addUniform( newFloatUniform( "glossiness", material->glossiness ) );
 
     // -- setup normals map --
@@ -499,24 +546,28 @@ HwMeshStateSetCache::createHwMeshStateSet( const Key& matAndBones )
 
 osg::StateSet*
 DepthMeshStateSetCache::get( const Material* m,
-                             int bonesCount )
+                             int bonesCount,
+                             bool dualQuaternionSkinning )
 {
-    return getOrCreate< Map, DepthMeshStateSetCache >( cache, std::make_pair( bonesCount, m->sides ), this,
+    int bonesFlags = SHADER_FLAG_BONES( bonesCount )
+        | ( dualQuaternionSkinning && bonesCount > 0 ? SHADER_FLAG_DUAL_QUATERNION : 0 );
+
+    return getOrCreate< Map, DepthMeshStateSetCache >( cache, std::make_pair( bonesFlags, m->sides ), this,
                         &DepthMeshStateSetCache::createDepthMeshStateSet );
 }
 
 osg::StateSet*
-DepthMeshStateSetCache::createDepthMeshStateSet( const std::pair< int, int >& boneAndSidesCount )
+DepthMeshStateSetCache::createDepthMeshStateSet( const std::pair< int, int >& bonesFlagsAndSidesCount )
 {
     osg::StateSet* stateSet = new osg::StateSet();
 
     stateSet->setAttributeAndModes( shadersCache->get(
-                                        SHADER_FLAG_BONES( boneAndSidesCount.first )
+                                        bonesFlagsAndSidesCount.first
                                         +
                                         SHADER_FLAG_DEPTH_ONLY ),
                                     osg::StateAttribute::ON );
     // -- setup sidedness --
-    switch ( boneAndSidesCount.second )
+    switch ( bonesFlagsAndSidesCount.second )
     {
         case 1:
             // one sided mesh -- force backface culling
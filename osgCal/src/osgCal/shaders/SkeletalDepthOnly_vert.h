@@ -4,12 +4,56 @@ if ( BONES_COUNT >= 1 ) {
 shaderText += "# define weight gl_MultiTexCoord2\n";
 shaderText += "# define index  gl_MultiTexCoord3\n";
 shaderText += "\n";
+if ( DUAL_QUATERNION ) {
+shaderText += "// MAX_BONES_PER_MESH_DUAL_QUATERNION + 1 (identity) bones\n";
+shaderText += "uniform vec4 realQuaternions[61];\n";
+shaderText += "uniform vec4 dualQuaternions[61];\n";
+} else {
 shaderText += "uniform mat3 rotationMatrices[31];\n";
 shaderText += "uniform vec3 translationVectors[31];\n";
+} // DUAL_QUATERNION
 }
 shaderText += "void main()\n";
 shaderText += "{\n";
 if ( BONES_COUNT >= 1 ) {
+if ( DUAL_QUATERNION ) {
+shaderText += "    vec4 realQuaternion = weight.x * realQuaternions[int(index.x)];\n";
+shaderText += "    vec4 dualQuaternion = weight.x * dualQuaternions[int(index.x)];\n";
+shaderText += "    // quaternions in the other hemisphere than the first one are\n";
+shaderText += "    // negated, so blending goes by the shortest path\n";
+shaderText += "    vec4 pivot = realQuaternions[int(index.x)];\n";
+shaderText += "    float w;\n";
+shaderText += "\n";
+if ( BONES_COUNT >= 2 ) {
+shaderText += "    w = dot( pivot, realQuaternions[int(index.y)] ) < 0.0 ? -weight.y : weight.y;\n";
+shaderText += "    realQuaternion += w * realQuaternions[int(index.y)];\n";
+shaderText += "    dualQuaternion += w * dualQuaternions[int(index.y)];\n";
+shaderText += "\n";
+if ( BONES_COUNT >= 3 ) {
+shaderText += "    w = dot( pivot, realQuaternions[int(index.z)] ) < 0.0 ? -weight.z : weight.z;\n";
+shaderText += "    realQuaternion += w * realQuaternions[int(index.z)];\n";
+shaderText += "    dualQuaternion += w * dualQuaternions[int(index.z)];\n";
+shaderText += "\n";
+if ( BONES_COUNT >= 4 ) {
+shaderText += "    w = dot( pivot, realQuaternions[int(index.w)] ) < 0.0 ? -weight.w : weight.w;\n";
+shaderText += "    realQuaternion += w * realQuaternions[int(index.w)];\n";
+shaderText += "    dualQuaternion += w * dualQuaternions[int(index.w)];\n";
+} // BONES_COUNT >= 4
+} // BONES_COUNT >= 3
+} // BONES_COUNT >= 2
+shaderText += "\n";
+shaderText += "    float len = length( realQuaternion );\n";
+shaderText += "    vec3  r  = realQuaternion.xyz / len;\n";
+shaderText += "    float rw = realQuaternion.w / len;\n";
+shaderText += "    vec3  d  = dualQuaternion.xyz / len;\n";
+shaderText += "    float dw = dualQuaternion.w / len;\n";
+shaderText += "\n";
+shaderText += "    mat3 totalRotation =\n";
+shaderText += "        mat3( 1.0 - 2.0 * (r.y*r.y + r.z*r.z), 2.0 * (r.x*r.y + rw*r.z), 2.0 * (r.x*r.z - rw*r.y),\n";
+shaderText += "              2.0 * (r.x*r.y - rw*r.z), 1.0 - 2.0 * (r.x*r.x + r.z*r.z), 2.0 * (r.y*r.z + rw*r.x),\n";
+shaderText += "              2.0 * (r.x*r.z + rw*r.y), 2.0 * (r.y*r.z - rw*r.x), 1.0 - 2.0 * (r.x*r.x + r.y*r.y) );\n";
+shaderText += "    vec3 totalTranslation = 2.0 * (rw * d - dw * r + cross( r, d ));\n";
+} else {
 shaderText += "    mat3 totalRotation = weight.x * rotationMatrices[int(index.x)];\n";
 shaderText += "    vec3 totalTranslation = weight.x * translationVectors[int(index.x)];\n";
 shaderText += "    // can't use W*(M*V+TV) here due to precision problems\n";
@@ -28,6 +72,7 @@ shaderText += "    totalTranslation += weight.w * translationVectors[int(index.w
 } // BONES_COUNT >= 4
 } // BONES_COUNT >= 3
 } // BONES_COUNT >= 2
+} // DUAL_QUATERNION
 shaderText += "\n";
 shaderText += "    vec3 transformedPosition = totalRotation * gl_Vertex.xyz + totalTranslation;\n";
 shaderText += "    gl_Position = gl_ModelViewProjectionMatrix * vec4(transformedPosition, 1.0);\n";
@@ -31,7 +31,8 @@ shaderText += "varying vec3 binormal;\n";
 shaderText += "\n";
 shaderText += "uniform float glossiness;\n";
 shaderText += "\n";
-if ( TWO_SIDED == 1 ) {
+if ( TWO_SIDED == 1 && ( OPACITY == 1 || RGBA == 1 ) ) {
+shaderText += "// transparent meshes are drawn in two passes (back faces first)\n";
 shaderText += "uniform float frontFacing;\n";
 }
 shaderText += "\n";
@@ -60,12 +61,17 @@ shaderText += "    // We previously calculated lighting in half precision too, b
 shaderText += "    // precision errors on meshes with high glossiness, so we reverted to full precision.\n";
 }
 shaderText += "\n";
-if ( TWO_SIDED == 1 ) {
-shaderText += "//    if ( !gl_FrontFacing ) // gl_FrontFacing is not always available,\n";
+if ( TWO_SIDED == 1 && ( OPACITY == 1 || RGBA == 1 ) ) {
 shaderText += "    if ( frontFacing == 0.0 )\n";
 shaderText += "    {\n";
 shaderText += "        normal = -normal;\n";
 shaderText += "    }\n";
+} else if ( TWO_SIDED == 1 ) {
+shaderText += "    // opaque meshes are drawn in one pass without culling\n";
+shaderText += "    if ( !gl_FrontFacing )\n";
+shaderText += "    {\n";
+shaderText += "        normal = -normal;\n";
+shaderText += "    }\n";
 }
 shaderText += "    \n";
 shaderText += "\n";